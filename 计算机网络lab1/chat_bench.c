@@ -0,0 +1,577 @@
+/**
+ * Relay-path microbenchmark for the chat protocol.
+ *
+ * Compares what the server does to relay one received MSG_MESSAGE into a
+ * lobby frame, in both formats as the lobby history needs by default:
+ *   struct - deserialize into a ChatMessage, then frame_create
+ *   view   - parse a ChatMessageView in place, then frame_create_relay
+ * and reports time and bytes written per relayed message. Before that it
+ * times the codec on its own across message sizes: serialize, deserialize
+ * into a ChatMessage, and splitting a receive buffer into frames the way
+ * the server's read loop used to (frame_length plus parse_message_view),
+ * then the same buffers through framing_split and framing_view on each
+ * code path the CPU supports, in GB/s of received bytes.
+ * Whether the server's relay path calls the allocator is checked by
+ * chat_alloc_check, which runs the server itself.
+ * Optionally it also measures the relay with the message log on (--log)
+ * and search latency over a synthetic corpus (--search).
+ *
+ * Build: gcc -O2 chat_bench.c chat_protocol.c chat_framing.c chat_frame.c chat_log.c chat_logger.c chat_search.c -o chat_bench -lws2_32
+ * Usage: chat_bench [iterations] [--log DIR] [--search MESSAGES]
+ */
+
+#include "chat_protocol.h"
+#include "chat_frame.h"
+#include "chat_framing.h"
+#include "chat_log.h"
+#include "chat_search.h"
+
+#define DEFAULT_ITERATIONS 200000
+#define SEARCH_VOCABULARY 50000          // Distinct English words in the corpus
+#define SEARCH_HAN_CHARS 3000            // Distinct Chinese characters
+#define SEARCH_QUERIES 2000
+#define CODEC_BATCH 64                   // Frames per receive buffer when splitting
+#define SPLIT_ROUNDS 3                   // Best of this many runs per splitting result
+
+typedef struct {
+    const char *name;
+    MessageType type;
+    int content_length;
+} BenchCase;
+
+static const BenchCase bench_cases[] = {
+    { "list (empty)", MSG_LIST, 0 },
+    { "chat 32 B", MSG_MESSAGE, 32 },
+    { "chat 1 KB", MSG_MESSAGE, 1024 }
+};
+
+static const int codec_sizes[] = { 0, 32, 256, 1024, MAX_MESSAGE_LEN - 1 };
+
+static volatile int bench_sink;  // Keeps results observable to the optimizer
+
+static double now_ns(void) {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e9 / (double)frequency.QuadPart;
+}
+
+/**
+ * Build one received frame for a case in the given wire format
+ */
+static int build_frame(const BenchCase *bench, ProtocolVersion proto, char *buffer, size_t size) {
+    ChatMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = bench->type;
+    get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    strcpy(msg.username, "bench_user");
+    memset(msg.content, 'x', bench->content_length);
+    msg.content_length = bench->content_length;
+    
+    if (proto == PROTO_BINARY) {
+        return serialize_message_v2(&msg, buffer, size);
+    }
+    
+    int len = serialize_message(&msg, buffer, size - 1);
+    if (len < 0) return -1;
+    buffer[len++] = '\n';
+    return len;
+}
+
+/**
+ * Bytes written into a relayed frame, across the formats it carries
+ */
+static long long frame_bytes(const Frame *frame) {
+    long long bytes = 0;
+    for (int proto = 0; proto < PROTO_COUNT; proto++) bytes += frame->len[proto];
+    return bytes;
+}
+
+/**
+ * Old relay path: decode into a ChatMessage, which deserialize clears
+ * and fills, and build the frame from it. Returns bytes written.
+ */
+static long long relay_struct(char *frame, int frame_len, ProtocolVersion proto) {
+    ChatMessage msg;
+    if (proto == PROTO_BINARY) {
+        if (deserialize_message_v2(frame, frame_len, &msg) != 0) return -1;
+    } else {
+        frame[frame_len - 1] = '\0';
+        int result = deserialize_message(frame, &msg);
+        frame[frame_len - 1] = '\n';
+        if (result != 0) return -1;
+    }
+    
+    Frame *relayed = frame_create(&msg);
+    if (relayed == NULL) return -1;
+    long long bytes = (long long)sizeof(msg) + frame_bytes(relayed);
+    frame_release(relayed);
+    return bytes;
+}
+
+/**
+ * Current relay path: borrowed view encoded straight into the frame, in
+ * the formats the server asks for when the lobby history is on (see
+ * relay_formats). Returns bytes written.
+ */
+static long long relay_view(const char *frame, int frame_len) {
+    ChatMessageView view;
+    if (parse_message_view(frame, frame_len, &view) != 0) return -1;
+    
+    Frame *relayed = frame_create_relay(&view, ALL_FORMATS);
+    if (relayed == NULL) return -1;
+    long long bytes = frame_bytes(relayed);
+    frame_release(relayed);
+    return bytes;
+}
+
+static void run_case(const BenchCase *bench, ProtocolVersion proto, int iterations) {
+    char frame[MAX_BUFFER_SIZE];
+    int frame_len = build_frame(bench, proto, frame, sizeof(frame));
+    if (frame_len < 0) {
+        printf("%-14s v%d  failed to build frame\n", bench->name, proto + 1);
+        return;
+    }
+    
+    long long struct_bytes = 0;
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        struct_bytes += relay_struct(frame, frame_len, proto);
+    }
+    double struct_ns = (now_ns() - start) / iterations;
+    
+    long long view_bytes = 0;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        view_bytes += relay_view(frame, frame_len);
+    }
+    double view_ns = (now_ns() - start) / iterations;
+    
+    printf("%-14s v%d  %6d  %10.1f  %10lld  %10.1f  %10lld\n",
+        bench->name, proto + 1, frame_len,
+        struct_ns, struct_bytes / iterations,
+        view_ns, view_bytes / iterations);
+}
+
+/**
+ * Bytes written by deserialize into a ChatMessage: the memset plus the
+ * fields copied into it
+ */
+static long long deserialize_bytes(const ChatMessage *msg) {
+    return (long long)sizeof(ChatMessage) + strlen(msg->timestamp) + strlen(msg->username) + msg->content_length;
+}
+
+/**
+ * Time serialize, deserialize and receive-buffer splitting for one
+ * content size in one format. Splitting copies nothing, so only its time
+ * is reported.
+ */
+static void run_codec_case(int content_length, ProtocolVersion proto, int iterations) {
+    static char batch[CODEC_BATCH * MAX_BUFFER_SIZE];
+    static ChatMessage msg;
+    ChatMessage parsed;
+    char frame[MAX_BUFFER_SIZE];
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_MESSAGE;
+    get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    strcpy(msg.username, "bench_user");
+    memset(msg.content, 'x', content_length);
+    msg.content_length = content_length;
+    
+    // Serialize (v1 without the "\n", which the sender appends)
+    int frame_len = 0;
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        frame_len = proto == PROTO_BINARY
+            ? serialize_message_v2(&msg, frame, sizeof(frame))
+            : serialize_message(&msg, frame, sizeof(frame));
+        if (frame_len < 0) break;
+        bench_sink += frame[frame_len - 1];
+    }
+    double serialize_ns = (now_ns() - start) / iterations;
+    if (frame_len < 0) {
+        printf("%7d v%d  failed to serialize\n", content_length, proto + 1);
+        return;
+    }
+    
+    long long deserialize_total = 0;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        int result = proto == PROTO_BINARY
+            ? deserialize_message_v2(frame, frame_len, &parsed)
+            : deserialize_message(frame, &parsed);
+        if (result != 0) {
+            printf("%7d v%d  failed to deserialize\n", content_length, proto + 1);
+            return;
+        }
+        deserialize_total += deserialize_bytes(&parsed);
+    }
+    double deserialize_ns = (now_ns() - start) / iterations;
+    
+    // A receive buffer of back-to-back frames, as one large recv returns them
+    int serialized_len = frame_len;
+    if (proto == PROTO_TEXT) {
+        frame[frame_len++] = '\n';
+    }
+    for (int i = 0; i < CODEC_BATCH; i++) {
+        memcpy(batch + (size_t)i * frame_len, frame, frame_len);
+    }
+    size_t batch_len = (size_t)CODEC_BATCH * frame_len;
+    
+    int split = 0;
+    start = now_ns();
+    while (split < iterations) {
+        size_t pos = 0;
+        while (pos < batch_len) {
+            ChatMessageView view;
+            int len = frame_length(batch + pos, batch_len - pos);
+            if (len <= 0 || parse_message_view(batch + pos, len, &view) != 0) {
+                printf("%7d v%d  failed to split\n", content_length, proto + 1);
+                return;
+            }
+            bench_sink += view.content_length;
+            pos += len;
+            split++;
+        }
+    }
+    double split_ns = (now_ns() - start) / split;
+    
+    printf("%7d v%d  %6d  %8.1f  %6d  %8.1f  %6lld  %8.1f\n",
+        content_length, proto + 1, frame_len,
+        serialize_ns, serialized_len,
+        deserialize_ns, deserialize_total / iterations, split_ns);
+}
+
+/**
+ * Split a receive buffer of back-to-back frames and parse every frame,
+ * until at least `frames` have been handled. Returns GB/s, or 0 if a
+ * frame fails to parse.
+ */
+static double split_once(const char *batch, int batch_len, int frames, int framing) {
+    long long bytes = 0;
+    int split = 0;
+    double start = now_ns();
+    while (split < frames) {
+        if (framing) {
+            FrameBatch spans;
+            int pos = 0;
+            while (pos < batch_len) {
+                framing_split(batch + pos, batch_len - pos, &spans);
+                if (spans.count == 0) return 0;
+                for (int i = 0; i < spans.count; i++) {
+                    ChatMessageView view;
+                    if (framing_view(batch + pos, &spans.spans[i], &view) != 0) return 0;
+                    bench_sink += view.content_length;
+                }
+                split += spans.count;
+                pos += spans.consumed;
+            }
+        } else {
+            int pos = 0;
+            while (pos < batch_len) {
+                ChatMessageView view;
+                int len = frame_length(batch + pos, batch_len - pos);
+                if (len <= 0 || parse_message_view(batch + pos, len, &view) != 0) return 0;
+                bench_sink += view.content_length;
+                pos += len;
+                split++;
+            }
+        }
+        bytes += batch_len;
+    }
+    return bytes / (now_ns() - start);
+}
+
+static double split_throughput(const char *batch, int batch_len, int frames, int framing) {
+    double best = 0;
+    for (int round = 0; round < SPLIT_ROUNDS; round++) {
+        double rate = split_once(batch, batch_len, frames, framing);
+        if (rate == 0) return 0;
+        if (rate > best) best = rate;
+    }
+    return best;
+}
+
+/**
+ * Splitting throughput of one frame size, per-frame memchr against each
+ * framing_split code path
+ */
+static void run_split_case(int content_length, ProtocolVersion proto, int iterations) {
+    static char batch[CODEC_BATCH * MAX_BUFFER_SIZE];
+    ChatMessage msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_MESSAGE;
+    get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    strcpy(msg.username, "bench_user");
+    memset(msg.content, 'x', content_length);
+    msg.content_length = content_length;
+    
+    int frame_len = proto == PROTO_BINARY
+        ? serialize_message_v2(&msg, batch, MAX_BUFFER_SIZE)
+        : serialize_message(&msg, batch, MAX_BUFFER_SIZE - 1);
+    if (frame_len < 0) return;
+    if (proto == PROTO_TEXT) {
+        batch[frame_len++] = '\n';
+    }
+    for (int i = 1; i < CODEC_BATCH; i++) {
+        memcpy(batch + (size_t)i * frame_len, batch, frame_len);
+    }
+    int batch_len = CODEC_BATCH * frame_len;
+    
+    printf("%7d v%d  %6d  %8.2f", content_length, proto + 1, frame_len,
+        split_throughput(batch, batch_len, iterations, 0));
+    for (int path = 0; path < FRAMING_PATH_COUNT; path++) {
+        if (framing_use_path((FramingPath)path) != 0) {
+            printf("  %8s", "-");
+            continue;
+        }
+        printf("  %8.2f", split_throughput(batch, batch_len, iterations, 1));
+    }
+    printf("\n");
+    framing_use_path(framing_best_path());
+}
+
+/**
+ * Server relay of one message (view, shared frame) without and with
+ * log_append, as the server does for a logged lobby message
+ */
+static void run_log_case(const BenchCase *bench, int iterations) {
+    char frame[MAX_BUFFER_SIZE];
+    int frame_len = build_frame(bench, PROTO_BINARY, frame, sizeof(frame));
+    if (frame_len < 0) return;
+    
+    double elapsed[2];
+    for (int logged = 0; logged < 2; logged++) {
+        double start = now_ns();
+        for (int i = 0; i < iterations; i++) {
+            ChatMessageView view;
+            if (parse_message_view(frame, frame_len, &view) != 0) return;
+            Frame *relayed = frame_create_relay(&view, ALL_FORMATS);
+            if (relayed == NULL) return;
+            if (logged) log_append(relayed);
+            frame_release(relayed);
+        }
+        elapsed[logged] = (now_ns() - start) / iterations;
+    }
+    
+    printf("%-14s %6d  %10.1f  %10.1f  %+7.1f%%\n", bench->name, frame_len,
+        elapsed[0], elapsed[1], (elapsed[1] - elapsed[0]) * 100.0 / elapsed[0]);
+}
+
+static unsigned long long bench_random(void) {
+    // xorshift64, fixed seed so runs are comparable
+    static unsigned long long state = 88172645463325252ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/**
+ * Rank in [0, n), heavily skewed to small ranks like word frequencies
+ */
+static int skewed_rank(int n) {
+    return (int)(bench_random() % (bench_random() % n + 1));
+}
+
+static int append_word(char *out, int rank) {
+    // Deterministic made-up word of 3-9 letters for each rank
+    unsigned int h = (unsigned int)rank * 2654435761u + 12345u;
+    int len = 3 + (int)(h % 7);
+    for (int i = 0; i < len; i++) {
+        h = h * 1103515245u + 12345u;
+        out[i] = (char)('a' + (h >> 16) % 26);
+    }
+    return len;
+}
+
+static int append_han(char *out, int rank) {
+    // UTF-8 of a character in the CJK unified ideographs block
+    unsigned int code = 0x4E00 + (unsigned int)rank * 7;
+    out[0] = (char)(0xE0 | (code >> 12));
+    out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (code & 0x3F));
+    return 3;
+}
+
+/**
+ * Content of one synthetic message: 6-14 tokens, mostly English words,
+ * some runs of 2-4 Chinese characters
+ */
+static int build_search_text(char *out) {
+    int len = 0;
+    int tokens = 6 + (int)(bench_random() % 9);
+    for (int t = 0; t < tokens; t++) {
+        if (t > 0) out[len++] = ' ';
+        if (bench_random() % 5 == 0) {
+            int chars = 2 + (int)(bench_random() % 3);
+            for (int c = 0; c < chars; c++) {
+                len += append_han(out + len, skewed_rank(SEARCH_HAN_CHARS));
+            }
+        } else {
+            len += append_word(out + len, skewed_rank(SEARCH_VOCABULARY));
+        }
+    }
+    return len;
+}
+
+static void count_hit(const char *frame, int frame_len, void *context) {
+    (void)frame;
+    (void)frame_len;
+    (*(int *)context)++;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Index a synthetic corpus, then time queries of one or two words or a
+ * pair of Chinese characters, asking for the top results like /search
+ */
+static void run_search_bench(int messages) {
+    if (search_init(messages) != 0) {
+        printf("Failed to allocate search index\n");
+        return;
+    }
+    
+    ChatMessage msg;
+    char frame[MAX_BUFFER_SIZE];
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_MESSAGE;
+    strcpy(msg.username, "bench");
+    msg.timestamp_ms = get_epoch_ms();
+    
+    double start = now_ns();
+    for (int i = 0; i < messages; i++) {
+        msg.content_length = build_search_text(msg.content);
+        msg.timestamp_ms++;
+        int frame_len = serialize_message_v2(&msg, frame, sizeof(frame));
+        search_add(frame, frame_len);
+    }
+    double index_ns = (now_ns() - start) / messages;
+    
+    SearchStats stats;
+    search_get_stats(&stats);
+    printf("\nSearch over %lld messages: %.0f ns per message indexed, %lld terms, %lld postings, %.1f MB\n",
+        stats.docs, index_ns, stats.terms, stats.postings, stats.bytes / (1024.0 * 1024.0));
+    
+    double *latency = (double *)malloc(sizeof(double) * SEARCH_QUERIES);
+    if (latency == NULL) {
+        search_destroy();
+        return;
+    }
+    long long hits = 0;
+    for (int q = 0; q < SEARCH_QUERIES; q++) {
+        char query[64];
+        int len = 0;
+        switch (q % 5) {
+            case 0:
+            case 1:
+                len = append_word(query, skewed_rank(SEARCH_VOCABULARY));
+                break;
+            case 2:
+            case 3:
+                len = append_word(query, skewed_rank(SEARCH_VOCABULARY));
+                query[len++] = ' ';
+                len += append_word(query + len, skewed_rank(SEARCH_VOCABULARY));
+                break;
+            default:
+                len = append_han(query, skewed_rank(SEARCH_HAN_CHARS));
+                len += append_han(query + len, skewed_rank(SEARCH_HAN_CHARS));
+                break;
+        }
+        
+        int found = 0;
+        start = now_ns();
+        search_query(query, len, MAX_SEARCH_RESULTS, count_hit, &found);
+        latency[q] = (now_ns() - start) / 1000.0;
+        hits += found;
+    }
+    
+    qsort(latency, SEARCH_QUERIES, sizeof(double), compare_doubles);
+    printf("%d queries, top %d: p50 %.1f us, p99 %.1f us, max %.1f us, %.1f hits per query\n",
+        SEARCH_QUERIES, MAX_SEARCH_RESULTS, latency[SEARCH_QUERIES / 2],
+        latency[SEARCH_QUERIES * 99 / 100], latency[SEARCH_QUERIES - 1], (double)hits / SEARCH_QUERIES);
+    
+    free(latency);
+    search_destroy();
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = DEFAULT_ITERATIONS;
+    const char *log_dir = NULL;
+    int search_messages = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            log_dir = argv[++i];
+        } else if (strcmp(argv[i], "--search") == 0 && i + 1 < argc) {
+            search_messages = atoi(argv[++i]);
+        } else {
+            iterations = atoi(argv[i]);
+        }
+    }
+    if (iterations <= 0 || search_messages < 0 || search_messages > MAX_SEARCH_DOCS) {
+        printf("Usage: %s [iterations] [--log DIR] [--search MESSAGES]\n", argv[0]);
+        return 1;
+    }
+    frame_pool_init();
+    
+    printf("Codec, %d iterations per case\n", iterations);
+    printf("%7s %-3s %6s  %8s  %6s  %8s  %6s  %8s\n",
+        "content", "fmt", "frame", "ser ns", "ser B", "de ns", "de B", "split ns");
+    
+    for (size_t i = 0; i < sizeof(codec_sizes) / sizeof(codec_sizes[0]); i++) {
+        run_codec_case(codec_sizes[i], PROTO_TEXT, iterations);
+        run_codec_case(codec_sizes[i], PROTO_BINARY, iterations);
+    }
+    
+    printf("\nSplitting received frames, GB/s (best path here: %s)\n", framing_path_name(framing_best_path()));
+    printf("%7s %-3s %6s  %8s", "content", "fmt", "frame", "memchr");
+    for (int path = 0; path < FRAMING_PATH_COUNT; path++) {
+        printf("  %8s", framing_path_name((FramingPath)path));
+    }
+    printf("\n");
+    
+    for (size_t i = 0; i < sizeof(codec_sizes) / sizeof(codec_sizes[0]); i++) {
+        run_split_case(codec_sizes[i], PROTO_TEXT, iterations);
+        run_split_case(codec_sizes[i], PROTO_BINARY, iterations);
+    }
+    
+    printf("\nRelay path into a lobby frame (v1 and v2), %d iterations per case\n", iterations);
+    printf("%-14s %-3s %6s  %10s  %10s  %10s  %10s\n",
+        "case", "fmt", "frame", "struct ns", "struct B", "view ns", "view B");
+    
+    for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+        run_case(&bench_cases[i], PROTO_TEXT, iterations);
+        run_case(&bench_cases[i], PROTO_BINARY, iterations);
+    }
+    
+    if (log_dir != NULL) {
+        if (log_open(log_dir, DEFAULT_LOG_FLUSH_MS, DEFAULT_LOG_FLUSH_BYTES) != 0) {
+            printf("Failed to open message log in %s\n", log_dir);
+            return 1;
+        }
+        printf("\nRelay with message log in %s (flush %d ms / %d bytes)\n",
+            log_dir, DEFAULT_LOG_FLUSH_MS, DEFAULT_LOG_FLUSH_BYTES);
+        printf("%-14s %6s  %10s  %10s  %8s\n", "case", "frame", "off ns", "on ns", "cost");
+        for (size_t i = 1; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+            run_log_case(&bench_cases[i], iterations);
+        }
+        log_close();
+    }
+    
+    if (search_messages > 0) {
+        run_search_bench(search_messages);
+    }
+    
+    return 0;
+}
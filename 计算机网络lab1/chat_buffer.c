@@ -0,0 +1,224 @@
+#include "chat_buffer.h"
+
+// Free blocks of each size. A free block stores the list link in its
+// first bytes; blocks come from malloc, which aligns them as SLists need.
+static SLIST_HEADER free_blocks[BUFFER_CLASSES];
+static volatile LONG64 bytes_in_use;
+static volatile LONG64 bytes_idle;
+
+void buffer_pool_init(void) {
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        InitializeSListHead(&free_blocks[i]);
+    }
+}
+
+void buffer_pool_get_stats(BufferPoolStats *stats) {
+    stats->in_use = bytes_in_use;
+    stats->idle = bytes_idle;
+}
+
+static int size_class(int size) {
+    int index = 0;
+    while ((BUFFER_MIN_SIZE << index) < size) index++;
+    return index;
+}
+
+static char *take_block(int size) {
+    char *block = (char *)InterlockedPopEntrySList(&free_blocks[size_class(size)]);
+    if (block != NULL) {
+        InterlockedExchangeAdd64(&bytes_idle, -size);
+    } else {
+        block = (char *)malloc(size);
+        if (block == NULL) return NULL;
+    }
+    InterlockedExchangeAdd64(&bytes_in_use, size);
+    return block;
+}
+
+static void give_block(char *block, int size) {
+    InterlockedExchangeAdd64(&bytes_in_use, -size);
+    PSLIST_HEADER list = &free_blocks[size_class(size)];
+    if ((LONG64)QueryDepthSList(list) * size >= BUFFER_POOL_IDLE_BYTES) {
+        free(block);
+        return;
+    }
+    InterlockedPushEntrySList(list, (PSLIST_ENTRY)block);
+    InterlockedExchangeAdd64(&bytes_idle, size);
+}
+
+void ring_init(RingBuffer *ring) {
+    ring->data = NULL;
+    ring->size = 0;
+    ring->head = 0;
+    ring->count = 0;
+    ring->next_size = BUFFER_MIN_SIZE;
+}
+
+/**
+ * Drop any unread bytes and give the block back to the pool
+ */
+void ring_release(RingBuffer *ring) {
+    if (ring->data != NULL) give_block(ring->data, ring->size);
+    ring->data = NULL;
+    ring->size = 0;
+    ring->head = 0;
+    ring->count = 0;
+}
+
+/**
+ * Move the unread bytes to the start of a new block of the given size
+ * (at least ring->count). Returns -1 if no block is available.
+ */
+static int ring_resize(RingBuffer *ring, int size) {
+    char *block = take_block(size);
+    if (block == NULL) return -1;
+    
+    if (ring->count > 0) {
+        int first = ring->size - ring->head;
+        if (first > ring->count) first = ring->count;
+        memcpy(block, ring->data + ring->head, first);
+        memcpy(block + first, ring->data, ring->count - first);
+    }
+    if (ring->data != NULL) give_block(ring->data, ring->size);
+    ring->data = block;
+    ring->size = size;
+    ring->head = 0;
+    return 0;
+}
+
+/**
+ * Receive into the free space of the ring with one WSARecv of up to two
+ * segments. An empty ring takes a block first; a full one grows, at most
+ * to max_size (a power of two). Returns what recv would (bytes, 0 when
+ * the peer closed, SOCKET_ERROR), or RING_FULL / RING_NO_MEMORY when
+ * nothing could be read.
+ */
+int ring_recv(RingBuffer *ring, SOCKET socket, int max_size) {
+    if (ring->count == ring->size) {
+        int size = ring->size == 0 ? ring->next_size : ring->size * 2;
+        if (size > max_size) return RING_FULL;
+        if (ring_resize(ring, size) != 0) return RING_NO_MEMORY;
+    }
+    
+    WSABUF bufs[2];
+    int space = ring->size - ring->count;
+    int tail = (ring->head + ring->count) & (ring->size - 1);
+    DWORD count = 1;
+    bufs[0].buf = ring->data + tail;
+    bufs[0].len = (ULONG)(ring->size - tail < space ? ring->size - tail : space);
+    if ((int)bufs[0].len < space) {
+        bufs[1].buf = ring->data;
+        bufs[1].len = (ULONG)(space - (int)bufs[0].len);
+        count = 2;
+    }
+    
+    DWORD received = 0;
+    DWORD flags = 0;
+    int result = WSARecv(socket, bufs, count, &received, &flags, NULL, NULL);
+    if (result == SOCKET_ERROR || received == 0) {
+        // Nothing arrived: an empty ring keeps no block
+        int error = WSAGetLastError();
+        if (ring->count == 0) ring_release(ring);
+        WSASetLastError(error);
+        return result == SOCKET_ERROR ? SOCKET_ERROR : 0;
+    }
+    ring->count += (int)received;
+    
+    // A read that filled every free byte suggests more is waiting: take
+    // a bigger block next time. One that used little shrinks it again.
+    if ((int)received == space && ring->size < max_size) {
+        ring->next_size = ring->size * 2;
+    } else if ((int)received <= space / 4 && ring->next_size > BUFFER_MIN_SIZE) {
+        ring->next_size /= 2;
+    }
+    return (int)received;
+}
+
+/**
+ * The unread bytes up to the end of the block (all of them unless they
+ * wrap around). Returns NULL with *length 0 when the ring is empty.
+ */
+const char *ring_peek(const RingBuffer *ring, int *length) {
+    if (ring->count == 0) {
+        *length = 0;
+        return NULL;
+    }
+    int first = ring->size - ring->head;
+    *length = first < ring->count ? first : ring->count;
+    return ring->data + ring->head;
+}
+
+/**
+ * Consume `used` bytes of the `length` that ring_peek returned. Returns
+ * 1 if there are more bytes to look at now: the rest of the data after
+ * the end of the block, or a frame that wrapped and has been made
+ * contiguous. Returns RING_NO_MEMORY if a wrapped frame could not be
+ * made contiguous; it would never be read, so the caller must close.
+ * A drained ring gives its block back to the pool.
+ */
+int ring_advance(RingBuffer *ring, int used, int length) {
+    if (ring->count == 0) return 0;
+    ring->head = (ring->head + used) & (ring->size - 1);
+    ring->count -= used;
+    if (ring->count == 0) {
+        ring_release(ring);
+        return 0;
+    }
+    
+    if (ring->head + ring->count > ring->size) {
+        // Only a partial frame was left before the end of the block
+        return ring_resize(ring, ring->size) == 0 ? 1 : RING_NO_MEMORY;
+    }
+    return used == length;
+}
+
+// Slab header, padded so the objects after it stay aligned for any type
+#define SLAB_HEADER 16
+
+void object_pool_init(ObjectPool *pool, int object_size, int per_slab) {
+    pool->object_size = (object_size + 7) & ~7;
+    if (pool->object_size < (int)sizeof(void *)) pool->object_size = sizeof(void *);
+    pool->per_slab = per_slab;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+}
+
+/**
+ * A zeroed object, or NULL if a new slab cannot be allocated
+ */
+void *object_pool_alloc(ObjectPool *pool) {
+    if (pool->free_list == NULL) {
+        char *slab = (char *)malloc(SLAB_HEADER + (size_t)pool->object_size * pool->per_slab);
+        if (slab == NULL) return NULL;
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+        for (int i = pool->per_slab - 1; i >= 0; i--) {
+            char *object = slab + SLAB_HEADER + (size_t)i * pool->object_size;
+            *(void **)object = pool->free_list;
+            pool->free_list = object;
+        }
+    }
+    
+    void *object = pool->free_list;
+    pool->free_list = *(void **)object;
+    memset(object, 0, pool->object_size);
+    return object;
+}
+
+void object_pool_free(ObjectPool *pool, void *object) {
+    if (object == NULL) return;
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+}
+
+/**
+ * Free every slab; objects still in use become invalid
+ */
+void object_pool_destroy(ObjectPool *pool) {
+    while (pool->slabs != NULL) {
+        void *slab = pool->slabs;
+        pool->slabs = *(void **)slab;
+        free(slab);
+    }
+    pool->free_list = NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef CHAT_BUFFER_H
+#define CHAT_BUFFER_H
+
+#include "chat_protocol.h"
+
+// Receive buffers. Each connection reads into a ring whose memory is a
+// power-of-two block from a pool shared by all threads. WSARecv fills
+// the free space of the ring as two segments, so unread bytes are never
+// moved to the front; only a frame that wraps around the end is copied
+// to make it contiguous. A ring that fills up grows up to a cap, and a
+// drained ring gives its block back, so an idle connection holds none.
+#define BUFFER_MIN_SHIFT 12
+#define BUFFER_MIN_SIZE (1 << BUFFER_MIN_SHIFT)   // 4 KB, larger than any valid frame
+#define BUFFER_CLASSES 9                          // Block sizes 4 KB .. 1 MB
+#define BUFFER_MAX_SIZE (BUFFER_MIN_SIZE << (BUFFER_CLASSES - 1))
+#define DEFAULT_RECV_BUFFER_MAX (64 * 1024)
+#define BUFFER_POOL_IDLE_BYTES (1024 * 1024)      // Free blocks kept per size, the rest go back to the heap
+
+// ring_recv results besides those of recv (RING_NO_MEMORY also from ring_advance)
+#define RING_FULL (-2)                   // Full at the size limit
+#define RING_NO_MEMORY (-3)
+
+typedef struct {
+    char *data;                          // Block from the pool, NULL while empty
+    int size;                            // Block size, 0 while empty
+    int head;                            // Offset of the first unread byte
+    int count;                           // Unread bytes
+    int next_size;                       // Block size to take when the ring is next filled
+} RingBuffer;
+
+typedef struct {
+    LONG64 in_use;                       // Bytes of blocks held by rings
+    LONG64 idle;                         // Bytes of free blocks kept in the pool
+} BufferPoolStats;
+
+// Fixed-size objects carved from slabs, for a single thread. Objects that
+// live as long as a connection are packed together rather than between
+// short-lived buffers, so the pages those buffers leave after a burst are
+// whole and the heap can give them back. Slabs are kept until destroyed.
+typedef struct {
+    int object_size;
+    int per_slab;
+    void *free_list;                     // Free objects, linked through their first bytes
+    void *slabs;                         // Slabs, linked through their first bytes
+} ObjectPool;
+
+// Function prototypes
+void buffer_pool_init(void);
+void buffer_pool_get_stats(BufferPoolStats *stats);
+void ring_init(RingBuffer *ring);
+void ring_release(RingBuffer *ring);
+int ring_recv(RingBuffer *ring, SOCKET socket, int max_size);
+const char *ring_peek(const RingBuffer *ring, int *length);
+int ring_advance(RingBuffer *ring, int used, int length);
+void object_pool_init(ObjectPool *pool, int object_size, int per_slab);
+void *object_pool_alloc(ObjectPool *pool);
+void object_pool_free(ObjectPool *pool, void *object);
+void object_pool_destroy(ObjectPool *pool);
+
+#endif // CHAT_BUFFER_H
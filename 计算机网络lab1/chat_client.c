@@ -4,6 +4,13 @@
 // 特性：
 //  - 启动欢迎界面（Features / Basic Commands / Message Sending）
 //  - 支持 /list /quit /exit /help 命令
+//  - 支持聊天室（房间）：/join /leave /room，/list <房间> 查看房间成员
+//  - 支持私聊：/msg <ID|昵称> 内容
+//  - 支持搜索聊天记录：/search <关键词>
+//  - 支持查看服务器运行统计：/stats
+//  - 断线后自动重连并恢复会话，服务器只补发缺失的消息（v2）
+//  - 自动应答服务器的心跳（MSG_PING -> MSG_PONG）
+//  - 接收缓冲区为环形缓冲区，按需扩容，服务器的突发消息不会丢失
 //  - 支持英文和中文消息，自动显示时间戳与用户名
 //  - 使用独立接收线程显示服务器广播消息
 
@@ -12,12 +19,30 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "chat_protocol.h"   // 已包含 winsock2.h 等
+#include "chat_framing.h"
+#include "chat_buffer.h"
 
 #define MAX_INPUT_LEN 2048
+#define RECONNECT_ATTEMPTS 5   /* 间隔 1, 2, 4, 8, 16 秒 */
 
 static SOCKET client_socket = INVALID_SOCKET;
+static struct sockaddr_in g_server_addr;
 static char   g_username[MAX_USERNAME_LEN] = {0};
 static volatile int g_running = 1;
+static ProtocolVersion g_protocol = PROTO_TEXT;   /* 服务器以 v2 帧应答后切换 */
+static unsigned int g_next_seq = 1;               /* v2 帧的发送序号 */
+
+/* 会话恢复：加入时服务器给出的令牌，以及收到的最后一个 v2 帧的序号 */
+static char g_session_token[MAX_SESSION_TOKEN_LEN] = {0};
+static unsigned int g_last_seq = 0;
+static int g_resuming = 0;
+
+/* 接收缓冲区（环形，内存取自缓冲池）：握手时多收到的帧留给接收线程处理 */
+#define CLIENT_RECV_BUFFER_MAX DEFAULT_RECV_BUFFER_MAX
+static RingBuffer g_recv;
+
+/* 主线程和接收线程（心跳应答、重连）都会发送，整帧发送时加锁 */
+static CRITICAL_SECTION g_send_lock;
 
 /*=============================
  *  辅助输出函数
@@ -40,6 +65,21 @@ void print_banner(void) {
     printf("  /exit  - Exit chat room (same as /quit)\n");
     printf("  /help  - Show this help message\n\n");
 
+    printf("[Rooms]\n");
+    printf("  /join <room>         - Join (or create) a room\n");
+    printf("  /leave <room>        - Leave a room\n");
+    printf("  /room <room> <text>  - Send a message to one room\n");
+    printf("  /list <room>         - View members of a room\n\n");
+
+    printf("[Direct Messages]\n");
+    printf("  /msg <id|nick> <text> - Send a direct message to one user\n\n");
+
+    printf("[Search]\n");
+    printf("  /search <words>      - Find recent chat messages containing all words\n\n");
+
+    printf("[Server]\n");
+    printf("  /stats               - Show server statistics\n\n");
+
     printf("[Message Sending]\n");
     printf("  - Type text directly to send messages (supports English/Chinese)\n");
     printf("  - Messages are automatically broadcast to all online users\n");
@@ -52,28 +92,204 @@ void print_help(void) {
     printf("  /list  - View online users list (shows ID and nickname)\n");
     printf("  /quit  - Exit chat room\n");
     printf("  /exit  - Exit chat room (same as /quit)\n");
-    printf("  /help  - Show this help message\n\n");
+    printf("  /help  - Show this help message\n");
+    printf("  /join <room>         - Join (or create) a room\n");
+    printf("  /leave <room>        - Leave a room\n");
+    printf("  /room <room> <text>  - Send a message to one room\n");
+    printf("  /list <room>         - View members of a room\n");
+    printf("  /msg <id|nick> <text> - Send a direct message to one user\n");
+    printf("  /search <words>      - Find recent chat messages containing all words\n");
+    printf("  /stats               - Show server statistics\n\n");
 }
 
 /*=============================
  *  协议发送封装
  *=============================*/
 
-int send_chat_message(const ChatMessage *msg) {
+/* 序列化并发送一条消息，调用者持有 g_send_lock */
+static int send_frame(const ChatMessage *msg) {
     char buffer[MAX_BUFFER_SIZE];
-    int len = serialize_message(msg, buffer, sizeof(buffer));
+
+    if (g_protocol == PROTO_BINARY) {
+        /* v2：长度前缀帧，一次发送，内容中可以包含换行 */
+        ChatMessage numbered = *msg;
+        numbered.seq = g_next_seq++;
+        int len = serialize_message_v2(&numbered, buffer, sizeof(buffer));
+        if (len < 0) {
+            printf("Failed to serialize message.\n");
+            return -1;
+        }
+        if (send(client_socket, buffer, len, 0) == SOCKET_ERROR) {
+            printf("send failed: %d\n", WSAGetLastError());
+            return -1;
+        }
+        return 0;
+    }
+
+    /* v1：行尾的换行和帧一起发送，一条消息只用一次 send */
+    int len = serialize_message(msg, buffer, sizeof(buffer) - 1);
     if (len < 0) {
         printf("Failed to serialize message.\n");
         return -1;
     }
+    buffer[len++] = '\n';
     if (send(client_socket, buffer, len, 0) == SOCKET_ERROR) {
         printf("send failed: %d\n", WSAGetLastError());
         return -1;
     }
-    if (send(client_socket, "\n", 1, 0) == SOCKET_ERROR) {
-        printf("send newline failed: %d\n", WSAGetLastError());
+    return 0;
+}
+
+int send_chat_message(const ChatMessage *msg) {
+    EnterCriticalSection(&g_send_lock);
+    int result = send_frame(msg);
+    LeaveCriticalSection(&g_send_lock);
+    return result;
+}
+
+/* 填写只带一段文本内容的命令消息 */
+static void make_command(ChatMessage *msg, MessageType type, const char *content) {
+    memset(msg, 0, sizeof(*msg));
+    msg->type = type;
+    get_timestamp(msg->timestamp, sizeof(msg->timestamp));
+    strncpy(msg->username, g_username, MAX_USERNAME_LEN - 1);
+    strncpy(msg->content, content, MAX_MESSAGE_LEN - 1);
+    msg->content_length = (int)strlen(msg->content);
+}
+
+/* 发送只带一段文本内容的命令消息（房间命令等） */
+int send_command(MessageType type, const char *content) {
+    ChatMessage msg;
+    make_command(&msg, type, content);
+    return send_chat_message(&msg);
+}
+
+/*=============================
+ *  帧解析：v1 文本行或 v2 二进制帧
+ *=============================*/
+
+/* 解码 framing_split 切出的一个帧；v1 行直接用切分时找到的分隔符位置，不再重新扫描 */
+static int decode_frame(const char *base, const FrameSpan *span, ChatMessage *msg) {
+    const char *start = base + span->offset;
+    if (is_binary_frame(start, span->length)) {
+        return deserialize_message_v2(start, span->length, msg);
+    }
+
+    ChatMessageView view;
+    if (framing_view(base, span, &view) != 0) {
+        return -1;
+    }
+    if (memchr(view.content, '\0', view.content_length) != NULL) {
         return -1;
     }
+
+    memset(msg, 0, sizeof(ChatMessage));
+    msg->type = view.type;
+    int timestamp_len = view.timestamp_len < (int)sizeof(msg->timestamp) - 1
+        ? view.timestamp_len : (int)sizeof(msg->timestamp) - 1;
+    memcpy(msg->timestamp, view.timestamp, timestamp_len);
+    memcpy(msg->username, view.username, view.username_len);
+    memcpy(msg->content, view.content, view.content_length);
+    msg->content_length = view.content_length;
+    return 0;
+}
+
+/* process_frames 的结果：帧格式错误；跨过缓冲区末尾的帧无内存拼接 */
+#define FRAMES_MALFORMED (-2)
+#define FRAMES_NO_MEMORY (-3)
+
+/* 帧处理函数：返回 0 继续处理，非 0 则停止，剩余的帧留在缓冲区 */
+typedef int (*FrameHandler)(ChatMessage *msg, int binary);
+
+/* 切分出接收缓冲区里的完整帧并依次交给 handler 处理。
+ * 返回 handler 的非 0 结果；帧格式错误返回 FRAMES_MALFORMED；
+ * 无内存拼接跨界的帧返回 FRAMES_NO_MEMORY；否则返回 0 */
+static int process_frames(FrameHandler handler) {
+    int result = 0;
+
+    for (;;) {
+        int length;
+        const char *data = ring_peek(&g_recv, &length);
+        if (data == NULL) {
+            return result;
+        }
+
+        int used = 0;
+        FrameBatch batch;
+        do {
+            const char *base = data + used;
+            framing_split(base, length - used, &batch);
+
+            for (int i = 0; i < batch.count && result == 0; i++) {
+                const FrameSpan *span = &batch.spans[i];
+                ChatMessage msg;
+                if (decode_frame(base, span, &msg) == 0) {
+                    result = handler(&msg, is_binary_frame(base + span->offset, span->length));
+                }
+                used += span->length;
+            }
+        } while (result == 0 && batch.count == FRAMING_MAX_SPANS);
+
+        if (result == 0 && batch.malformed) {
+            result = FRAMES_MALFORMED;
+        }
+        /* 跨过缓冲区末尾的帧会先被拼成连续的，再处理一轮 */
+        int more = ring_advance(&g_recv, used, length);
+        if (result != 0) {
+            return result;
+        }
+        if (more == RING_NO_MEMORY) {
+            return FRAMES_NO_MEMORY;
+        }
+        if (!more) {
+            return 0;
+        }
+    }
+}
+
+/*=============================
+ *  断线重连
+ *=============================*/
+
+/* 连接断开后用会话令牌重新连接；结果（ACK 或 ERROR）由接收线程处理 */
+static int reconnect_session(void) {
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS; attempt++) {
+        if (!g_running || g_session_token[0] == '\0') {
+            return 0;
+        }
+        printf("\n[CLIENT] Connection lost, reconnecting (%d/%d)...\n",
+               attempt + 1, RECONNECT_ATTEMPTS);
+        Sleep(1000u << attempt);
+
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET) {
+            continue;
+        }
+        if (connect(s, (struct sockaddr*)&g_server_addr, sizeof(g_server_addr)) == SOCKET_ERROR) {
+            closesocket(s);
+            continue;
+        }
+
+        /* 旧连接上收到一半的帧作废 */
+        char request[MAX_SESSION_TOKEN_LEN + 16];
+        snprintf(request, sizeof(request), "%s %u", g_session_token, g_last_seq);
+        ring_release(&g_recv);
+        g_resuming = 1;
+
+        /* 输入线程可能正在发送：换套接字、关闭旧连接和发送 RESUME
+         * 都在发送锁内完成，它不会写到已关闭的套接字上 */
+        ChatMessage msg;
+        make_command(&msg, MSG_RESUME, request);
+        EnterCriticalSection(&g_send_lock);
+        SOCKET old = client_socket;
+        client_socket = s;
+        closesocket(old);
+        int result = send_frame(&msg);
+        LeaveCriticalSection(&g_send_lock);
+        if (result == 0) {
+            return 1;
+        }
+    }
     return 0;
 }
 
@@ -81,60 +297,96 @@ int send_chat_message(const ChatMessage *msg) {
  *  接收线程：负责显示服务器推送
  *=============================*/
 
+/* 显示一条服务器推送的消息 */
+static void display_message(ChatMessage *msg) {
+    switch (msg->type) {
+    case MSG_MESSAGE:
+    case MSG_SYSTEM:
+    case MSG_ACK:
+    case MSG_ERROR:
+        printf("\n[%s] %s: %s\n",
+               msg->timestamp, msg->username, msg->content);
+        break;
+    case MSG_ROOM_MESSAGE: {
+        /* 内容格式为 "房间名 正文" */
+        char *text = strchr(msg->content, ' ');
+        if (text != NULL) {
+            *text++ = '\0';
+        } else {
+            text = "";
+        }
+        printf("\n[%s] [%s] %s: %s\n",
+               msg->timestamp, msg->content, msg->username, text);
+        break;
+    }
+    case MSG_DIRECT: {
+        /* 内容格式为 "接收者 正文"，只显示正文 */
+        char *text = strchr(msg->content, ' ');
+        printf("\n[%s] [DM] %s: %s\n",
+               msg->timestamp, msg->username, text != NULL ? text + 1 : "");
+        break;
+    }
+    case MSG_SEARCH:
+        /* 搜索结果：保留原消息的时间戳和发送者 */
+        printf("\n[%s] [search] %s: %s\n",
+               msg->timestamp, msg->username, msg->content);
+        break;
+    default:
+        break;
+    }
+}
+
+/* 接收线程处理一帧：记录序号，处理会话恢复的结果和心跳，然后显示 */
+static int handle_pushed_frame(ChatMessage *msg, int binary) {
+    if (binary) {
+        g_last_seq = msg->seq;
+    }
+    if (g_resuming && msg->type == MSG_ACK) {
+        g_resuming = 0;
+    } else if (g_resuming && msg->type == MSG_ERROR) {
+        /* 会话已过期，不再重试 */
+        g_resuming = 0;
+        g_session_token[0] = '\0';
+        printf("\n[CLIENT] Please restart the client to join again\n");
+    }
+    if (msg->type == MSG_PING) {
+        /* 服务器检测连接是否还活着，不显示 */
+        send_command(MSG_PONG, "");
+    }
+    display_message(msg);
+    return 0;
+}
+
 DWORD WINAPI recv_thread(LPVOID lpParam) {
     (void)lpParam;
 
-    char buffer[MAX_BUFFER_SIZE];
-    char recv_buffer[MAX_BUFFER_SIZE * 2];
-    int recv_pos = 0;
-    ChatMessage msg;
-
     while (g_running) {
-        int bytes = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes <= 0) {
-            if (g_running) {
-                printf("\n[CLIENT] Connection closed or recv failed (bytes=%d)\n", bytes);
-            }
+        /* 先处理缓冲区里已有的完整帧 */
+        int processed = process_frames(handle_pushed_frame);
+        if (processed == FRAMES_MALFORMED || processed == FRAMES_NO_MEMORY) {
+            printf("\n[CLIENT] %s\n", processed == FRAMES_MALFORMED ? "Malformed frame from server"
+                                                                    : "Out of memory for the receive buffer");
             g_running = 0;
             break;
         }
 
-        buffer[bytes] = '\0';
-
-        if (recv_pos + bytes < (int)sizeof(recv_buffer) - 1) {
-            memcpy(recv_buffer + recv_pos, buffer, bytes);
-            recv_pos += bytes;
-            recv_buffer[recv_pos] = '\0';
+        /* 直接收进环形缓冲区的空闲部分（最多两段），不再先收到临时缓冲区再复制 */
+        int bytes = ring_recv(&g_recv, client_socket, CLIENT_RECV_BUFFER_MAX);
+        if (bytes == RING_FULL || bytes == RING_NO_MEMORY) {
+            printf("\n[CLIENT] %s\n", bytes == RING_FULL ? "Frame from server too long"
+                                                         : "Out of memory for the receive buffer");
+            g_running = 0;
+            break;
         }
-
-        char *line_start = recv_buffer;
-        char *line_end   = NULL;
-
-        while ((line_end = strchr(line_start, '\n')) != NULL) {
-            *line_end = '\0';
-
-            if (deserialize_message(line_start, &msg) == 0) {
-                switch (msg.type) {
-                case MSG_MESSAGE:
-                case MSG_SYSTEM:
-                case MSG_ACK:
-                case MSG_ERROR:
-                    printf("\n[%s] %s: %s\n",
-                           msg.timestamp, msg.username, msg.content);
-                    break;
-                default:
-                    break;
-                }
+        if (bytes <= 0) {
+            if (g_running && reconnect_session()) {
+                continue;
             }
-
-            line_start = line_end + 1;
-        }
-
-        if (line_start > recv_buffer) {
-            int remaining = recv_pos - (int)(line_start - recv_buffer);
-            memmove(recv_buffer, line_start, remaining);
-            recv_pos = remaining;
-            recv_buffer[recv_pos] = '\0';
+            if (g_running) {
+                printf("\n[CLIENT] Connection closed or recv failed (bytes=%d)\n", bytes);
+            }
+            g_running = 0;
+            break;
         }
     }
 
@@ -151,7 +403,8 @@ int send_nickname(const char *nickname) {
 
     msg.type = MSG_NICKNAME;
     get_timestamp(msg.timestamp, sizeof(msg.timestamp));
-    strncpy(msg.username, "CLIENT", MAX_USERNAME_LEN - 1);
+    /* 用户名字段声明支持 v2，旧服务器会忽略它并继续使用 v1 */
+    strncpy(msg.username, CHAT_V2_CAPABILITY, MAX_USERNAME_LEN - 1);
 
     strncpy(msg.content, nickname, MAX_MESSAGE_LEN - 1);
     msg.content_length = (int)strlen(msg.content);
@@ -163,6 +416,33 @@ int send_nickname(const char *nickname) {
  *  主函数
  *=============================*/
 
+/* 握手阶段处理一帧：收到 ACK 返回 1，收到 ERROR 返回 -1 */
+static int handle_handshake_frame(ChatMessage *msg, int binary) {
+    if (binary) {
+        /* 服务器用 v2 帧应答即表示同意使用 v2 */
+        g_protocol = PROTO_BINARY;
+        g_last_seq = msg->seq;
+    }
+
+    if (msg->type == MSG_ACK) {
+        /* 令牌附在 ACK 末尾，保存下来，不显示 */
+        char *marker = strstr(msg->content, CHAT_SESSION_MARKER);
+        if (marker != NULL) {
+            strncpy(g_session_token, marker + strlen(CHAT_SESSION_MARKER),
+                    sizeof(g_session_token) - 1);
+            *marker = '\0';
+        }
+        printf("[Server] %s\n", msg->content);
+        return 1;
+    }
+    if (msg->type == MSG_ERROR) {
+        printf("[Server Error] %s\n", msg->content);
+        return -1;
+    }
+    printf("[%s] %s: %s\n", msg->timestamp, msg->username, msg->content);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     WSADATA wsaData;
     char server_ip[64] = "127.0.0.1";
@@ -206,6 +486,9 @@ int main(int argc, char *argv[]) {
         printf("WSAStartup failed.\n");
         return 1;
     }
+    InitializeCriticalSection(&g_send_lock);
+    buffer_pool_init();
+    ring_init(&g_recv);
 
     /* 4. 创建 socket 并连接服务器 */
     client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -215,15 +498,14 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port   = htons(server_port);
-    server_addr.sin_addr.s_addr = inet_addr(server_ip);
+    memset(&g_server_addr, 0, sizeof(g_server_addr));
+    g_server_addr.sin_family = AF_INET;
+    g_server_addr.sin_port   = htons(server_port);
+    g_server_addr.sin_addr.s_addr = inet_addr(server_ip);
 
     printf("\nConnecting to server %s:%d...\n", server_ip, server_port);
-    if (connect(client_socket, (struct sockaddr*)&server_addr,
-                sizeof(server_addr)) == SOCKET_ERROR) {
+    if (connect(client_socket, (struct sockaddr*)&g_server_addr,
+                sizeof(g_server_addr)) == SOCKET_ERROR) {
         printf("connect failed: %d\n", WSAGetLastError());
         closesocket(client_socket);
         WSACleanup();
@@ -242,61 +524,30 @@ int main(int argc, char *argv[]) {
     printf("Nickname sent successfully. Waiting for server response...\n");
 
     {
-        char buffer[MAX_BUFFER_SIZE];
-        char recv_buf[MAX_BUFFER_SIZE * 2];
-        int recv_pos = 0;
-        int got_first = 0;
-        ChatMessage msg;
+        int result = 0;
 
-        while (!got_first) {
-            int bytes = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+        while (result == 0) {
+            int bytes = ring_recv(&g_recv, client_socket, CLIENT_RECV_BUFFER_MAX);
             if (bytes <= 0) {
                 printf("Server closed connection or recv failed (bytes=%d)\n", bytes);
                 closesocket(client_socket);
                 WSACleanup();
                 return 1;
             }
+            result = process_frames(handle_handshake_frame);
+        }
 
-            buffer[bytes] = '\0';
-            if (recv_pos + bytes < (int)sizeof(recv_buf) - 1) {
-                memcpy(recv_buf + recv_pos, buffer, bytes);
-                recv_pos += bytes;
-                recv_buf[recv_pos] = '\0';
-            }
-
-            char *line_start = recv_buf;
-            char *line_end   = NULL;
-
-            while ((line_end = strchr(line_start, '\n')) != NULL) {
-                *line_end = '\0';
-
-                if (deserialize_message(line_start, &msg) == 0) {
-                    if (msg.type == MSG_ACK) {
-                        printf("[Server] %s\n", msg.content);
-                        got_first = 1;
-                    } else if (msg.type == MSG_ERROR) {
-                        printf("[Server Error] %s\n", msg.content);
-                        closesocket(client_socket);
-                        WSACleanup();
-                        return 1;
-                    } else {
-                        printf("[%s] %s: %s\n",
-                               msg.timestamp, msg.username, msg.content);
-                    }
-                }
-
-                line_start = line_end + 1;
-            }
-
-            if (line_start > recv_buf) {
-                int remaining = recv_pos - (int)(line_start - recv_buf);
-                memmove(recv_buf, line_start, remaining);
-                recv_pos = remaining;
-                recv_buf[recv_pos] = '\0';
+        if (result != 1) {
+            if (result == FRAMES_MALFORMED) {
+                printf("Malformed frame from server\n");
+            } else if (result == FRAMES_NO_MEMORY) {
+                printf("Out of memory for the receive buffer\n");
             }
-
-            if (got_first) break;
+            closesocket(client_socket);
+            WSACleanup();
+            return 1;
         }
+        /* ACK 之后的帧（例如历史消息）留在 g_recv 中，交给接收线程 */
     }
 
     /* 6. 启动接收线程 */
@@ -342,6 +593,29 @@ int main(int argc, char *argv[]) {
             msg.content[0] = '\0';
             msg.content_length = 0;
             send_chat_message(&msg);
+        } else if (strncmp(input, "/list ", 6) == 0) {
+            send_command(MSG_LIST, input + 6);
+        } else if (strncmp(input, "/join ", 6) == 0) {
+            send_command(MSG_JOIN_ROOM, input + 6);
+        } else if (strncmp(input, "/leave ", 7) == 0) {
+            send_command(MSG_LEAVE_ROOM, input + 7);
+        } else if (strncmp(input, "/room ", 6) == 0) {
+            /* 原样发送 "房间名 正文"，由服务器校验是否为房间成员 */
+            if (strchr(input + 6, ' ') == NULL) {
+                printf("Usage: /room <room> <text>\n");
+            } else {
+                send_command(MSG_ROOM_MESSAGE, input + 6);
+            }
+        } else if (strncmp(input, "/msg ", 5) == 0) {
+            if (strchr(input + 5, ' ') == NULL) {
+                printf("Usage: /msg <id|nick> <text>\n");
+            } else {
+                send_command(MSG_DIRECT, input + 5);
+            }
+        } else if (strncmp(input, "/search ", 8) == 0) {
+            send_command(MSG_SEARCH, input + 8);
+        } else if (strcmp(input, "/stats") == 0) {
+            send_command(MSG_STATS, "");
         } else if (strcmp(input, "/help") == 0) {
             print_help();
         } else {
@@ -0,0 +1,148 @@
+#include "chat_frame.h"
+
+static volatile LONG next_frame_seq = 0;  // v2 sequence number of the last frame
+
+// Free frames of each class. A free frame stores the list link in its
+// first bytes; frames come from malloc, which aligns them as SLists need.
+static SLIST_HEADER free_frames[FRAME_CLASSES];
+static volatile LONG64 heap_allocations;
+
+void frame_pool_init(void) {
+    for (int i = 0; i < FRAME_CLASSES; i++) {
+        InitializeSListHead(&free_frames[i]);
+    }
+}
+
+void frame_pool_get_stats(FramePoolStats *stats) {
+    stats->heap_allocations = heap_allocations;
+    stats->idle_bytes = 0;
+    for (int i = 0; i < FRAME_CLASSES; i++) {
+        stats->idle_bytes += (LONG64)QueryDepthSList(&free_frames[i]) << (FRAME_MIN_SHIFT + i);
+    }
+}
+
+/**
+ * A frame with room for payload bytes after the header. Its fields are
+ * left for the caller to fill in, except size_class.
+ */
+static Frame *frame_alloc(int payload) {
+    int size = (int)sizeof(Frame) + payload;
+    int size_class = 0;
+    while (size_class < FRAME_CLASSES && (1 << (FRAME_MIN_SHIFT + size_class)) < size) size_class++;
+    
+    Frame *frame = NULL;
+    if (size_class < FRAME_CLASSES) {
+        frame = (Frame *)InterlockedPopEntrySList(&free_frames[size_class]);
+        size = 1 << (FRAME_MIN_SHIFT + size_class);
+    } else {
+        size_class = -1;
+    }
+    if (frame == NULL) {
+        frame = (Frame *)malloc(size);
+        if (frame == NULL) return NULL;
+        InterlockedIncrement64(&heap_allocations);
+    }
+    frame->size_class = size_class;
+    return frame;
+}
+
+static void frame_free(Frame *frame) {
+    if (frame->size_class >= 0) {
+        PSLIST_HEADER list = &free_frames[frame->size_class];
+        int size = 1 << (FRAME_MIN_SHIFT + frame->size_class);
+        if (QueryDepthSList(list) < FRAME_POOL_IDLE_BYTES / size) {
+            InterlockedPushEntrySList(list, (PSLIST_ENTRY)frame);
+            return;
+        }
+    }
+    free(frame);
+}
+
+static LONG64 now_ticks(void) {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+/**
+ * Allocate a frame holding one message in every wire format:
+ * the v1 text line plus "\n" and the v2 binary frame
+ */
+Frame *frame_create(const ChatMessage *msg) {
+    char text[MAX_BUFFER_SIZE];
+    char binary[CHAT_V2_HEADER_LEN + MAX_USERNAME_LEN + MAX_MESSAGE_LEN];
+    
+    int text_len = serialize_message(msg, text, sizeof(text) - 1);
+    if (text_len < 0) return NULL;
+    
+    // v2 content may contain newlines, which would split a v1 line
+    for (int i = text_len - msg->content_length; i < text_len; i++) {
+        if (text[i] == '\n' || text[i] == '\r') text[i] = ' ';
+    }
+    text[text_len++] = '\n'; // Add newline for easier parsing
+    
+    // Frames are numbered in the order the server relays them
+    ChatMessage stamped = *msg;
+    stamped.seq = (unsigned int)InterlockedIncrement(&next_frame_seq);
+    int binary_len = serialize_message_v2(&stamped, binary, sizeof(binary));
+    if (binary_len < 0) return NULL;
+    
+    Frame *frame = frame_alloc(text_len + binary_len);
+    if (frame == NULL) return NULL;
+    frame->refcount = 1;
+    frame->type = msg->type;
+    frame->history_seq = 0;
+    frame->seq = stamped.seq;
+    frame->created = now_ticks();
+    frame->len[PROTO_TEXT] = text_len;
+    frame->data[PROTO_TEXT] = frame->buf;
+    frame->len[PROTO_BINARY] = binary_len;
+    frame->data[PROTO_BINARY] = frame->buf + text_len;
+    memcpy(frame->data[PROTO_TEXT], text, text_len);
+    memcpy(frame->data[PROTO_BINARY], binary, binary_len);
+    return frame;
+}
+
+/**
+ * Allocate a frame for a relayed client message. The format it arrived
+ * in is forwarded as-is; other formats are only encoded if they are in
+ * the formats mask.
+ */
+Frame *frame_create_relay(ChatMessageView *view, int formats) {
+    // Room for the original plus the largest possible re-encoding
+    int capacity = view->frame_len + CHAT_V2_HEADER_LEN + view->username_len + view->content_length + 64;
+    Frame *frame = frame_alloc(capacity);
+    if (frame == NULL) return NULL;
+    
+    view->seq = (unsigned int)InterlockedIncrement(&next_frame_seq);
+    frame->refcount = 1;
+    frame->type = view->type;
+    frame->history_seq = 0;
+    frame->seq = view->seq;
+    frame->created = now_ticks();
+    
+    char *out = frame->buf;
+    for (int proto = 0; proto < PROTO_COUNT; proto++) {
+        frame->data[proto] = out;
+        frame->len[proto] = 0;
+        if (proto != (int)view->proto && !(formats & FORMAT_BIT(proto))) continue;
+        
+        int len = encode_view_frame(view, (ProtocolVersion)proto, out, capacity - (out - frame->buf));
+        if (len < 0) {
+            frame_free(frame);
+            return NULL;
+        }
+        frame->len[proto] = len;
+        out += len;
+    }
+    return frame;
+}
+
+/**
+ * Drop one reference to a frame; the last one returns it to the pool
+ */
+void frame_release(Frame *frame) {
+    if (InterlockedDecrement(&frame->refcount) == 0) {
+        frame_free(frame);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef CHAT_FRAME_H
+#define CHAT_FRAME_H
+
+#include "chat_protocol.h"
+
+// Frames come from a pool of power-of-two size classes (header included)
+// shared by all threads: the last release pushes a frame onto its class's
+// lock-free free list and the next frame of that size pops it, so once the
+// pool has warmed up relaying a message does not touch the heap.
+#define FRAME_MIN_SHIFT 8
+#define FRAME_CLASSES 6                  // 256 B .. 8 KB, enough for any message in both formats
+#define FRAME_POOL_IDLE_BYTES (1024 * 1024)  // Free frames kept per class, the rest go back to the heap
+
+// Serialized message, shared by every queue and worker that holds a reference.
+// It is encoded once per protocol version; data[v]/len[v] point into buf.
+// Relayed frames may skip formats nobody needs (len[v] == 0).
+typedef struct Frame {
+    volatile LONG refcount;
+    int size_class;                  // Pool class it returns to, -1 if it came from the heap directly
+    MessageType type;
+    LONG64 history_seq;              // Position in a history ring, 0 if not recorded
+    unsigned int seq;                // Sequence number in the v2 header
+    LONG64 created;                  // QueryPerformanceCounter value when built
+    int len[PROTO_COUNT];
+    char *data[PROTO_COUNT];
+    char buf[1];
+} Frame;
+
+#define FORMAT_BIT(proto) (1 << (proto))
+#define ALL_FORMATS (FORMAT_BIT(PROTO_TEXT) | FORMAT_BIT(PROTO_BINARY))
+
+typedef struct {
+    LONG64 heap_allocations;         // Frames the pool had to malloc
+    LONG64 idle_bytes;               // Free frames kept for reuse
+} FramePoolStats;
+
+// Function prototypes
+void frame_pool_init(void);
+void frame_pool_get_stats(FramePoolStats *stats);
+Frame *frame_create(const ChatMessage *msg);
+Frame *frame_create_relay(ChatMessageView *view, int formats);
+void frame_release(Frame *frame);
+
+#endif // CHAT_FRAME_H
@@ -0,0 +1,300 @@
+#include "chat_framing.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRAMING_HAVE_SSE2 1
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define FRAMING_INLINE inline __attribute__((always_inline))
+#define FRAMING_AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define FRAMING_INLINE __forceinline
+#define FRAMING_AVX2_TARGET
+#endif
+
+#define FRAMING_CHUNK 64                 // Bytes per mask word
+
+// Set bit i of *newlines / *bars where chunk[i] is '\n' / '|'
+typedef void (*ChunkMasks)(const char *chunk, unsigned long long *newlines, unsigned long long *bars);
+typedef int (*SplitFunction)(const char *buffer, int length, FrameBatch *batch);
+
+static SplitFunction split_function = NULL;
+
+static FRAMING_INLINE void chunk_masks_scalar(const char *chunk, unsigned long long *newlines, unsigned long long *bars) {
+    unsigned long long nl = 0;
+    unsigned long long br = 0;
+    for (int i = 0; i < FRAMING_CHUNK; i++) {
+        nl |= (unsigned long long)(chunk[i] == '\n') << i;
+        br |= (unsigned long long)(chunk[i] == '|') << i;
+    }
+    *newlines = nl;
+    *bars = br;
+}
+
+static FRAMING_INLINE int lowest_bit(unsigned long long mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+/**
+ * Masks of the 64 bytes at buffer + offset; past the end of the buffer
+ * the bits are clear
+ */
+static FRAMING_INLINE void load_chunk(const char *buffer, int length, int offset, ChunkMasks masks,
+                                      unsigned long long *newlines, unsigned long long *bars) {
+    if (length - offset >= FRAMING_CHUNK) {
+        masks(buffer + offset, newlines, bars);
+        return;
+    }
+    char tail[FRAMING_CHUNK] = { 0 };
+    memcpy(tail, buffer + offset, length - offset);
+    masks(tail, newlines, bars);
+}
+
+/**
+ * The split loop. It is inlined into one function per code path, so the
+ * mask computation is inlined as well.
+ */
+static FRAMING_INLINE int split_frames(const char *buffer, int length, FrameBatch *batch, ChunkMasks masks) {
+    int count = 0;
+    int pos = 0;
+    int chunk = -FRAMING_CHUNK;          // Offset the masks below describe
+    unsigned long long newlines = 0;
+    unsigned long long bars = 0;
+    
+    batch->malformed = 0;
+    while (count < FRAMING_MAX_SPANS && pos < length) {
+        FrameSpan *span = &batch->spans[count];
+        span->offset = pos;
+        
+        if ((unsigned char)buffer[pos] == CHAT_V2_MAGIC) {
+            int len = frame_length(buffer + pos, length - pos);
+            if (len < 0) batch->malformed = 1;
+            if (len <= 0) break;
+            span->length = len;
+            span->bar_count = 0;
+            count++;
+            pos += len;
+            continue;
+        }
+        
+        // v1 line: take separators up to the first newline at or after pos,
+        // reusing the masks of the chunk the previous line ended in
+        int scan = pos;
+        int found = 0;
+        int end = -1;
+        for (;;) {
+            if (scan >= chunk + FRAMING_CHUNK) {
+                chunk = scan;
+                load_chunk(buffer, length, chunk, masks, &newlines, &bars);
+            }
+            unsigned long long live = ~0ULL << (scan - chunk);
+            unsigned long long nl = newlines & live;
+            unsigned long long br = bars & live;
+            if (nl != 0) br &= (nl & (0 - nl)) - 1;
+            while (br != 0 && found < FRAMING_BARS) {
+                span->bars[found++] = chunk + lowest_bit(br) - pos;
+                br &= br - 1;
+            }
+            if (nl != 0) {
+                end = chunk + lowest_bit(nl);
+                break;
+            }
+            if (chunk + FRAMING_CHUNK >= length) break;
+            scan = chunk + FRAMING_CHUNK;
+            
+            // Past the separators only the newline matters: memchr finds
+            // it faster than building both masks for the rest of the content
+            if (found == FRAMING_BARS) {
+                const char *newline = (const char *)memchr(buffer + scan, '\n', length - scan);
+                if (newline != NULL) end = (int)(newline - buffer);
+                break;
+            }
+        }
+        if (end < 0) break;
+        
+        span->length = end + 1 - pos;
+        span->bar_count = found;
+        count++;
+        pos = end + 1;
+    }
+    
+    batch->count = count;
+    batch->consumed = pos;
+    return count;
+}
+
+static int split_scalar(const char *buffer, int length, FrameBatch *batch) {
+    return split_frames(buffer, length, batch, chunk_masks_scalar);
+}
+
+#ifdef FRAMING_HAVE_SSE2
+static FRAMING_INLINE void chunk_masks_sse2(const char *chunk, unsigned long long *newlines, unsigned long long *bars) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i bar = _mm_set1_epi8('|');
+    unsigned long long nl = 0;
+    unsigned long long br = 0;
+    for (int i = 0; i < FRAMING_CHUNK / 16; i++) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(chunk + i * 16));
+        nl |= (unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)) << (i * 16);
+        br |= (unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, bar)) << (i * 16);
+    }
+    *newlines = nl;
+    *bars = br;
+}
+
+FRAMING_AVX2_TARGET
+static FRAMING_INLINE void chunk_masks_avx2(const char *chunk, unsigned long long *newlines, unsigned long long *bars) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i bar = _mm256_set1_epi8('|');
+    __m256i low = _mm256_loadu_si256((const __m256i *)chunk);
+    __m256i high = _mm256_loadu_si256((const __m256i *)(chunk + 32));
+    *newlines = (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline))
+        | (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32;
+    *bars = (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, bar))
+        | (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, bar)) << 32;
+}
+
+static int split_sse2(const char *buffer, int length, FrameBatch *batch) {
+    return split_frames(buffer, length, batch, chunk_masks_sse2);
+}
+
+FRAMING_AVX2_TARGET
+static int split_avx2(const char *buffer, int length, FrameBatch *batch) {
+    return split_frames(buffer, length, batch, chunk_masks_avx2);
+}
+
+static int cpu_has_avx2(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 0;
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return 0;  // OSXSAVE, AVX
+    if ((_xgetbv(0) & 6) != 6) return 0;                                      // OS saves YMM state
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+FramingPath framing_best_path(void) {
+#ifdef FRAMING_HAVE_SSE2
+    return cpu_has_avx2() ? FRAMING_AVX2 : FRAMING_SSE2;
+#else
+    return FRAMING_SCALAR;
+#endif
+}
+
+/**
+ * Select the code path framing_split uses (the best one is picked on
+ * first use). Returns -1 if this build or CPU does not have it.
+ */
+int framing_use_path(FramingPath path) {
+    switch (path) {
+    case FRAMING_SCALAR:
+        split_function = split_scalar;
+        return 0;
+#ifdef FRAMING_HAVE_SSE2
+    case FRAMING_SSE2:
+        split_function = split_sse2;
+        return 0;
+    case FRAMING_AVX2:
+        if (!cpu_has_avx2()) return -1;
+        split_function = split_avx2;
+        return 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
+const char *framing_path_name(FramingPath path) {
+    switch (path) {
+    case FRAMING_SCALAR: return "scalar";
+    case FRAMING_SSE2: return "sse2";
+    case FRAMING_AVX2: return "avx2";
+    default: return "unknown";
+    }
+}
+
+/**
+ * Split the complete frames at the start of buffer, up to
+ * FRAMING_MAX_SPANS of them. Stops early at an incomplete frame, or at
+ * one whose header is invalid (batch->malformed). Returns batch->count;
+ * call again past batch->consumed when it is FRAMING_MAX_SPANS.
+ */
+int framing_split(const char *buffer, int length, FrameBatch *batch) {
+    if (split_function == NULL) framing_use_path(framing_best_path());
+    return split_function(buffer, length, batch);
+}
+
+/**
+ * Unsigned decimal of 1 to 9 digits filling the whole field
+ */
+static FRAMING_INLINE int parse_digits(const char *p, int len, int *value) {
+    if (len < 1 || len > 9) return -1;
+    int result = 0;
+    for (int i = 0; i < len; i++) {
+        if (p[i] < '0' || p[i] > '9') return -1;
+        result = result * 10 + (p[i] - '0');
+    }
+    *value = result;
+    return 0;
+}
+
+/**
+ * Fill a view for one span of a framing_split buffer; the same result as
+ * parse_message_view, but v1 fields come from the separators the split
+ * already found
+ */
+int framing_view(const char *buffer, const FrameSpan *span, ChatMessageView *view) {
+    const char *frame = buffer + span->offset;
+    view->frame = frame;
+    view->frame_len = span->length;
+    view->flags = 0;
+    view->seq = 0;
+    view->timestamp_ms = 0;
+    if ((unsigned char)frame[0] == CHAT_V2_MAGIC) {
+        parse_binary_view(frame, view);
+        return 0;
+    }
+    
+    view->proto = PROTO_TEXT;
+    
+    const char *end = frame + span->length - 1;
+    if (end > frame && end[-1] == '\r') end--;
+    if (span->bar_count < FRAMING_BARS) return -1;
+    const int *bars = span->bars;
+    
+    int type;
+    if (parse_digits(frame, bars[0], &type) != 0) return -1;
+    view->type = (MessageType)type;
+    
+    view->timestamp = frame + bars[0] + 1;
+    view->timestamp_len = bars[1] - bars[0] - 1;
+    if (view->timestamp_len >= MAX_TIMESTAMP_LEN) return -1;
+    view->username = frame + bars[1] + 1;
+    view->username_len = bars[2] - bars[1] - 1;
+    if (view->username_len >= MAX_USERNAME_LEN) return -1;
+    if (!valid_username(view->username, view->username_len)) return -1;
+    
+    if (parse_digits(frame + bars[2] + 1, bars[3] - bars[2] - 1, &view->content_length) != 0) return -1;
+    if (view->content_length >= MAX_MESSAGE_LEN) return -1;
+    view->content = frame + bars[3] + 1;
+    if (view->content_length != end - view->content) return -1;
+    
+    return 0;
+}
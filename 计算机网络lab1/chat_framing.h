@@ -0,0 +1,44 @@
+#ifndef CHAT_FRAMING_H
+#define CHAT_FRAMING_H
+
+#include "chat_protocol.h"
+
+// Splits a receive buffer into frames in one pass. v1 bytes are compared
+// 64 at a time against '\n' and '|' (AVX2 or SSE2 when the CPU has them,
+// plain C otherwise), so every byte is looked at once: the same pass that
+// finds the end of a line also records where its fields are, and
+// framing_view builds the view from those offsets without scanning the
+// line again. v2 frames are stepped over by their header length.
+#define FRAMING_MAX_SPANS 64             // Frames returned per call
+#define FRAMING_BARS 4                   // '|' separators before v1 content
+
+typedef enum {
+    FRAMING_SCALAR,
+    FRAMING_SSE2,
+    FRAMING_AVX2,
+    FRAMING_PATH_COUNT
+} FramingPath;
+
+// One complete frame of the split buffer
+typedef struct {
+    int offset;                          // Start of the frame in the buffer
+    int length;                          // As frame_length returns it (v1 includes "\n")
+    int bar_count;                       // v1: separators found, at most FRAMING_BARS
+    int bars[FRAMING_BARS];              // v1: offsets of the first separators in the frame
+} FrameSpan;
+
+typedef struct {
+    FrameSpan spans[FRAMING_MAX_SPANS];
+    int count;                           // Complete frames at the start of the buffer
+    int consumed;                        // Bytes they cover
+    int malformed;                       // The next frame has an invalid header
+} FrameBatch;
+
+// Function prototypes
+FramingPath framing_best_path(void);
+int framing_use_path(FramingPath path);
+const char *framing_path_name(FramingPath path);
+int framing_split(const char *buffer, int length, FrameBatch *batch);
+int framing_view(const char *buffer, const FrameSpan *span, ChatMessageView *view);
+
+#endif // CHAT_FRAMING_H
@@ -0,0 +1,509 @@
+/**
+ * Fuzz harness for the chat protocol parsers.
+ *
+ * Each input is used three ways:
+ *   - as one v1 line for deserialize_message (NUL-terminated copy)
+ *   - as one v2 frame for deserialize_message_v2
+ *   - as a byte stream fed through the server's receive loop: chunks are
+ *     sent over a loopback socket and read into a RingBuffer, frame_length
+ *     splits what ring_peek returns, and every frame goes through
+ *     parse_message_view and encode_view_frame
+ * framing_split must cut every buffer the receive loop sees (and the
+ * whole input) into the same frames as frame_length, on each code path
+ * the CPU supports, and framing_view must agree with parse_message_view.
+ * Anything that parses must survive a round trip through the encoder and
+ * parse back to the same fields; a mismatch aborts.
+ *
+ * libFuzzer: clang -g -O1 -fsanitize=fuzzer,address chat_fuzz.c chat_protocol.c chat_framing.c chat_buffer.c -o chat_fuzz -lws2_32
+ * Without libFuzzer, -DCHAT_FUZZ_MAIN adds a main that replays the files
+ * given on the command line, or with none runs a built-in mutator over
+ * seed frames:
+ *   gcc -O1 -g -DCHAT_FUZZ_MAIN chat_fuzz.c chat_protocol.c chat_framing.c chat_buffer.c -o chat_fuzz -lws2_32
+ * Usage: chat_fuzz [--runs N] [files...]
+ */
+
+#include "chat_protocol.h"
+#include "chat_buffer.h"
+#include "chat_framing.h"
+
+#define FUZZ_MAX_INPUT (MAX_BUFFER_SIZE * 4)
+#define FUZZ_RING_MAX (BUFFER_MIN_SIZE * 2)   // Receive ring cap, so long lines hit RING_FULL
+#define DEFAULT_FUZZ_RUNS 1000000
+
+#define FUZZ_CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "chat_fuzz: check failed at %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        abort(); \
+    } \
+} while (0)
+
+/**
+ * A parsed v1 line must serialize and parse back unchanged
+ */
+static void check_text_message(const char *data, size_t size) {
+    static char line[FUZZ_MAX_INPUT + 1];
+    char buffer[MAX_BUFFER_SIZE];
+    ChatMessage msg;
+    ChatMessage again;
+    
+    memcpy(line, data, size);
+    line[size] = '\0';
+    if (deserialize_message(line, &msg) != 0) return;
+    
+    FUZZ_CHECK(msg.content_length >= 0 && msg.content_length < MAX_MESSAGE_LEN);
+    FUZZ_CHECK(strlen(msg.username) < MAX_USERNAME_LEN);
+    FUZZ_CHECK(msg.content[msg.content_length] == '\0');
+    
+    int len = serialize_message(&msg, buffer, sizeof(buffer));
+    FUZZ_CHECK(len > 0);
+    FUZZ_CHECK(deserialize_message(buffer, &again) == 0);
+    FUZZ_CHECK(again.type == msg.type);
+    FUZZ_CHECK(strcmp(again.timestamp, msg.timestamp) == 0);
+    FUZZ_CHECK(strcmp(again.username, msg.username) == 0);
+    FUZZ_CHECK(again.content_length == msg.content_length);
+    FUZZ_CHECK(memcmp(again.content, msg.content, msg.content_length) == 0);
+}
+
+/**
+ * A parsed v2 frame must serialize back to the same bytes
+ */
+static void check_binary_message(const char *data, size_t size) {
+    char buffer[MAX_BUFFER_SIZE];
+    ChatMessage msg;
+    
+    if (deserialize_message_v2(data, size, &msg) != 0) return;
+    
+    FUZZ_CHECK(msg.content_length >= 0 && msg.content_length < MAX_MESSAGE_LEN);
+    FUZZ_CHECK(size == CHAT_V2_HEADER_LEN + (unsigned char)data[15] + (size_t)msg.content_length);
+    
+    // Usernames cannot hold a NUL, so only a zero timestamp, replaced on
+    // the way out, can make the bytes differ
+    FUZZ_CHECK(strlen(msg.username) == (unsigned char)data[15]);
+    if (msg.timestamp_ms == 0) return;
+    int len = serialize_message_v2(&msg, buffer, sizeof(buffer));
+    FUZZ_CHECK(len == (int)size);
+    FUZZ_CHECK(memcmp(buffer, data, size) == 0);
+}
+
+/**
+ * Re-encode a view in both formats and check the fields survive
+ */
+static void check_view(const ChatMessageView *view) {
+    char v1[MAX_BUFFER_SIZE * 2];
+    char v2[MAX_BUFFER_SIZE];
+    ChatMessageView back;
+    
+    FUZZ_CHECK(view->content_length >= 0 && view->content_length < MAX_MESSAGE_LEN);
+    FUZZ_CHECK(view->username_len >= 0 && view->username_len < MAX_USERNAME_LEN);
+    FUZZ_CHECK(view->content + view->content_length <= view->frame + view->frame_len);
+    FUZZ_CHECK(valid_username(view->username, view->username_len));
+    
+    // A v1 frame is relayed as it is, so it must end with its content
+    if (view->proto == PROTO_TEXT) {
+        int content_end = (int)(view->content - view->frame) + view->content_length;
+        int terminator = view->frame_len - content_end;
+        FUZZ_CHECK(view->timestamp_len >= 0 && view->timestamp_len < MAX_TIMESTAMP_LEN);
+        FUZZ_CHECK(terminator == 1 || terminator == 2);
+        FUZZ_CHECK(view->frame[view->frame_len - 1] == '\n');
+        if (terminator == 2) FUZZ_CHECK(view->frame[content_end] == '\r');
+    }
+    
+    int len = encode_view_frame(view, PROTO_BINARY, v2, sizeof(v2));
+    if (len > 0) {
+        FUZZ_CHECK(frame_length(v2, len) == len);
+        FUZZ_CHECK(parse_message_view(v2, len, &back) == 0);
+        FUZZ_CHECK(back.type == (MessageType)(unsigned char)view->type);
+        FUZZ_CHECK(back.username_len == view->username_len);
+        FUZZ_CHECK(memcmp(back.username, view->username, view->username_len) == 0);
+        FUZZ_CHECK(back.content_length == view->content_length);
+        FUZZ_CHECK(memcmp(back.content, view->content, view->content_length) == 0);
+    }
+    
+    // The v1 line must be exactly one frame with the same sender, whatever
+    // a v2 sender put in its header; only newlines in content are replaced
+    len = encode_view_frame(view, PROTO_TEXT, v1, sizeof(v1));
+    if (len > 0) {
+        FUZZ_CHECK(frame_length(v1, len) == len);
+        FUZZ_CHECK(parse_message_view(v1, len, &back) == 0);
+        FUZZ_CHECK(back.type == view->type);
+        FUZZ_CHECK(back.username_len == view->username_len);
+        FUZZ_CHECK(memcmp(back.username, view->username, view->username_len) == 0);
+        FUZZ_CHECK(back.content_length == view->content_length);
+    }
+}
+
+static int same_view(const ChatMessageView *a, const ChatMessageView *b) {
+    return a->proto == b->proto && a->type == b->type && a->frame == b->frame
+        && a->frame_len == b->frame_len && a->flags == b->flags && a->seq == b->seq
+        && a->timestamp_ms == b->timestamp_ms && a->timestamp == b->timestamp
+        && a->timestamp_len == b->timestamp_len && a->username == b->username
+        && a->username_len == b->username_len && a->content == b->content
+        && a->content_length == b->content_length;
+}
+
+/**
+ * Split a buffer with framing_split on every supported code path and
+ * compare with frame_length and parse_message_view frame by frame
+ */
+static void check_split(const char *buffer, int length) {
+    for (int path = 0; path < FRAMING_PATH_COUNT; path++) {
+        if (framing_use_path((FramingPath)path) != 0) continue;
+        
+        FrameBatch batch;
+        int pos = 0;
+        do {
+            const char *base = buffer + pos;
+            framing_split(base, length - pos, &batch);
+            FUZZ_CHECK(batch.count >= 0 && batch.count <= FRAMING_MAX_SPANS);
+            
+            int offset = 0;
+            for (int i = 0; i < batch.count; i++) {
+                const FrameSpan *span = &batch.spans[i];
+                FUZZ_CHECK(span->offset == offset);
+                FUZZ_CHECK(span->length == frame_length(base + offset, length - pos - offset));
+                
+                ChatMessageView expected;
+                ChatMessageView actual;
+                int result = parse_message_view(base + offset, span->length, &expected);
+                FUZZ_CHECK(framing_view(base, span, &actual) == result);
+                FUZZ_CHECK(result != 0 || same_view(&expected, &actual));
+                offset += span->length;
+            }
+            FUZZ_CHECK(batch.consumed == offset);
+            pos += offset;
+        } while (batch.count == FRAMING_MAX_SPANS);
+        
+        int rest = frame_length(buffer + pos, length - pos);
+        FUZZ_CHECK(batch.malformed ? rest < 0 : rest == 0);
+    }
+    framing_use_path(framing_best_path());
+}
+
+/**
+ * Loopback TCP pair the receive loop reads from, made (together with the
+ * receive block pool) on first use
+ */
+static int open_stream(SOCKET *tx, SOCKET *rx) {
+    static SOCKET sender = INVALID_SOCKET;
+    static SOCKET receiver = INVALID_SOCKET;
+    if (receiver != INVALID_SOCKET) {
+        *tx = sender;
+        *rx = receiver;
+        return 0;
+    }
+    
+    buffer_pool_init();
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return -1;
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) return -1;
+    struct sockaddr_in addr;
+    int addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(listener, 1) == SOCKET_ERROR ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) == SOCKET_ERROR) {
+        closesocket(listener);
+        return -1;
+    }
+    sender = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sender == INVALID_SOCKET || connect(sender, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        closesocket(listener);
+        return -1;
+    }
+    receiver = accept(listener, NULL, NULL);
+    closesocket(listener);
+    if (receiver == INVALID_SOCKET) return -1;
+    
+    // Chunks are tiny and each is read before the next is sent
+    BOOL no_delay = TRUE;
+    setsockopt(sender, IPPROTO_TCP, TCP_NODELAY, (const char *)&no_delay, sizeof(no_delay));
+    *tx = sender;
+    *rx = receiver;
+    return 0;
+}
+
+/**
+ * Read and drop bytes sent but not yet received, so the next input
+ * starts on an empty stream
+ */
+static void drain_stream(SOCKET rx, int pending) {
+    char scratch[256];
+    while (pending > 0) {
+        int got = recv(rx, scratch, pending < (int)sizeof(scratch) ? pending : (int)sizeof(scratch), 0);
+        FUZZ_CHECK(got > 0);
+        pending -= got;
+    }
+}
+
+/**
+ * Feed the input through the server's receive loop: chunks go over a
+ * loopback socket into a RingBuffer with ring_recv, and complete frames
+ * are taken with ring_peek and ring_advance, so frames wrap around the
+ * end of the block and the ring grows and shrinks. The first byte picks
+ * the chunk size. Every frame must be the next bytes of the input.
+ */
+static void check_receive_loop(const char *data, size_t size) {
+    SOCKET tx, rx;
+    if (size == 0 || open_stream(&tx, &rx) != 0) return;
+    
+    unsigned char pick = (unsigned char)data[0];
+    int chunk = pick % 64 + 1;
+    if (pick & 0x80) chunk *= 64;
+    data++;
+    size--;
+    
+    RingBuffer ring;
+    ring_init(&ring);
+    size_t sent = 0;
+    size_t consumed = 0;
+    while (sent < size) {
+        int pending = (int)(size - sent < (size_t)chunk ? size - sent : (size_t)chunk);
+        FUZZ_CHECK(send(tx, data + sent, pending, 0) == pending);
+        sent += pending;
+        
+        while (pending > 0) {
+            int got = ring_recv(&ring, rx, FUZZ_RING_MAX);
+            if (got == RING_FULL) {
+                // Line too long: the server closes here
+                drain_stream(rx, pending);
+                ring_release(&ring);
+                return;
+            }
+            FUZZ_CHECK(got > 0 && got <= pending);
+            pending -= got;
+            
+            for (;;) {
+                int length;
+                const char *base = ring_peek(&ring, &length);
+                if (base == NULL) break;
+                check_split(base, length);
+                
+                int used = 0;
+                for (;;) {
+                    int len = frame_length(base + used, length - used);
+                    if (len == 0) break;
+                    if (len < 0) {
+                        // Malformed frame: the server closes here
+                        drain_stream(rx, pending);
+                        ring_release(&ring);
+                        return;
+                    }
+                    FUZZ_CHECK(len <= length - used);
+                    FUZZ_CHECK(memcmp(base + used, data + consumed, len) == 0);
+                    
+                    ChatMessageView view;
+                    if (parse_message_view(base + used, len, &view) == 0) {
+                        check_view(&view);
+                    }
+                    used += len;
+                    consumed += len;
+                }
+                
+                int more = ring_advance(&ring, used, length);
+                FUZZ_CHECK(more != RING_NO_MEMORY);
+                if (!more) break;
+            }
+        }
+    }
+    // What is left is one incomplete frame, none stuck behind a wrap
+    FUZZ_CHECK((size_t)ring.count == size - consumed);
+    FUZZ_CHECK(frame_length(data + consumed, size - consumed) == 0);
+    ring_release(&ring);
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+    if (size > FUZZ_MAX_INPUT) return 0;
+    
+    check_text_message((const char *)data, size);
+    check_binary_message((const char *)data, size);
+    check_receive_loop((const char *)data, size);
+    check_split((const char *)data, (int)size);
+    return 0;
+}
+
+#ifdef CHAT_FUZZ_MAIN
+
+static unsigned long long fuzz_random(void) {
+    // xorshift64, fixed seed so a failing run can be repeated
+    static unsigned long long state = 88172645463325252ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/**
+ * Seed inputs: well-formed frames of both formats, alone and back to back
+ */
+static int build_seeds(char seeds[][FUZZ_MAX_INPUT], int *lengths, int max_seeds) {
+    static const MessageType types[] = { MSG_JOIN, MSG_MESSAGE, MSG_LIST, MSG_DIRECT, MSG_RESUME };
+    static const int sizes[] = { 0, 1, 32, 600, MAX_MESSAGE_LEN - 1 };
+    int count = 0;
+    
+    for (int t = 0; t < (int)(sizeof(types) / sizeof(types[0])); t++) {
+        for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])) && count + 2 <= max_seeds; s++) {
+            ChatMessage msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.type = types[t];
+            get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+            strcpy(msg.username, "fuzz_user");
+            for (int i = 0; i < sizes[s]; i++) {
+                msg.content[i] = (char)('a' + i % 26);
+            }
+            msg.content_length = sizes[s];
+            
+            int len = serialize_message(&msg, seeds[count], FUZZ_MAX_INPUT - 1);
+            seeds[count][len++] = '\n';
+            lengths[count++] = len;
+            
+            lengths[count] = serialize_message_v2(&msg, seeds[count], FUZZ_MAX_INPUT);
+            count++;
+        }
+    }
+    
+    // Mixed stream behind a chunk-size byte, as check_receive_loop expects
+    if (count < max_seeds) {
+        int len = 0;
+        seeds[count][len++] = 7;
+        for (int i = 0; i < 4 && len + lengths[i] <= FUZZ_MAX_INPUT; i++) {
+            memcpy(seeds[count] + len, seeds[i], lengths[i]);
+            len += lengths[i];
+        }
+        lengths[count++] = len;
+    }
+    
+    // Hundreds of short frames, more than one framing_split call returns
+    if (count < max_seeds) {
+        int len = 0;
+        seeds[count][len++] = 64;
+        for (int i = 0; len + lengths[i % 2] <= FUZZ_MAX_INPUT; i++) {
+            memcpy(seeds[count] + len, seeds[i % 2], lengths[i % 2]);
+            len += lengths[i % 2];
+        }
+        lengths[count++] = len;
+    }
+    return count;
+}
+
+/**
+ * One random edit of the input, biased towards the length fields and
+ * separators the parsers trust
+ */
+static size_t mutate(char *data, size_t size, const char *other, size_t other_size) {
+    static const int interesting[] = { 0, 1, 0x7F, 0x80, 0xFF, MAX_USERNAME_LEN - 1, MAX_USERNAME_LEN };
+    size_t pos = size > 0 ? (size_t)(fuzz_random() % size) : 0;
+    
+    switch (fuzz_random() % 8) {
+    case 0:
+        if (size > 0) data[pos] ^= (char)(1 << (fuzz_random() % 8));
+        break;
+    case 1:
+        if (size > 0) data[pos] = (char)fuzz_random();
+        break;
+    case 2:
+        if (size > 0) data[pos] = (char)interesting[fuzz_random() % (sizeof(interesting) / sizeof(interesting[0]))];
+        break;
+    case 3:
+        if (size > 0) data[pos] = "|\n\r0\0"[fuzz_random() % 5];
+        break;
+    case 4:
+        if (size < FUZZ_MAX_INPUT) {
+            memmove(data + pos + 1, data + pos, size - pos);
+            data[pos] = (char)fuzz_random();
+            size++;
+        }
+        break;
+    case 5:
+        if (size > 0) {
+            size_t count = 1 + (size_t)(fuzz_random() % (size - pos));
+            memmove(data + pos, data + pos + count, size - pos - count);
+            size -= count;
+        }
+        break;
+    case 6:
+        // Splice another seed in
+        if (other_size > 0) {
+            size_t count = 1 + (size_t)(fuzz_random() % other_size);
+            if (pos + count > FUZZ_MAX_INPUT) count = FUZZ_MAX_INPUT - pos;
+            memcpy(data + pos, other, count);
+            if (pos + count > size) size = pos + count;
+        }
+        break;
+    default:
+        // Rewrite a decimal run in a v1 header
+        for (size_t i = pos; i < size; i++) {
+            if (data[i] >= '0' && data[i] <= '9') {
+                data[i] = (char)('0' + fuzz_random() % 10);
+                break;
+            }
+        }
+        break;
+    }
+    return size;
+}
+
+static int run_file(const char *path) {
+    static unsigned char data[FUZZ_MAX_INPUT];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    
+    LLVMFuzzerTestOneInput(data, size);
+    printf("%s: ok (%zu bytes)\n", path, size);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static char seeds[64][FUZZ_MAX_INPUT];
+    static int lengths[64];
+    static char input[FUZZ_MAX_INPUT];
+    long long runs = DEFAULT_FUZZ_RUNS;
+    int files = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoll(argv[++i]);
+        } else {
+            if (run_file(argv[i]) != 0) return 1;
+            files++;
+        }
+    }
+    if (files > 0) return 0;
+    if (runs <= 0) {
+        printf("Usage: %s [--runs N] [files...]\n", argv[0]);
+        return 1;
+    }
+    
+    int seed_count = build_seeds(seeds, lengths, 64);
+    for (int i = 0; i < seed_count; i++) {
+        LLVMFuzzerTestOneInput((const unsigned char *)seeds[i], lengths[i]);
+    }
+    
+    for (long long run = 0; run < runs; run++) {
+        int seed = (int)(fuzz_random() % seed_count);
+        int other = (int)(fuzz_random() % seed_count);
+        size_t size = lengths[seed];
+        memcpy(input, seeds[seed], size);
+        
+        int edits = 1 + (int)(fuzz_random() % 8);
+        for (int e = 0; e < edits; e++) {
+            size = mutate(input, size, seeds[other], lengths[other]);
+        }
+        LLVMFuzzerTestOneInput((const unsigned char *)input, size);
+        
+        if ((run + 1) % 100000 == 0) {
+            printf("%lld runs\n", run + 1);
+        }
+    }
+    printf("%lld runs, no failures\n", runs);
+    return 0;
+}
+
+#endif // CHAT_FUZZ_MAIN
@@ -0,0 +1,88 @@
+#include "chat_history.h"
+
+/**
+ * Allocate an empty history of the given length.
+ * Returns NULL if capacity is 0 (history disabled) or out of memory.
+ */
+MessageHistory *history_create(int capacity) {
+    if (capacity <= 0) return NULL;
+    
+    MessageHistory *history = (MessageHistory *)calloc(1, sizeof(MessageHistory));
+    if (history == NULL) return NULL;
+    
+    history->frames = (Frame **)malloc(sizeof(Frame *) * capacity);
+    if (history->frames == NULL) {
+        free(history);
+        return NULL;
+    }
+    InitializeSRWLock(&history->lock);
+    history->capacity = capacity;
+    return history;
+}
+
+/**
+ * Release every frame and free the history (NULL is ignored)
+ */
+void history_destroy(MessageHistory *history) {
+    if (history == NULL) return;
+    
+    for (int i = 0; i < history->count; i++) {
+        frame_release(history->frames[(history->head + i) % history->capacity]);
+    }
+    free(history->frames);
+    free(history);
+}
+
+/**
+ * Record a frame, replacing the oldest one when full. The history takes
+ * its own reference and numbers the frame, so a reader of history_copy()
+ * can tell recorded frames it already has from newer ones.
+ */
+void history_append(MessageHistory *history, Frame *frame) {
+    if (history == NULL) return;
+    
+    InterlockedIncrement(&frame->refcount);
+    AcquireSRWLockExclusive(&history->lock);
+    
+    frame->history_seq = ++history->last_seq;
+    
+    Frame *evicted = NULL;
+    if (history->count == history->capacity) {
+        evicted = history->frames[history->head];
+        history->frames[history->head] = frame;
+        history->head = (history->head + 1) % history->capacity;
+    } else {
+        history->frames[(history->head + history->count) % history->capacity] = frame;
+        history->count++;
+    }
+    
+    ReleaseSRWLockExclusive(&history->lock);
+    
+    if (evicted != NULL) {
+        frame_release(evicted);
+    }
+}
+
+/**
+ * Copy up to max_frames of the newest frames, oldest first, taking a
+ * reference to each. *last_seq receives the history_seq of the newest
+ * recorded frame. Returns the number of frames copied.
+ */
+int history_copy(MessageHistory *history, Frame **frames, int max_frames, LONG64 *last_seq) {
+    *last_seq = 0;
+    if (history == NULL) return 0;
+    
+    AcquireSRWLockShared(&history->lock);
+    
+    int count = history->count < max_frames ? history->count : max_frames;
+    int skip = history->count - count;
+    for (int i = 0; i < count; i++) {
+        Frame *frame = history->frames[(history->head + skip + i) % history->capacity];
+        InterlockedIncrement(&frame->refcount);
+        frames[i] = frame;
+    }
+    *last_seq = history->last_seq;
+    
+    ReleaseSRWLockShared(&history->lock);
+    return count;
+}
@@ -0,0 +1,26 @@
+#ifndef CHAT_HISTORY_H
+#define CHAT_HISTORY_H
+
+#include "chat_frame.h"
+
+#define DEFAULT_HISTORY_LEN 50
+#define MAX_HISTORY_LEN 1000
+
+// The last N frames of the lobby or of one room, kept as references to
+// the already-serialized frames (oldest at head)
+typedef struct {
+    SRWLOCK lock;
+    Frame **frames;
+    int capacity;
+    int head;
+    int count;
+    LONG64 last_seq;                 // history_seq of the newest frame
+} MessageHistory;
+
+// Function prototypes
+MessageHistory *history_create(int capacity);
+void history_destroy(MessageHistory *history);
+void history_append(MessageHistory *history, Frame *frame);
+int history_copy(MessageHistory *history, Frame **frames, int max_frames, LONG64 *last_seq);
+
+#endif // CHAT_HISTORY_H
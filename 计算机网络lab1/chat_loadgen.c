@@ -0,0 +1,787 @@
+/**
+ * Headless load generator for the chat server.
+ *
+ * Opens many client connections, joins each one with MSG_NICKNAME, then
+ * has some of them send MSG_MESSAGE at a fixed total rate. Each message
+ * carries its send time, so every recipient measures the end-to-end
+ * broadcast latency. The result is printed to stdout as one JSON object
+ * so runs of different builds can be compared; progress goes to stderr.
+ * With --server-pid the server's CPU time and memory are sampled too;
+ * run with --rate 0 to measure what an idle connection costs the server
+ * (rss_per_client_bytes, its working set growth divided by the clients).
+ * With --server-admin the server's metrics socket is read before and
+ * after sending, to report how many frames each WSASend carried; compare
+ * runs of a server started with different --flush-window values to see
+ * what write coalescing trades in latency for fewer send calls. The admin
+ * socket only listens on 127.0.0.1, so --server-admin needs a loopback
+ * --host.
+ *
+ * Build: gcc -O2 chat_loadgen.c chat_protocol.c -o chat_loadgen -lws2_32 -lpsapi
+ * Usage: chat_loadgen [--host IP] [--clients N] [--senders N] [--rate MSGS_PER_SEC]
+ *                     [--size BYTES] [--duration SECONDS] [--threads N] [--v1]
+ *                     [--server-pid PID] [--server-admin PORT]
+ */
+
+#include "chat_protocol.h"
+#include <psapi.h>
+
+#pragma comment(lib, "psapi.lib")
+
+#define MAX_LOADGEN_THREADS 64
+#define HANDSHAKE_WINDOW 64              // Handshakes in flight per thread
+#define HANDSHAKE_TIMEOUT_MS 30000
+#define DRAIN_MS 2000                    // Time for late deliveries once sending stops
+#define ADMIN_REPLY_LEN 16384            // Largest metrics reply read from the server
+#define STAMP_LEN 40                     // Room for the run ID and send time
+#define HIST_SUB_BITS 5                  // 32 buckets per power of two, about 3% error
+#define HIST_LINEAR (2 << HIST_SUB_BITS) // Values below this get exact buckets
+#define HIST_BUCKETS (HIST_LINEAR + (64 - HIST_SUB_BITS - 1) * (1 << HIST_SUB_BITS))
+
+// Phases of a run, advanced by the main thread
+typedef enum {
+    PHASE_HANDSHAKE = 0,
+    PHASE_SENDING = 1,
+    PHASE_DRAINING = 2,
+    PHASE_DONE = 3
+} LoadPhase;
+
+// Log-linear histogram of microsecond values
+typedef struct {
+    LONG64 counts[HIST_BUCKETS];
+    LONG64 total;
+    LONG64 max;
+    double sum;
+} Histogram;
+
+// One simulated client
+typedef struct {
+    SOCKET socket;
+    int index;
+    int sender;                      // Sends messages during the run
+    int joined;
+    LONG64 handshake_start;          // now_ns() when connect started
+    LONG64 received;                 // Stamped messages of this run
+    char recv_buffer[MAX_BUFFER_SIZE * 2];
+    int recv_pos;
+    char send_buffer[MAX_BUFFER_SIZE];  // Bytes the socket did not take yet
+    int send_pos;
+    int send_len;
+} LoadConn;
+
+// One thread driving a contiguous block of clients
+typedef struct {
+    HANDLE thread;
+    LoadConn *conns;
+    WSAPOLLFD *fds;
+    int count;
+    int senders;
+    int next_sender;
+    Histogram latency;
+    Histogram handshake;
+    LONG64 sent;
+    LONG64 stalls;                   // Sends skipped because the socket was full
+    LONG64 delivered;
+    int joined;
+    int failed;
+} LoadThread;
+
+// Options
+static const char *host = "127.0.0.1";
+static int client_count = 100;
+static int sender_count = -1;        // Default: every client
+static double total_rate = 100.0;
+static int message_size = 64;
+static int duration_s = 10;
+static int thread_count = 4;
+static ProtocolVersion protocol = PROTO_BINARY;
+static DWORD server_pid = 0;
+static int server_admin_port = 0;
+
+static struct sockaddr_in server_addr;
+static unsigned int run_id;          // Tells this run's messages from replayed history
+static volatile LONG phase = PHASE_HANDSHAKE;
+static volatile LONG threads_ready = 0;
+static volatile LONG64 send_start_ns = 0;
+static LoadThread threads[MAX_LOADGEN_THREADS];
+
+static LONG64 now_ns(void) {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    // Split so the multiplication cannot overflow on long uptimes
+    return (counter.QuadPart / frequency.QuadPart) * 1000000000LL +
+        (counter.QuadPart % frequency.QuadPart) * 1000000000LL / frequency.QuadPart;
+}
+
+static void histogram_record(Histogram *h, LONG64 value) {
+    if (value < 0) value = 0;
+    
+    int index;
+    if (value < HIST_LINEAR) {
+        index = (int)value;
+    } else {
+        int msb = 0;
+        while ((value >> (msb + 1)) != 0) msb++;
+        int shift = msb - HIST_SUB_BITS;
+        index = HIST_LINEAR + (msb - HIST_SUB_BITS - 1) * (1 << HIST_SUB_BITS) +
+            (int)((value >> shift) - (1 << HIST_SUB_BITS));
+    }
+    
+    h->counts[index]++;
+    h->total++;
+    h->sum += (double)value;
+    if (value > h->max) h->max = value;
+}
+
+static void histogram_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) into->max = from->max;
+}
+
+/**
+ * Value at a percentile (0-100), the middle of its bucket
+ */
+static LONG64 histogram_percentile(const Histogram *h, double percentile) {
+    if (h->total == 0) return 0;
+    
+    LONG64 rank = (LONG64)(percentile / 100.0 * (double)h->total + 0.5);
+    if (rank < 1) rank = 1;
+    LONG64 seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen < rank) continue;
+        if (i < HIST_LINEAR) return i;
+        
+        int k = i - HIST_LINEAR;
+        int shift = k >> HIST_SUB_BITS;
+        LONG64 low = (LONG64)((1 << HIST_SUB_BITS) + (k & ((1 << HIST_SUB_BITS) - 1))) << (shift + 1);
+        LONG64 mid = low + ((1LL << (shift + 1)) >> 1);
+        return mid < h->max ? mid : h->max;
+    }
+    return h->max;
+}
+
+static void print_histogram(const char *name, const Histogram *h, const char *suffix) {
+    printf("  \"%s\": {\"count\": %lld, \"mean\": %.1f, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, "
+           "\"p999\": %lld, \"max\": %lld}%s\n",
+        name, h->total, h->total > 0 ? h->sum / (double)h->total : 0.0,
+        histogram_percentile(h, 50), histogram_percentile(h, 90), histogram_percentile(h, 99),
+        histogram_percentile(h, 99.9), h->max, suffix);
+}
+
+/**
+ * Serialize a message in the run's wire format
+ */
+static int encode_message(const ChatMessage *msg, char *buffer, int size) {
+    if (protocol == PROTO_BINARY) {
+        return serialize_message_v2(msg, buffer, size);
+    }
+    int len = serialize_message(msg, buffer, size - 1);
+    if (len < 0) return -1;
+    buffer[len++] = '\n';
+    return len;
+}
+
+/**
+ * Write a frame, keeping what the socket does not take for later.
+ * Returns 0, or -1 if the connection failed.
+ */
+static int send_frame(LoadThread *t, LoadConn *conn, const char *data, int len) {
+    int sent = send(conn->socket, data, len, 0);
+    if (sent == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK) return -1;
+        sent = 0;
+    }
+    if (sent < len) {
+        memcpy(conn->send_buffer, data + sent, len - sent);
+        conn->send_pos = 0;
+        conn->send_len = len - sent;
+        t->fds[conn - t->conns].events |= POLLWRNORM;
+    }
+    return 0;
+}
+
+static void flush_pending(LoadThread *t, LoadConn *conn) {
+    int sent = send(conn->socket, conn->send_buffer + conn->send_pos, conn->send_len - conn->send_pos, 0);
+    if (sent == SOCKET_ERROR) return;
+    conn->send_pos += sent;
+    if (conn->send_pos == conn->send_len) {
+        conn->send_len = 0;
+        t->fds[conn - t->conns].events = POLLRDNORM;
+    }
+}
+
+/**
+ * Connect one client and send its NICKNAME. The ACK is awaited by the
+ * poll loop. Returns 0, or -1 if it could not connect.
+ */
+static int start_client(LoadThread *t, LoadConn *conn) {
+    conn->handshake_start = now_ns();
+    conn->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (conn->socket == INVALID_SOCKET) return -1;
+    
+    u_long mode = 1;
+    if (connect(conn->socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR ||
+        ioctlsocket(conn->socket, FIONBIO, &mode) == SOCKET_ERROR) {
+        closesocket(conn->socket);
+        conn->socket = INVALID_SOCKET;
+        return -1;
+    }
+    t->fds[conn - t->conns].fd = conn->socket;
+    t->fds[conn - t->conns].events = POLLRDNORM;
+    
+    ChatMessage msg;
+    char frame[MAX_BUFFER_SIZE];
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_NICKNAME;
+    get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    strcpy(msg.username, protocol == PROTO_BINARY ? CHAT_V2_CAPABILITY : "loadgen");
+    msg.content_length = snprintf(msg.content, sizeof(msg.content), "lg%08x_%d", run_id, conn->index);
+    
+    int len = encode_message(&msg, frame, sizeof(frame));
+    if (len < 0 || send_frame(t, conn, frame, len) != 0) {
+        closesocket(conn->socket);
+        conn->socket = INVALID_SOCKET;
+        t->fds[conn - t->conns].fd = INVALID_SOCKET;
+        return -1;
+    }
+    return 0;
+}
+
+static void drop_client(LoadThread *t, LoadConn *conn) {
+    closesocket(conn->socket);
+    conn->socket = INVALID_SOCKET;
+    t->fds[conn - t->conns].fd = INVALID_SOCKET;
+    if (conn->joined) {
+        conn->joined = 0;
+        t->joined--;
+    }
+    t->failed++;
+}
+
+/**
+ * Answer a server heartbeat so idle clients are not evicted. Skipped
+ * while a partial frame is pending; that write counts as activity.
+ */
+static void answer_ping(LoadThread *t, LoadConn *conn) {
+    if (conn->send_len != 0) return;
+    
+    ChatMessage msg;
+    char frame[MAX_BUFFER_SIZE];
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_PONG;
+    get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    strcpy(msg.username, "loadgen");
+    int len = encode_message(&msg, frame, sizeof(frame));
+    if (len > 0 && send_frame(t, conn, frame, len) != 0) {
+        drop_client(t, conn);
+    }
+}
+
+/**
+ * Handle one received frame. Returns 1 if it finished the handshake.
+ */
+static int handle_frame(LoadThread *t, LoadConn *conn, const ChatMessageView *view, LONG64 now) {
+    if (!conn->joined) {
+        if (view->type == MSG_ACK) {
+            conn->joined = 1;
+            t->joined++;
+            histogram_record(&t->handshake, (now - conn->handshake_start) / 1000);
+            return 1;
+        }
+        if (view->type == MSG_ERROR) {
+            fprintf(stderr, "Client %d rejected: %.*s\n", conn->index, view->content_length, view->content);
+            drop_client(t, conn);
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (view->type == MSG_PING) {
+        answer_ping(t, conn);
+        return 0;
+    }
+    if (view->type != MSG_MESSAGE || view->content_length < 2 || memcmp(view->content, "LG", 2) != 0) {
+        return 0;
+    }
+    
+    char stamp[STAMP_LEN + 1];
+    int len = view->content_length < STAMP_LEN ? view->content_length : STAMP_LEN;
+    memcpy(stamp, view->content, len);
+    stamp[len] = '\0';
+    
+    unsigned int stamp_run;
+    long long sent_ns;
+    if (sscanf(stamp, "LG%x %lld", &stamp_run, &sent_ns) == 2 && stamp_run == run_id) {
+        conn->received++;
+        t->delivered++;
+        histogram_record(&t->latency, (now - sent_ns) / 1000);
+    }
+    return 0;
+}
+
+/**
+ * Read what a socket has and process complete frames.
+ * Returns the number of handshakes finished.
+ */
+static int read_client(LoadThread *t, LoadConn *conn) {
+    int space = (int)sizeof(conn->recv_buffer) - conn->recv_pos;
+    int received = recv(conn->socket, conn->recv_buffer + conn->recv_pos, space, 0);
+    if (received == 0 || (received == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) {
+        int was_handshaking = !conn->joined;
+        drop_client(t, conn);
+        return was_handshaking;
+    }
+    if (received == SOCKET_ERROR) return 0;
+    conn->recv_pos += received;
+    
+    int finished = 0;
+    int offset = 0;
+    LONG64 now = now_ns();
+    while (conn->socket != INVALID_SOCKET) {
+        int len = frame_length(conn->recv_buffer + offset, conn->recv_pos - offset);
+        if (len == 0) break;
+        
+        ChatMessageView view;
+        if (len < 0 || parse_message_view(conn->recv_buffer + offset, len, &view) != 0) {
+            fprintf(stderr, "Malformed frame for client %d\n", conn->index);
+            finished += !conn->joined;
+            drop_client(t, conn);
+            return finished;
+        }
+        finished += handle_frame(t, conn, &view, now);
+        offset += len;
+    }
+    
+    if (offset > 0 && conn->socket != INVALID_SOCKET) {
+        memmove(conn->recv_buffer, conn->recv_buffer + offset, conn->recv_pos - offset);
+        conn->recv_pos -= offset;
+    }
+    return finished;
+}
+
+/**
+ * Wait up to timeout_ms for socket events and handle them.
+ * Returns the number of handshakes finished.
+ */
+static int poll_clients(LoadThread *t, int timeout_ms) {
+    int ready = WSAPoll(t->fds, (ULONG)t->count, timeout_ms);
+    if (ready <= 0) {
+        if (ready == 0 || timeout_ms == 0) return 0;
+        Sleep(timeout_ms);  // Nothing pollable yet
+        return 0;
+    }
+    
+    int finished = 0;
+    for (int i = 0; i < t->count; i++) {
+        short revents = t->fds[i].revents;
+        LoadConn *conn = &t->conns[i];
+        if (revents == 0 || conn->socket == INVALID_SOCKET) continue;
+        
+        if (revents & (POLLRDNORM | POLLHUP | POLLERR)) {
+            finished += read_client(t, conn);
+        }
+        if ((revents & POLLWRNORM) && conn->socket != INVALID_SOCKET && conn->send_len > 0) {
+            flush_pending(t, conn);
+        }
+    }
+    return finished;
+}
+
+/**
+ * Send one stamped chat message from the thread's next sender
+ */
+static void send_stamped(LoadThread *t) {
+    LoadConn *conn = NULL;
+    for (int tries = 0; tries < t->count && conn == NULL; tries++) {
+        LoadConn *candidate = &t->conns[t->next_sender];
+        t->next_sender = (t->next_sender + 1) % t->count;
+        if (candidate->sender && candidate->joined) conn = candidate;
+    }
+    if (conn == NULL) return;
+    if (conn->send_len > 0) {
+        t->stalls++;
+        return;
+    }
+    
+    ChatMessage msg;
+    char frame[MAX_BUFFER_SIZE];
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_MESSAGE;
+    get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    snprintf(msg.username, sizeof(msg.username), "lg%08x_%d", run_id, conn->index);
+    int stamp_len = snprintf(msg.content, sizeof(msg.content), "LG%08x %lld ", run_id, (long long)now_ns());
+    memset(msg.content + stamp_len, 'x', message_size - stamp_len);
+    msg.content_length = message_size;
+    msg.content[message_size] = '\0';
+    
+    int len = encode_message(&msg, frame, sizeof(frame));
+    if (len < 0) return;
+    if (send_frame(t, conn, frame, len) != 0) {
+        drop_client(t, conn);
+        return;
+    }
+    t->sent++;
+}
+
+/**
+ * Tell the server this client is leaving (best effort) and close it
+ */
+static void leave_client(LoadConn *conn) {
+    if (conn->socket == INVALID_SOCKET) return;
+    
+    ChatMessage msg;
+    char frame[MAX_BUFFER_SIZE];
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_LEAVE;
+    get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    strcpy(msg.username, "loadgen");
+    int len = encode_message(&msg, frame, sizeof(frame));
+    if (len > 0 && conn->send_len == 0) {
+        send(conn->socket, frame, len, 0);
+    }
+    closesocket(conn->socket);
+    conn->socket = INVALID_SOCKET;
+}
+
+static DWORD WINAPI load_thread(LPVOID param) {
+    LoadThread *t = (LoadThread *)param;
+    
+    // Join every client, keeping a bounded number of handshakes in flight
+    LONG64 deadline = now_ns() + HANDSHAKE_TIMEOUT_MS * 1000000LL;
+    int next = 0;
+    int pending = 0;
+    while ((next < t->count || pending > 0) && now_ns() < deadline) {
+        while (next < t->count && pending < HANDSHAKE_WINDOW) {
+            if (start_client(t, &t->conns[next]) == 0) {
+                pending++;
+            } else {
+                t->failed++;
+            }
+            next++;
+        }
+        pending -= poll_clients(t, 10);
+    }
+    for (int i = 0; i < t->count; i++) {
+        if (t->conns[i].socket != INVALID_SOCKET && !t->conns[i].joined) {
+            drop_client(t, &t->conns[i]);
+        }
+    }
+    InterlockedIncrement(&threads_ready);
+    
+    // Keep reading join notices until every thread is done
+    while (phase == PHASE_HANDSHAKE) {
+        poll_clients(t, 10);
+    }
+    
+    // This thread's share of the rate, spread over its senders
+    double rate = sender_count > 0 ? total_rate * t->senders / sender_count : 0.0;
+    LONG64 interval_ns = rate > 0 ? (LONG64)(1e9 / rate) : 0;
+    LONG64 next_due = send_start_ns;
+    while (phase == PHASE_SENDING) {
+        LONG64 now = now_ns();
+        while (interval_ns > 0 && now >= next_due && phase == PHASE_SENDING) {
+            send_stamped(t);
+            next_due += interval_ns;
+        }
+        poll_clients(t, 1);
+    }
+    
+    while (phase == PHASE_DRAINING) {
+        poll_clients(t, 10);
+    }
+    
+    for (int i = 0; i < t->count; i++) {
+        leave_client(&t->conns[i]);
+    }
+    return 0;
+}
+
+static LONG64 filetime_100ns(const FILETIME *time) {
+    return ((LONG64)time->dwHighDateTime << 32) | time->dwLowDateTime;
+}
+
+/**
+ * CPU time (kernel + user, 100 ns units) and working set of a process
+ */
+static int sample_process(HANDLE process, LONG64 *cpu, SIZE_T *rss, SIZE_T *peak_rss) {
+    FILETIME created, exited, kernel, user;
+    PROCESS_MEMORY_COUNTERS memory;
+    if (!GetProcessTimes(process, &created, &exited, &kernel, &user)) return -1;
+    memory.cb = sizeof(memory);
+    if (!GetProcessMemoryInfo(process, &memory, sizeof(memory))) return -1;
+    
+    *cpu = filetime_100ns(&kernel) + filetime_100ns(&user);
+    *rss = memory.WorkingSetSize;
+    *peak_rss = memory.PeakWorkingSetSize;
+    return 0;
+}
+
+/**
+ * Frames written and WSASend calls so far, read from the server's admin
+ * socket in the Prometheus format
+ */
+static int read_server_writes(LONG64 *frames, LONG64 *send_calls) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) return -1;
+    struct sockaddr_in addr = server_addr;
+    addr.sin_port = htons((u_short)server_admin_port);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        closesocket(s);
+        return -1;
+    }
+    send(s, "metrics\n", 8, 0);
+    
+    static char reply[ADMIN_REPLY_LEN];
+    int len = 0;
+    int got;
+    while (len < (int)sizeof(reply) - 1 && (got = recv(s, reply + len, (int)sizeof(reply) - 1 - len, 0)) > 0) {
+        len += got;
+    }
+    reply[len] = '\0';
+    closesocket(s);
+    
+    const char *sent = strstr(reply, "\nchat_messages_sent_total ");
+    const char *calls = strstr(reply, "\nchat_send_calls_total ");
+    if (sent == NULL || calls == NULL) return -1;
+    *frames = strtoll(strchr(sent + 1, ' ') + 1, NULL, 10);
+    *send_calls = strtoll(strchr(calls + 1, ' ') + 1, NULL, 10);
+    return 0;
+}
+
+/**
+ * Parse command line options
+ */
+static int parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            client_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--senders") == 0 && i + 1 < argc) {
+            sender_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            total_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration_s = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--v1") == 0) {
+            protocol = PROTO_TEXT;
+        } else if (strcmp(argv[i], "--server-pid") == 0 && i + 1 < argc) {
+            server_pid = (DWORD)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server-admin") == 0 && i + 1 < argc) {
+            server_admin_port = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--host IP] [--clients N] [--senders N] [--rate MSGS_PER_SEC]\n"
+                            "          [--size BYTES] [--duration SECONDS] [--threads N] [--v1]\n"
+                            "          [--server-pid PID] [--server-admin PORT]\n", argv[0]);
+            return -1;
+        }
+    }
+    
+    if (sender_count < 0 || sender_count > client_count) sender_count = client_count;
+    if (client_count < 1 || client_count > MAX_CLIENTS) {
+        fprintf(stderr, "Client count must be between 1 and %d\n", MAX_CLIENTS);
+        return -1;
+    }
+    if (thread_count < 1 || thread_count > MAX_LOADGEN_THREADS) {
+        fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_LOADGEN_THREADS);
+        return -1;
+    }
+    if (message_size < STAMP_LEN || message_size > MAX_MESSAGE_LEN - 1) {
+        fprintf(stderr, "Message size must be between %d and %d bytes\n", STAMP_LEN, MAX_MESSAGE_LEN - 1);
+        return -1;
+    }
+    if (total_rate < 0 || duration_s < 1) {
+        fprintf(stderr, "Rate must not be negative and duration must be at least 1 second\n");
+        return -1;
+    }
+    if (server_admin_port < 0 || server_admin_port > 65535) {
+        fprintf(stderr, "Admin port must be between 1 and 65535\n");
+        return -1;
+    }
+    // The server binds its admin socket to 127.0.0.1 only
+    if (server_admin_port != 0 && (ntohl(inet_addr(host)) >> 24) != 127) {
+        fprintf(stderr, "--server-admin needs a loopback --host, the admin socket listens on 127.0.0.1 only\n");
+        return -1;
+    }
+    if (thread_count > client_count) thread_count = client_count;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    WSADATA wsaData;
+    
+    if (parse_args(argc, argv) != 0) {
+        return 1;
+    }
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return 1;
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_addr.s_addr = inet_addr(host);
+    run_id = (unsigned int)GetTickCount() ^ ((unsigned int)GetCurrentProcessId() << 16);
+    
+    HANDLE server_process = NULL;
+    if (server_pid != 0) {
+        server_process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | PROCESS_VM_READ, FALSE, server_pid);
+        if (server_process == NULL) {
+            fprintf(stderr, "Cannot open server process %lu: %lu\n", (unsigned long)server_pid, (unsigned long)GetLastError());
+            WSACleanup();
+            return 1;
+        }
+    }
+    
+    // Working set before any client connects, the base for rss_per_client_bytes
+    LONG64 server_cpu_start = 0, server_cpu_end = 0, own_cpu_start = 0, own_cpu_end = 0;
+    SIZE_T server_rss = 0, server_peak = 0, own_rss = 0, own_peak = 0, server_rss_before = 0;
+    if (server_process != NULL) sample_process(server_process, &server_cpu_start, &server_rss_before, &server_peak);
+    
+    // Contiguous blocks of clients per thread; senders spread evenly
+    for (int i = 0; i < thread_count; i++) {
+        LoadThread *t = &threads[i];
+        int first = (int)((LONG64)client_count * i / thread_count);
+        t->count = (int)((LONG64)client_count * (i + 1) / thread_count) - first;
+        t->conns = (LoadConn *)calloc(t->count, sizeof(LoadConn));
+        t->fds = (WSAPOLLFD *)calloc(t->count, sizeof(WSAPOLLFD));
+        if (t->conns == NULL || t->fds == NULL) {
+            fprintf(stderr, "Out of memory for %d clients\n", client_count);
+            return 1;
+        }
+        for (int j = 0; j < t->count; j++) {
+            LoadConn *conn = &t->conns[j];
+            int index = first + j;
+            conn->socket = INVALID_SOCKET;
+            conn->index = index;
+            conn->sender = (LONG64)index * sender_count / client_count != (LONG64)(index + 1) * sender_count / client_count;
+            t->senders += conn->sender;
+            t->fds[j].fd = INVALID_SOCKET;
+        }
+    }
+    
+    fprintf(stderr, "Joining %d clients to %s:%d with %d thread(s)...\n", client_count, host, SERVER_PORT, thread_count);
+    LONG64 handshake_start = now_ns();
+    for (int i = 0; i < thread_count; i++) {
+        threads[i].thread = CreateThread(NULL, 0, load_thread, &threads[i], 0, NULL);
+        if (threads[i].thread == NULL) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+    while (threads_ready < thread_count) {
+        Sleep(10);
+    }
+    double handshake_s = (now_ns() - handshake_start) / 1e9;
+    
+    int joined = 0;
+    int failed = 0;
+    for (int i = 0; i < thread_count; i++) {
+        joined += threads[i].joined;
+        failed += threads[i].failed;
+    }
+    fprintf(stderr, "%d joined, %d failed in %.2f s; sending %.0f msg/s from %d sender(s) for %d s...\n",
+        joined, failed, handshake_s, total_rate, sender_count, duration_s);
+    
+    if (server_process != NULL) sample_process(server_process, &server_cpu_start, &server_rss, &server_peak);
+    sample_process(GetCurrentProcess(), &own_cpu_start, &own_rss, &own_peak);
+    LONG64 frames_start = 0, frames_end = 0, calls_start = 0, calls_end = 0;
+    int have_writes = server_admin_port != 0 && read_server_writes(&frames_start, &calls_start) == 0;
+    if (server_admin_port != 0 && !have_writes) {
+        fprintf(stderr, "Cannot read metrics from admin port %d\n", server_admin_port);
+    }
+    
+    send_start_ns = now_ns();
+    InterlockedExchange(&phase, PHASE_SENDING);
+    Sleep(duration_s * 1000);
+    InterlockedExchange(&phase, PHASE_DRAINING);
+    LONG64 send_end_ns = now_ns();
+    Sleep(DRAIN_MS);
+    
+    double window_s = (now_ns() - send_start_ns) / 1e9;
+    if (server_process != NULL) sample_process(server_process, &server_cpu_end, &server_rss, &server_peak);
+    sample_process(GetCurrentProcess(), &own_cpu_end, &own_rss, &own_peak);
+    if (have_writes) have_writes = read_server_writes(&frames_end, &calls_end) == 0;
+    InterlockedExchange(&phase, PHASE_DONE);
+    
+    for (int i = 0; i < thread_count; i++) {
+        WaitForSingleObject(threads[i].thread, INFINITE);
+        CloseHandle(threads[i].thread);
+    }
+    
+    // Merge per-thread results
+    static Histogram latency, handshake;
+    LONG64 sent = 0, stalls = 0, delivered = 0;
+    LONG64 min_received = -1, max_received = 0;
+    joined = 0;
+    failed = 0;
+    for (int i = 0; i < thread_count; i++) {
+        LoadThread *t = &threads[i];
+        histogram_merge(&latency, &t->latency);
+        histogram_merge(&handshake, &t->handshake);
+        sent += t->sent;
+        stalls += t->stalls;
+        delivered += t->delivered;
+        joined += t->joined;
+        failed += t->failed;
+        for (int j = 0; j < t->count; j++) {
+            if (!t->conns[j].joined) continue;
+            if (min_received < 0 || t->conns[j].received < min_received) min_received = t->conns[j].received;
+            if (t->conns[j].received > max_received) max_received = t->conns[j].received;
+        }
+        free(t->conns);
+        free(t->fds);
+    }
+    
+    double send_s = (send_end_ns - send_start_ns) / 1e9;
+    LONG64 expected = joined > 1 ? sent * (joined - 1) : 0;
+    printf("{\n");
+    printf("  \"config\": {\"host\": \"%s\", \"clients\": %d, \"senders\": %d, \"rate\": %.1f, \"size\": %d, "
+           "\"duration_s\": %d, \"threads\": %d, \"protocol\": %d},\n",
+        host, client_count, sender_count, total_rate, message_size, duration_s, thread_count, protocol + 1);
+    printf("  \"handshake\": {\"joined\": %d, \"failed\": %d, \"seconds\": %.3f, \"per_second\": %.1f},\n",
+        joined, failed, handshake_s, handshake_s > 0 ? joined / handshake_s : 0.0);
+    print_histogram("handshake_latency_us", &handshake, ",");
+    printf("  \"messages\": {\"sent\": %lld, \"send_rate\": %.1f, \"send_stalls\": %lld, \"expected_deliveries\": %lld, "
+           "\"delivered\": %lld, \"delivery_ratio\": %.4f, \"per_recipient_rate\": %.1f, "
+           "\"min_per_recipient\": %lld, \"max_per_recipient\": %lld},\n",
+        sent, sent / send_s, stalls, expected, delivered, expected > 0 ? (double)delivered / expected : 0.0,
+        joined > 0 ? delivered / (double)joined / send_s : 0.0, min_received < 0 ? 0 : min_received, max_received);
+    print_histogram("latency_us", &latency, ",");
+    if (server_process != NULL) {
+        printf("  \"server\": {\"pid\": %lu, \"cpu_percent\": %.1f, \"rss_bytes\": %llu, \"peak_rss_bytes\": %llu, "
+               "\"rss_before_join_bytes\": %llu, \"rss_per_client_bytes\": %.0f},\n",
+            (unsigned long)server_pid, (server_cpu_end - server_cpu_start) / (window_s * 1e7) * 100.0,
+            (unsigned long long)server_rss, (unsigned long long)server_peak, (unsigned long long)server_rss_before,
+            joined > 0 ? ((double)server_rss - (double)server_rss_before) / joined : 0.0);
+        CloseHandle(server_process);
+    }
+    if (have_writes) {
+        LONG64 frames = frames_end - frames_start;
+        LONG64 calls = calls_end - calls_start;
+        printf("  \"writes\": {\"frames\": %lld, \"send_calls\": %lld, \"frames_per_call\": %.2f, "
+               "\"send_calls_per_second\": %.1f},\n",
+            frames, calls, calls > 0 ? (double)frames / calls : 0.0, calls / window_s);
+    }
+    // If the load generator itself is near 100% of a core, the numbers
+    // describe it rather than the server
+    printf("  \"loadgen\": {\"cpu_percent\": %.1f, \"rss_bytes\": %llu}\n",
+        (own_cpu_end - own_cpu_start) / (window_s * 1e7) * 100.0, (unsigned long long)own_rss);
+    printf("}\n");
+    
+    WSACleanup();
+    return 0;
+}
@@ -0,0 +1,562 @@
+#include "chat_log.h"
+#include "chat_logger.h"
+
+#define MAX_LOG_SEGMENTS 4096
+#define LOG_READ_CHUNK (64 * 1024)
+#define LOG_PATH_LEN 260
+#define LOG_CLOCK_SKEW_MS 60000      // Record timestamps may be this far out of order
+
+// Records waiting to be written; appenders fill one batch while the
+// flusher thread writes the other. A batch never spans two segments.
+typedef struct {
+    char *data;
+    int len;
+    LogIndexEntry index[LOG_BUFFER_SIZE / LOG_INDEX_INTERVAL + 2];
+    int index_count;
+    LONG64 roll_record;              // Nonzero: start segment roll_record after this batch
+    int sealed;                      // Being handed off; appenders wait for the next batch
+} LogBatch;
+
+// Options and state of a read
+typedef struct {
+    LogRecordCallback callback;
+    void *context;
+    int by_time;                     // Select by timestamp instead of record number
+    LONG64 first_record;             // By record: skip records before this one
+    LONG64 from_ms;                  // By time: skip records outside [from_ms, to_ms]
+    LONG64 to_ms;
+    int stopped;                     // The callback asked to stop
+} LogScan;
+
+// Where appending continues in a segment
+typedef struct {
+    LONG64 record;                   // Number of the next record
+    LONG64 offset;                   // End of the complete records
+    LONG64 next_index_offset;        // Offset due for the next index entry
+} LogPosition;
+
+// Writer state, guarded by log_lock
+static char log_dir[LOG_PATH_LEN];
+static CRITICAL_SECTION log_lock;
+static CONDITION_VARIABLE log_work_ready;   // Flusher waits for a batch
+static CONDITION_VARIABLE log_batch_free;   // Appenders wait for the flusher
+static LogBatch log_batches[2];
+static LogBatch *log_active = NULL;         // Being filled by appenders
+static LogBatch *log_writing = NULL;        // Being written by the flusher
+static HANDLE log_file = INVALID_HANDLE_VALUE;        // Flusher only
+static HANDLE log_index_file = INVALID_HANDLE_VALUE;  // Flusher only
+static HANDLE log_thread = NULL;
+static volatile int log_running = 0;
+static LONG64 next_record = 1;
+static LONG64 segment_offset = 0;           // Segment size including the active batch
+static LONG64 next_index_offset = 0;
+static int log_flush_ms = DEFAULT_LOG_FLUSH_MS;
+static int log_flush_bytes = DEFAULT_LOG_FLUSH_BYTES;
+
+// Totals printed by log_close()
+static LONG64 log_bytes = 0;
+static LONG64 log_syncs = 0;
+
+static int compare_records(const void *a, const void *b) {
+    LONG64 x = *(const LONG64 *)a;
+    LONG64 y = *(const LONG64 *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Path of a segment's file. Returns -1 if it does not fit in LOG_PATH_LEN.
+ */
+static int segment_path(const char *dir, LONG64 first, const char *ext, char *path) {
+    int len = snprintf(path, LOG_PATH_LEN, "%s\\%020lld.%s", dir, first, ext);
+    return len < 0 || len >= LOG_PATH_LEN ? -1 : 0;
+}
+
+/**
+ * First record numbers of the segments in a directory, sorted
+ */
+static int list_segments(const char *dir, LONG64 *firsts, int max_segments) {
+    char pattern[LOG_PATH_LEN];
+    snprintf(pattern, sizeof(pattern), "%s\\*.log", dir);
+    
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(pattern, &data);
+    if (find == INVALID_HANDLE_VALUE) return 0;
+    
+    int count = 0;
+    do {
+        char *end;
+        LONG64 first = strtoll(data.cFileName, &end, 10);
+        if (first > 0 && strcmp(end, ".log") == 0 && count < max_segments) {
+            firsts[count++] = first;
+        }
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+    
+    qsort(firsts, count, sizeof(LONG64), compare_records);
+    return count;
+}
+
+/**
+ * Read the sparse index of a segment. Returns NULL (and 0 entries)
+ * if it is missing; the segment is then scanned from the start.
+ */
+static LogIndexEntry *load_index(const char *dir, LONG64 first, int *count) {
+    char path[LOG_PATH_LEN];
+    *count = 0;
+    if (segment_path(dir, first, "idx", path) != 0) return NULL;
+    
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    
+    LARGE_INTEGER size;
+    LogIndexEntry *entries = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart >= (LONG64)sizeof(LogIndexEntry)) {
+        int entry_count = (int)(size.QuadPart / sizeof(LogIndexEntry));
+        entries = (LogIndexEntry *)malloc(sizeof(LogIndexEntry) * entry_count);
+        DWORD got = 0;
+        if (entries != NULL && ReadFile(file, entries, sizeof(LogIndexEntry) * entry_count, &got, NULL)) {
+            *count = (int)(got / sizeof(LogIndexEntry));  // A torn last entry is ignored
+        }
+    }
+    CloseHandle(file);
+    return entries;
+}
+
+static int scan_wants(const LogScan *scan, LONG64 record, LONG64 timestamp_ms) {
+    if (scan->by_time) {
+        return timestamp_ms >= scan->from_ms && timestamp_ms <= scan->to_ms;
+    }
+    return record >= scan->first_record;
+}
+
+/**
+ * Parse the records of an open segment from offset up to stop_offset
+ * (-1 = end of file), calling the scan callback for the wanted ones.
+ * Stops at a torn or invalid record. *record holds the number of the
+ * record at offset and is advanced past every complete record.
+ * Returns the offset just past the last complete record.
+ */
+static LONG64 scan_segment(HANDLE file, LONG64 offset, LONG64 stop_offset, LONG64 *record, LogScan *scan) {
+    char *buffer = (char *)malloc(LOG_READ_CHUNK);
+    if (buffer == NULL) return offset;
+    
+    LARGE_INTEGER position;
+    position.QuadPart = offset;
+    SetFilePointerEx(file, position, NULL, FILE_BEGIN);
+    
+    LONG64 end = offset;             // File offset of buffer[0]
+    int have = 0;
+    int done = 0;
+    while (!done) {
+        DWORD got = 0;
+        if (!ReadFile(file, buffer + have, LOG_READ_CHUNK - have, &got, NULL) || got == 0) {
+            break;                   // End of file; leftover bytes are a torn record
+        }
+        have += got;
+        
+        int used = 0;
+        while (!done) {
+            if (stop_offset >= 0 && end + used >= stop_offset) {
+                done = 1;
+                break;
+            }
+            
+            int len = is_binary_frame(buffer + used, have - used) ? frame_length(buffer + used, have - used) : -1;
+            if (len == 0 && have - used < LOG_READ_CHUNK) break;  // Read more
+            
+            ChatMessageView view;
+            if (len <= 0 || parse_message_view(buffer + used, len, &view) != 0) {
+                done = 1;            // Not a record: the log ends here
+                break;
+            }
+            
+            if (scan != NULL && scan_wants(scan, *record, (LONG64)view.timestamp_ms)) {
+                if (scan->callback(*record, &view, scan->context) != 0) {
+                    scan->stopped = 1;
+                    done = 1;
+                }
+            }
+            used += len;
+            (*record)++;
+        }
+        
+        memmove(buffer, buffer + used, have - used);
+        have -= used;
+        end += used;
+    }
+    
+    free(buffer);
+    return end;
+}
+
+/**
+ * Read records from one segment, starting at the last index entry at or
+ * before the wanted position. Returns 1 if the read should go on with
+ * the next segment.
+ */
+static int read_segment(const char *dir, LONG64 first, LogScan *scan) {
+    char path[LOG_PATH_LEN];
+    if (segment_path(dir, first, "log", path) != 0) return 0;
+    
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 1;
+    
+    int count;
+    LogIndexEntry *index = load_index(dir, first, &count);
+    
+    LONG64 offset = 0;
+    LONG64 record = first;
+    LONG64 stop_offset = -1;
+    for (int i = 0; i < count; i++) {
+        // Timestamps come from the senders and only roughly increase, so
+        // the seek leaves room for skew and records are checked one by one
+        if (scan->by_time ? index[i].timestamp_ms < scan->from_ms - LOG_CLOCK_SKEW_MS : index[i].record <= scan->first_record) {
+            offset = index[i].offset;
+            record = index[i].record;
+        } else if (scan->by_time && index[i].timestamp_ms > scan->to_ms + LOG_CLOCK_SKEW_MS) {
+            stop_offset = index[i].offset;
+            break;
+        }
+    }
+    free(index);
+    
+    scan_segment(file, offset, stop_offset, &record, scan);
+    CloseHandle(file);
+    return !scan->stopped && stop_offset < 0;
+}
+
+static int read_log(const char *dir, LogScan *scan) {
+    LONG64 firsts[MAX_LOG_SEGMENTS];
+    int count = list_segments(dir, firsts, MAX_LOG_SEGMENTS);
+    
+    for (int i = 0; i < count; i++) {
+        // Skip segments that end before the first wanted record
+        if (!scan->by_time && i + 1 < count && firsts[i + 1] <= scan->first_record) continue;
+        if (!read_segment(dir, firsts[i], scan)) break;
+    }
+    return count;
+}
+
+/**
+ * Read every record from first_record on.
+ * Returns the number of segments found, 0 if there is no log.
+ */
+int log_read_records(const char *dir, LONG64 first_record, LogRecordCallback callback, void *context) {
+    LogScan scan = { callback, context, 0, first_record, 0, 0, 0 };
+    return read_log(dir, &scan);
+}
+
+/**
+ * Read the records timestamped in [from_ms, to_ms].
+ * Returns the number of segments found, 0 if there is no log.
+ */
+int log_read_time(const char *dir, LONG64 from_ms, LONG64 to_ms, LogRecordCallback callback, void *context) {
+    LogScan scan = { callback, context, 1, 0, from_ms, to_ms, 0 };
+    return read_log(dir, &scan);
+}
+
+/**
+ * Open the files of a segment for appending. A new segment is created;
+ * an existing one is cut back to its last complete record, which a crash
+ * may have left half written. Returns where appending continues.
+ */
+static int open_segment(LONG64 first, LogPosition *position) {
+    char path[LOG_PATH_LEN];
+    if (segment_path(log_dir, first, "log", path) != 0) return -1;
+    log_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (log_file == INVALID_HANDLE_VALUE) return -1;
+    
+    // Index entries can reach past the records if the last sync was lost
+    int count;
+    LogIndexEntry *index = load_index(log_dir, first, &count);
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(log_file, &size)) size.QuadPart = 0;
+    while (count > 0 && index[count - 1].offset >= size.QuadPart) {
+        count--;
+    }
+    
+    // Find the end of the complete records, starting from the last index entry
+    LONG64 record = count > 0 ? index[count - 1].record : first;
+    LONG64 end = scan_segment(log_file, count > 0 ? index[count - 1].offset : 0, -1, &record, NULL);
+    
+    LARGE_INTEGER cut;
+    cut.QuadPart = end;
+    SetFilePointerEx(log_file, cut, NULL, FILE_BEGIN);
+    SetEndOfFile(log_file);
+    
+    // Rewrite the index with the entries that point at kept records
+    while (count > 0 && index[count - 1].offset >= end) {
+        count--;
+    }
+    segment_path(log_dir, first, "idx", path);  // Same length as the .log path
+    log_index_file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (log_index_file == INVALID_HANDLE_VALUE) {
+        free(index);
+        CloseHandle(log_file);
+        log_file = INVALID_HANDLE_VALUE;
+        return -1;
+    }
+    DWORD written;
+    if (count > 0) {
+        WriteFile(log_index_file, index, sizeof(LogIndexEntry) * count, &written, NULL);
+    }
+    
+    position->record = record;
+    position->offset = end;
+    position->next_index_offset = count > 0 ? index[count - 1].offset + LOG_INDEX_INTERVAL : 0;
+    free(index);
+    return 0;
+}
+
+static void close_segment(void) {
+    if (log_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(log_file);
+        log_file = INVALID_HANDLE_VALUE;
+    }
+    if (log_index_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(log_index_file);
+        log_index_file = INVALID_HANDLE_VALUE;
+    }
+}
+
+/**
+ * Write one batch and make it durable (flusher thread, no lock held)
+ */
+static void write_batch(LogBatch *batch) {
+    DWORD written;
+    if (batch->len > 0) {
+        if (!WriteFile(log_file, batch->data, batch->len, &written, NULL) || (int)written != batch->len) {
+            LOG_ERROR("Failed to write message log: %lu", GetLastError());
+        }
+        // The index is rebuilt from the records if it falls behind, so
+        // only the records themselves are flushed
+        if (batch->index_count > 0) {
+            WriteFile(log_index_file, batch->index, sizeof(LogIndexEntry) * batch->index_count, &written, NULL);
+        }
+        if (!FlushFileBuffers(log_file)) {
+            LOG_ERROR("Failed to flush message log: %lu", GetLastError());
+        }
+        log_bytes += batch->len;
+        log_syncs++;
+    }
+    
+    if (batch->roll_record != 0) {
+        LogPosition position;  // Appenders already continue at offset 0
+        close_segment();
+        if (open_segment(batch->roll_record, &position) != 0) {
+            LOG_ERROR("Failed to start log segment %lld: %lu", batch->roll_record, GetLastError());
+        }
+    }
+}
+
+/**
+ * Make the active batch the one being written. Called with log_lock held
+ * while no batch is being written.
+ */
+static void swap_batches(void) {
+    log_writing = log_active;
+    log_active = (log_active == &log_batches[0]) ? &log_batches[1] : &log_batches[0];
+    WakeAllConditionVariable(&log_batch_free);  // Appenders waiting on a sealed batch
+}
+
+/**
+ * Group commit: every batch handed over (or collected when the flush
+ * window ends) is written with one WriteFile and one FlushFileBuffers,
+ * however many records it holds
+ */
+static DWORD WINAPI log_flusher(LPVOID param) {
+    (void)param;
+    
+    EnterCriticalSection(&log_lock);
+    for (;;) {
+        if (log_writing == NULL && log_active->len < log_flush_bytes && log_running) {
+            SleepConditionVariableCS(&log_work_ready, &log_lock, log_flush_ms);
+        }
+        
+        if (log_writing == NULL) {
+            if (log_active->len == 0 && log_active->roll_record == 0) {
+                if (!log_running) break;
+                continue;
+            }
+            swap_batches();
+        }
+        
+        LogBatch *batch = log_writing;
+        LeaveCriticalSection(&log_lock);
+        write_batch(batch);
+        EnterCriticalSection(&log_lock);
+        
+        batch->len = 0;
+        batch->index_count = 0;
+        batch->roll_record = 0;
+        batch->sealed = 0;
+        log_writing = NULL;
+        WakeAllConditionVariable(&log_batch_free);
+    }
+    LeaveCriticalSection(&log_lock);
+    return 0;
+}
+
+/**
+ * Pass the active batch to the flusher, waiting while it is still busy
+ * with the previous one. The batch is sealed first, so nothing more is
+ * added to it while this waits. Called with log_lock held.
+ */
+static void hand_off_batch(void) {
+    LogBatch *batch = log_active;
+    batch->sealed = 1;
+    while (log_writing != NULL && log_active == batch) {
+        SleepConditionVariableCS(&log_batch_free, &log_lock, INFINITE);
+    }
+    
+    // The flusher may have collected it in the meantime
+    if (log_active == batch) {
+        swap_batches();
+        WakeConditionVariable(&log_work_ready);
+    }
+}
+
+/**
+ * Open (or create) the log in a directory and start the flusher.
+ * Records are made durable at most flush_ms after they are appended,
+ * or as soon as flush_bytes are waiting.
+ */
+int log_open(const char *dir, int flush_ms, int flush_bytes) {
+    // Segment names have a fixed length, so one check covers them all
+    char path[LOG_PATH_LEN];
+    if (segment_path(dir, 0, "log", path) != 0) {
+        return -1;
+    }
+    if (!CreateDirectoryA(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        return -1;
+    }
+    strncpy(log_dir, dir, LOG_PATH_LEN - 1);
+    log_dir[LOG_PATH_LEN - 1] = '\0';
+    log_flush_ms = flush_ms;
+    log_flush_bytes = flush_bytes < LOG_BUFFER_SIZE ? flush_bytes : LOG_BUFFER_SIZE;
+    
+    for (int i = 0; i < 2; i++) {
+        log_batches[i].data = (char *)malloc(LOG_BUFFER_SIZE);
+        if (log_batches[i].data == NULL) {
+            free(log_batches[0].data);
+            return -1;
+        }
+        log_batches[i].len = 0;
+        log_batches[i].index_count = 0;
+        log_batches[i].roll_record = 0;
+        log_batches[i].sealed = 0;
+    }
+    
+    // Continue the newest segment
+    LONG64 firsts[MAX_LOG_SEGMENTS];
+    LogPosition position;
+    int count = list_segments(dir, firsts, MAX_LOG_SEGMENTS);
+    if (open_segment(count > 0 ? firsts[count - 1] : 1, &position) != 0) {
+        free(log_batches[0].data);
+        free(log_batches[1].data);
+        return -1;
+    }
+    next_record = position.record;
+    segment_offset = position.offset;
+    next_index_offset = position.next_index_offset;
+    
+    InitializeCriticalSection(&log_lock);
+    InitializeConditionVariable(&log_work_ready);
+    InitializeConditionVariable(&log_batch_free);
+    log_active = &log_batches[0];
+    log_writing = NULL;
+    log_running = 1;
+    
+    log_thread = CreateThread(NULL, 0, log_flusher, NULL, 0, NULL);
+    if (log_thread == NULL) {
+        log_running = 0;
+        close_segment();
+        free(log_batches[0].data);
+        free(log_batches[1].data);
+        DeleteCriticalSection(&log_lock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Flush everything appended so far and stop the flusher
+ */
+void log_close(void) {
+    if (!log_running) return;
+    
+    EnterCriticalSection(&log_lock);
+    log_running = 0;
+    WakeConditionVariable(&log_work_ready);
+    LeaveCriticalSection(&log_lock);
+    
+    WaitForSingleObject(log_thread, INFINITE);
+    CloseHandle(log_thread);
+    log_thread = NULL;
+    close_segment();
+    DeleteCriticalSection(&log_lock);
+    free(log_batches[0].data);
+    free(log_batches[1].data);
+    
+    LOG_INFO("Message log: %lld records, %lld bytes, %lld syncs", next_record - 1, log_bytes, log_syncs);
+}
+
+int log_enabled(void) {
+    return log_running;
+}
+
+/**
+ * Number the next appended record will get
+ */
+LONG64 log_next_record(void) {
+    return next_record;
+}
+
+/**
+ * Append a relayed frame (its v2 encoding) to the log. Only copies it
+ * into the active batch; the flusher thread writes and syncs.
+ */
+void log_append(const Frame *frame) {
+    if (!log_running) return;
+    
+    int len = frame->len[PROTO_BINARY];
+    if (len == 0) return;  // Callers include the v2 format while logging
+    
+    EnterCriticalSection(&log_lock);
+    
+    for (;;) {
+        if (log_active->sealed) {
+            SleepConditionVariableCS(&log_batch_free, &log_lock, INFINITE);
+        } else if (segment_offset > 0 && segment_offset + len > LOG_SEGMENT_SIZE) {
+            // This record starts the next segment
+            log_active->roll_record = next_record;
+            segment_offset = 0;
+            next_index_offset = 0;
+            hand_off_batch();
+        } else if (log_active->len + len > LOG_BUFFER_SIZE) {
+            hand_off_batch();
+        } else {
+            break;
+        }
+    }
+    
+    if (segment_offset >= next_index_offset) {
+        ChatMessageView view;
+        LogIndexEntry *entry = &log_active->index[log_active->index_count++];
+        entry->record = next_record;
+        entry->timestamp_ms = parse_message_view(frame->data[PROTO_BINARY], len, &view) == 0 ? (LONG64)view.timestamp_ms : 0;
+        entry->offset = segment_offset;
+        next_index_offset = segment_offset + LOG_INDEX_INTERVAL;
+    }
+    
+    memcpy(log_active->data + log_active->len, frame->data[PROTO_BINARY], len);
+    log_active->len += len;
+    segment_offset += len;
+    next_record++;
+    
+    if (log_active->len >= log_flush_bytes) {
+        WakeConditionVariable(&log_work_ready);
+    }
+    
+    LeaveCriticalSection(&log_lock);
+}
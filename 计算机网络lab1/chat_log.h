@@ -0,0 +1,33 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include "chat_frame.h"
+
+// Durable log of relayed messages. Records are the v2 binary frames,
+// appended to segment files "<first record>.log" in one directory. Each
+// segment has a sparse index "<first record>.idx" of LogIndexEntry.
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)  // Start a new segment past this size
+#define LOG_INDEX_INTERVAL 4096               // Record bytes between index entries
+#define LOG_BUFFER_SIZE (256 * 1024)          // Largest batch written at once
+#define DEFAULT_LOG_FLUSH_MS 50
+#define DEFAULT_LOG_FLUSH_BYTES (64 * 1024)
+
+typedef struct {
+    LONG64 record;                   // Record number, counted from 1 over the whole log
+    LONG64 timestamp_ms;             // Timestamp of that record
+    LONG64 offset;                   // Byte offset of that record in the segment
+} LogIndexEntry;
+
+// Called for each record read; return nonzero to stop reading
+typedef int (*LogRecordCallback)(LONG64 record, ChatMessageView *view, void *context);
+
+// Function prototypes
+int log_open(const char *dir, int flush_ms, int flush_bytes);
+void log_close(void);
+int log_enabled(void);
+LONG64 log_next_record(void);
+void log_append(const Frame *frame);
+int log_read_records(const char *dir, LONG64 first_record, LogRecordCallback callback, void *context);
+int log_read_time(const char *dir, LONG64 from_ms, LONG64 to_ms, LogRecordCallback callback, void *context);
+
+#endif // CHAT_LOG_H
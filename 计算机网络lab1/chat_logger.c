@@ -0,0 +1,383 @@
+#include "chat_logger.h"
+#include <stdarg.h>
+
+#define LOGGER_PATH_LEN 260
+#define LOGGER_LINE_LEN (LOGGER_TEXT_LEN + 64)   // Text plus time, level and thread
+
+// One record in the ring. Bounded queue with a sequence per slot: the
+// slot is free for position p while sequence == p, and holds the record
+// of position p once sequence == p + 1.
+typedef struct {
+    volatile LONG64 sequence;
+    LONG64 time_ms;                  // get_epoch_ms() when logged
+    DWORD thread_id;
+    int level;
+    char text[LOGGER_TEXT_LEN];
+} LoggerRecord;
+
+volatile int logger_level = LOG_LEVEL_INFO;
+static LoggerConfig logger_config;
+static LoggerRecord *logger_ring = NULL;
+static volatile LONG64 logger_tail = 0;         // Next position claimed by a producer
+static volatile LONG64 logger_head = 0;         // Next position read by the writer
+static volatile LONG64 logger_drops = 0;        // Records lost to a full ring
+static volatile LONG logger_sleeping = 0;       // Writer is waiting on logger_wake
+static volatile int logger_running = 0;
+static LoggerLimit * volatile logger_limits = NULL;  // Call sites that went over the rate
+static CRITICAL_SECTION logger_lock;            // Only guards sleeping and waking the writer
+static CONDITION_VARIABLE logger_wake;
+static HANDLE logger_thread = NULL;
+
+// Writer thread only
+static HANDLE logger_file = INVALID_HANDLE_VALUE;
+static LONG64 logger_file_bytes = 0;
+static char *logger_batch = NULL;
+static int logger_batch_len = 0;
+
+static const char *level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+void logger_default_config(LoggerConfig *config) {
+    config->level = LOG_LEVEL_INFO;
+    config->console = 1;
+    config->file_path = NULL;
+    config->file_size = DEFAULT_LOGGER_FILE_SIZE;
+    config->file_count = DEFAULT_LOGGER_FILES;
+    config->rate = DEFAULT_LOGGER_RATE;
+}
+
+/**
+ * Parse "debug", "info", "warn" or "error". Returns -1 for anything else.
+ */
+int logger_parse_level(const char *name, LogLevel *level) {
+    static const char *names[] = { "debug", "info", "warn", "error" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (LogLevel)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Format a record as one line: "YYYY-MM-DD HH:MM:SS.mmm LEVEL [thread] text".
+ * Returns its length.
+ */
+static int format_record(const LoggerRecord *record, char *line) {
+    time_t seconds = (time_t)(record->time_ms / 1000);
+    struct tm local;
+    char when[24];
+    if (localtime_s(&local, &seconds) != 0 || strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local) == 0) {
+        when[0] = '\0';
+    }
+    
+    int len = snprintf(line, LOGGER_LINE_LEN, "%s.%03d %s [%lu] %s", when, (int)(record->time_ms % 1000),
+        level_names[record->level], (unsigned long)record->thread_id, record->text);
+    if (len >= LOGGER_LINE_LEN - 1) len = LOGGER_LINE_LEN - 2;
+    line[len++] = '\n';
+    line[len] = '\0';
+    return len;
+}
+
+/**
+ * Start a new file: path becomes path.1, path.1 becomes path.2 and so
+ * on; the oldest is deleted
+ */
+static int open_log_file(int rotate) {
+    char from[LOGGER_PATH_LEN];
+    char to[LOGGER_PATH_LEN];
+    const char *path = logger_config.file_path;
+    
+    if (rotate) {
+        CloseHandle(logger_file);
+        logger_file = INVALID_HANDLE_VALUE;
+        
+        snprintf(to, sizeof(to), "%s.%d", path, logger_config.file_count);
+        DeleteFileA(to);
+        for (int i = logger_config.file_count - 1; i >= 1; i--) {
+            snprintf(from, sizeof(from), "%s.%d", path, i);
+            snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+            MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+        }
+        snprintf(to, sizeof(to), "%s.1", path);
+        MoveFileExA(path, to, MOVEFILE_REPLACE_EXISTING);
+    }
+    
+    logger_file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (logger_file == INVALID_HANDLE_VALUE) return -1;
+    
+    LARGE_INTEGER zero, end;
+    zero.QuadPart = 0;
+    if (!SetFilePointerEx(logger_file, zero, &end, FILE_END)) end.QuadPart = 0;
+    logger_file_bytes = end.QuadPart;
+    return 0;
+}
+
+/**
+ * Write the batch to every sink
+ */
+static void flush_batch(void) {
+    if (logger_batch_len == 0) return;
+    
+    if (logger_config.console) {
+        fwrite(logger_batch, 1, logger_batch_len, stderr);
+        fflush(stderr);
+    }
+    if (logger_file != INVALID_HANDLE_VALUE) {
+        if (logger_file_bytes > 0 && logger_file_bytes + logger_batch_len > logger_config.file_size) {
+            open_log_file(1);  // On failure the file sink stays off
+        }
+        DWORD written = 0;
+        if (logger_file != INVALID_HANDLE_VALUE && WriteFile(logger_file, logger_batch, logger_batch_len, &written, NULL)) {
+            logger_file_bytes += written;
+        }
+    }
+    logger_batch_len = 0;
+}
+
+/**
+ * Move the published records into the batch. Returns how many there were.
+ */
+static int drain_ring(void) {
+    int count = 0;
+    for (;;) {
+        LONG64 head = logger_head;
+        LoggerRecord *record = &logger_ring[head & (LOGGER_RING_RECORDS - 1)];
+        if (ReadAcquire64(&record->sequence) != head + 1) break;  // Empty, or still being written
+        
+        if (logger_batch_len + LOGGER_LINE_LEN > LOGGER_BATCH_SIZE) {
+            flush_batch();
+        }
+        logger_batch_len += format_record(record, logger_batch + logger_batch_len);
+        
+        WriteRelease64(&record->sequence, head + LOGGER_RING_RECORDS);
+        WriteRelease64(&logger_head, head + 1);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Add a line for each call site that suppressed records in a second
+ * that is over (any second when flushing at exit)
+ */
+static void report_suppressed(int all) {
+    LONG64 second = (LONG64)(GetTickCount64() / 1000);
+    for (LoggerLimit *limit = logger_limits; limit != NULL; limit = limit->next) {
+        if (limit->suppressed == 0 || (!all && limit->second == second)) continue;
+        
+        LoggerRecord record;
+        record.time_ms = (LONG64)get_epoch_ms();
+        record.thread_id = GetCurrentThreadId();
+        record.level = limit->level;
+        snprintf(record.text, sizeof(record.text), "%ld more like \"%s\" suppressed",
+            (long)InterlockedExchange(&limit->suppressed, 0), limit->format);
+        
+        if (logger_batch_len + LOGGER_LINE_LEN > LOGGER_BATCH_SIZE) {
+            flush_batch();
+        }
+        logger_batch_len += format_record(&record, logger_batch + logger_batch_len);
+    }
+}
+
+static int ring_ready(void) {
+    const LoggerRecord *record = &logger_ring[logger_head & (LOGGER_RING_RECORDS - 1)];
+    return ReadAcquire64(&record->sequence) == logger_head + 1;
+}
+
+/**
+ * Writer thread. Producers only wake it for warnings, errors or a ring
+ * filling up; otherwise it collects what arrived every LOGGER_FLUSH_MS,
+ * so each write to the sinks carries a batch of lines.
+ */
+static DWORD WINAPI logger_writer(LPVOID param) {
+    (void)param;
+    
+    for (;;) {
+        int stopping = !logger_running;
+        drain_ring();
+        report_suppressed(stopping);
+        flush_batch();
+        if (stopping) break;
+        
+        EnterCriticalSection(&logger_lock);
+        InterlockedExchange(&logger_sleeping, 1);
+        if (!ring_ready() && logger_running) {
+            SleepConditionVariableCS(&logger_wake, &logger_lock, LOGGER_FLUSH_MS);
+        }
+        InterlockedExchange(&logger_sleeping, 0);
+        LeaveCriticalSection(&logger_lock);
+    }
+    return 0;
+}
+
+/**
+ * Open the sinks and start the writer thread. Records logged before
+ * this (or after logger_stop()) are written to stderr directly.
+ */
+int logger_start(const LoggerConfig *config) {
+    logger_config = *config;
+    logger_level = config->level;
+    
+    logger_ring = (LoggerRecord *)malloc(sizeof(LoggerRecord) * LOGGER_RING_RECORDS);
+    logger_batch = (char *)malloc(LOGGER_BATCH_SIZE);
+    if (logger_ring == NULL || logger_batch == NULL) {
+        free(logger_ring);
+        free(logger_batch);
+        logger_ring = NULL;
+        logger_batch = NULL;
+        return -1;
+    }
+    for (int i = 0; i < LOGGER_RING_RECORDS; i++) {
+        logger_ring[i].sequence = i;
+    }
+    logger_tail = 0;
+    logger_head = 0;
+    logger_batch_len = 0;
+    
+    if (config->file_path != NULL && open_log_file(0) != 0) {
+        free(logger_ring);
+        free(logger_batch);
+        logger_ring = NULL;
+        logger_batch = NULL;
+        return -1;
+    }
+    
+    InitializeCriticalSection(&logger_lock);
+    InitializeConditionVariable(&logger_wake);
+    logger_running = 1;
+    logger_thread = CreateThread(NULL, 0, logger_writer, NULL, 0, NULL);
+    if (logger_thread == NULL) {
+        logger_running = 0;
+        DeleteCriticalSection(&logger_lock);
+        if (logger_file != INVALID_HANDLE_VALUE) CloseHandle(logger_file);
+        logger_file = INVALID_HANDLE_VALUE;
+        free(logger_ring);
+        free(logger_batch);
+        logger_ring = NULL;
+        logger_batch = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write everything logged so far and stop the writer. Call once no
+ * other thread logs any more.
+ */
+void logger_stop(void) {
+    if (!logger_running) return;
+    
+    EnterCriticalSection(&logger_lock);
+    logger_running = 0;
+    WakeConditionVariable(&logger_wake);
+    LeaveCriticalSection(&logger_lock);
+    
+    WaitForSingleObject(logger_thread, INFINITE);
+    CloseHandle(logger_thread);
+    logger_thread = NULL;
+    DeleteCriticalSection(&logger_lock);
+    if (logger_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(logger_file);
+        logger_file = INVALID_HANDLE_VALUE;
+    }
+    free(logger_ring);
+    free(logger_batch);
+    logger_ring = NULL;
+    logger_batch = NULL;
+    
+    if (logger_drops > 0) {
+        logger_write(NULL, LOG_LEVEL_WARN, "Server log: %lld record(s) dropped, ring was full", (long long)logger_drops);
+    }
+}
+
+/**
+ * Whether a call site is over its rate. Threads racing on a new second
+ * may each reset the window, so the limit is approximate. A call site
+ * joins the writer's list the first time it suppresses a record.
+ */
+static int over_rate(LoggerLimit *limit, LogLevel level, const char *format) {
+    LONG64 second = (LONG64)(GetTickCount64() / 1000);
+    if (limit->second != second) {
+        InterlockedExchange64(&limit->second, second);
+        InterlockedExchange(&limit->count, 0);
+    }
+    if (InterlockedIncrement(&limit->count) <= logger_config.rate) return 0;
+    
+    InterlockedIncrement(&limit->suppressed);
+    if (!limit->registered && InterlockedCompareExchange(&limit->registered, 1, 0) == 0) {
+        limit->format = format;
+        limit->level = level;
+        LoggerLimit *next;
+        do {
+            next = logger_limits;
+            limit->next = next;
+        } while (InterlockedCompareExchangePointer((PVOID volatile *)&logger_limits, limit, next) != next);
+    }
+    return 1;
+}
+
+/**
+ * Log a record (use the LOG_ macros). The text is formatted here; the
+ * rest happens on the writer thread. Never blocks on a sink.
+ */
+void logger_write(LoggerLimit *limit, LogLevel level, const char *format, ...) {
+    if (limit != NULL && logger_config.rate > 0 && over_rate(limit, level, format)) return;
+    
+    va_list args;
+    if (!logger_running) {
+        LoggerRecord record;
+        char line[LOGGER_LINE_LEN];
+        record.time_ms = (LONG64)get_epoch_ms();
+        record.thread_id = GetCurrentThreadId();
+        record.level = level;
+        va_start(args, format);
+        vsnprintf(record.text, sizeof(record.text), format, args);
+        va_end(args);
+        format_record(&record, line);
+        fputs(line, stderr);
+        return;
+    }
+    
+    // Claim a slot
+    LONG64 position = logger_tail;
+    LoggerRecord *record;
+    for (;;) {
+        record = &logger_ring[position & (LOGGER_RING_RECORDS - 1)];
+        LONG64 diff = ReadAcquire64(&record->sequence) - position;
+        if (diff == 0) {
+            LONG64 seen = InterlockedCompareExchange64(&logger_tail, position + 1, position);
+            if (seen == position) break;
+            position = seen;
+        } else if (diff < 0) {
+            // Full: the writer has not freed this slot from the previous lap
+            InterlockedIncrement64(&logger_drops);
+            return;
+        } else {
+            position = logger_tail;  // Another producer took it
+        }
+    }
+    
+    record->time_ms = (LONG64)get_epoch_ms();
+    record->thread_id = GetCurrentThreadId();
+    record->level = level;
+    va_start(args, format);
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    WriteRelease64(&record->sequence, position + 1);
+    
+    if (level >= LOG_LEVEL_WARN || position - logger_head >= LOGGER_RING_RECORDS / 2) {
+        if (logger_sleeping && InterlockedExchange(&logger_sleeping, 0)) {
+            EnterCriticalSection(&logger_lock);
+            WakeConditionVariable(&logger_wake);
+            LeaveCriticalSection(&logger_lock);
+        }
+    }
+}
+
+/**
+ * Records lost because the ring was full
+ */
+LONG64 logger_dropped(void) {
+    return logger_drops;
+}
@@ -0,0 +1,67 @@
+#ifndef CHAT_LOGGER_H
+#define CHAT_LOGGER_H
+
+#include "chat_protocol.h"
+
+// Leveled server log. LOG_ macros format the text on the calling thread
+// and put the record in a lock-free ring; a background thread adds the
+// time and level and writes records in batches to the sinks (console
+// and/or a rotating file). When the ring is full records are dropped
+// and counted instead of blocking the caller. Each call site may log
+// at most `rate` records per second; the writer reports how many more
+// were suppressed once that second is over.
+#define LOGGER_RING_RECORDS 8192         // Records waiting for the writer (power of two)
+#define LOGGER_TEXT_LEN 256              // Longest message; longer ones are cut
+#define LOGGER_BATCH_SIZE (64 * 1024)    // Bytes written to the sinks at once
+#define LOGGER_FLUSH_MS 100              // Writer wakes at least this often
+#define DEFAULT_LOGGER_FILE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_LOGGER_FILES 5
+#define DEFAULT_LOGGER_RATE 50
+
+typedef enum {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO = 1,
+    LOG_LEVEL_WARN = 2,
+    LOG_LEVEL_ERROR = 3
+} LogLevel;
+
+typedef struct {
+    LogLevel level;                      // Records below this are not formatted
+    int console;                         // Write to stderr
+    const char *file_path;               // NULL: no file sink
+    LONG64 file_size;                    // Rotate the file past this size
+    int file_count;                      // Rotated files kept: path.1 .. path.N
+    int rate;                            // Records per call site per second, 0 = no limit
+} LoggerConfig;
+
+// Rate limit state of one call site
+typedef struct LoggerLimit {
+    volatile LONG64 second;              // GetTickCount64() / 1000 of the current window
+    volatile LONG count;                 // Records in that window
+    volatile LONG suppressed;            // Not logged and not yet reported
+    volatile LONG registered;            // On the writer's list of limited call sites
+    struct LoggerLimit *next;
+    const char *format;                  // Set when registered, for the report
+    LogLevel level;
+} LoggerLimit;
+
+extern volatile int logger_level;
+
+#define LOG_AT(level, ...) do { \
+    static LoggerLimit log_limit_; \
+    if ((int)(level) >= logger_level) logger_write(&log_limit_, (level), __VA_ARGS__); \
+} while (0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Function prototypes
+void logger_default_config(LoggerConfig *config);
+int logger_parse_level(const char *name, LogLevel *level);
+int logger_start(const LoggerConfig *config);
+void logger_stop(void);
+void logger_write(LoggerLimit *limit, LogLevel level, const char *format, ...);
+LONG64 logger_dropped(void);
+
+#endif // CHAT_LOGGER_H
@@ -0,0 +1,490 @@
+#include "chat_metrics.h"
+#include "chat_search.h"
+#include <stdarg.h>
+
+#define ADMIN_REQUEST_LEN 1024
+#define ADMIN_TIMEOUT_MS 1000            // Per admin request, and shutdown checks
+
+// Counters added up over every shard
+typedef struct {
+    ULONGLONG at_ms;                     // GetTickCount64() value when summed
+    LONG64 accepted;
+    LONG64 joins;
+    LONG64 leaves;
+    LONG64 messages_in;
+    LONG64 messages_out;
+    LONG64 bytes_in;
+    LONG64 bytes_out;
+    LONG64 send_calls;
+    LONG64 queued_frames;
+} MetricsSample;
+
+static MetricsShard shards[METRICS_MAX_SHARDS];
+C_ASSERT(sizeof(MetricsShard) % METRICS_CACHE_LINE == 0);  // Array neighbours start on a new line
+static DWORD shard_slot = TLS_OUT_OF_INDEXES;   // TLS index holding the thread's shard
+static MetricsGaugeCallback gauge_callback = NULL;
+static LARGE_INTEGER metrics_frequency;
+static ULONGLONG started_ms;
+
+// Samples taken by metrics_tick(), guarded by sample_lock
+static CRITICAL_SECTION sample_lock;
+static MetricsSample samples[METRICS_SAMPLES];
+static int sample_head = 0;
+static int sample_count = 0;
+
+// Admin socket, served by its own thread
+static SOCKET admin_socket = INVALID_SOCKET;
+static HANDLE admin_thread = NULL;
+static volatile int admin_running = 0;
+
+static const char *histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    "delivery", "dispatch", "mutex_wait"
+};
+static const char *histogram_help[METRIC_HISTOGRAM_COUNT] = {
+    "Time from creating a frame until it is written to a client",
+    "Time spent handling one message from a joined client",
+    "Time spent waiting for the client list lock"
+};
+
+// Prometheus bucket bounds in nanoseconds
+static const LONG64 prometheus_bounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+    250000000, 500000000, 1000000000, 2500000000LL
+};
+
+void metrics_init(MetricsGaugeCallback gauges) {
+    gauge_callback = gauges;
+    QueryPerformanceFrequency(&metrics_frequency);
+    started_ms = GetTickCount64();
+    shard_slot = TlsAlloc();
+    InitializeCriticalSection(&sample_lock);
+}
+
+MetricsShard *metrics_shard(int index) {
+    return &shards[index];
+}
+
+/**
+ * Make a shard the calling thread's, for code without a worker at hand
+ */
+void metrics_thread_start(int index) {
+    if (shard_slot != TLS_OUT_OF_INDEXES) {
+        TlsSetValue(shard_slot, &shards[index]);
+    }
+}
+
+/**
+ * The calling thread's shard, or NULL if it is not a worker
+ */
+MetricsShard *metrics_local(void) {
+    return shard_slot != TLS_OUT_OF_INDEXES ? (MetricsShard *)TlsGetValue(shard_slot) : NULL;
+}
+
+/**
+ * Timestamp for metrics_record(), in QueryPerformanceCounter ticks
+ */
+LONG64 metrics_now(void) {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+static int bucket_index(LONG64 value) {
+    if (value < METRICS_HIST_LINEAR) return (int)value;
+    
+    int msb = 0;
+    while ((value >> (msb + 1)) != 0) msb++;
+    int shift = msb - METRICS_HIST_SUB_BITS;
+    return METRICS_HIST_LINEAR + (msb - METRICS_HIST_SUB_BITS - 1) * (1 << METRICS_HIST_SUB_BITS) +
+        (int)((value >> shift) - (1 << METRICS_HIST_SUB_BITS));
+}
+
+/**
+ * Smallest value that lands in a bucket
+ */
+static LONG64 bucket_low(int index) {
+    if (index < METRICS_HIST_LINEAR) return index;
+    
+    int k = index - METRICS_HIST_LINEAR;
+    int shift = k >> METRICS_HIST_SUB_BITS;
+    return (LONG64)((1 << METRICS_HIST_SUB_BITS) + (k & ((1 << METRICS_HIST_SUB_BITS) - 1))) << (shift + 1);
+}
+
+/**
+ * Record the time between two metrics_now() values
+ */
+void metrics_record(MetricsShard *shard, MetricHistogram histogram, LONG64 start, LONG64 end) {
+    if (shard == NULL) return;
+    
+    LONG64 ticks = end > start ? end - start : 0;
+    LONG64 ns = (ticks / metrics_frequency.QuadPart) * 1000000000LL +
+        (ticks % metrics_frequency.QuadPart) * 1000000000LL / metrics_frequency.QuadPart;
+    
+    MetricsHistogram *h = &shard->histograms[histogram];
+    h->counts[bucket_index(ns)]++;
+    h->total++;
+    h->sum += ns;
+    if (ns > h->max) h->max = ns;
+}
+
+/**
+ * Add up the counters of every shard
+ */
+static void sum_counters(MetricsSample *total) {
+    memset(total, 0, sizeof(*total));
+    total->at_ms = GetTickCount64();
+    for (int i = 0; i < METRICS_MAX_SHARDS; i++) {
+        const MetricsShard *shard = &shards[i];
+        total->accepted += shard->accepted;
+        total->joins += shard->joins;
+        total->leaves += shard->leaves;
+        total->messages_in += shard->messages_in;
+        total->messages_out += shard->messages_out;
+        total->bytes_in += shard->bytes_in;
+        total->bytes_out += shard->bytes_out;
+        total->send_calls += shard->send_calls;
+        total->queued_frames += shard->queued_frames;
+    }
+}
+
+static void sum_histogram(MetricHistogram histogram, MetricsHistogram *total) {
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < METRICS_MAX_SHARDS; i++) {
+        const MetricsHistogram *h = &shards[i].histograms[histogram];
+        if (h->total == 0) continue;
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            total->counts[b] += h->counts[b];
+        }
+        total->total += h->total;
+        total->sum += h->sum;
+        if (h->max > total->max) total->max = h->max;
+    }
+}
+
+/**
+ * Value at a percentile (0-100), the middle of its bucket
+ */
+static LONG64 histogram_percentile(const MetricsHistogram *h, double percentile) {
+    if (h->total == 0) return 0;
+    
+    LONG64 rank = (LONG64)(percentile / 100.0 * (double)h->total + 0.5);
+    if (rank < 1) rank = 1;
+    LONG64 seen = 0;
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen < rank) continue;
+        if (i < METRICS_HIST_LINEAR) return i;
+        
+        LONG64 mid = (bucket_low(i) + bucket_low(i + 1)) / 2;
+        return mid < h->max ? mid : h->max;
+    }
+    return h->max;
+}
+
+/**
+ * Take a sample of the totals; called once a second by one worker
+ */
+void metrics_tick(void) {
+    MetricsSample total;
+    sum_counters(&total);
+    
+    EnterCriticalSection(&sample_lock);
+    samples[(sample_head + sample_count) % METRICS_SAMPLES] = total;
+    if (sample_count == METRICS_SAMPLES) {
+        sample_head = (sample_head + 1) % METRICS_SAMPLES;
+    } else {
+        sample_count++;
+    }
+    LeaveCriticalSection(&sample_lock);
+}
+
+/**
+ * Per-second rates of the totals over the sampled window, or since start
+ */
+static void compute_rates(const MetricsSample *total, MetricsSample *rates) {
+    MetricsSample oldest;
+    memset(&oldest, 0, sizeof(oldest));
+    oldest.at_ms = started_ms;
+    
+    EnterCriticalSection(&sample_lock);
+    if (sample_count > 0) {
+        oldest = samples[sample_head];
+    }
+    LeaveCriticalSection(&sample_lock);
+    
+    double seconds = total->at_ms > oldest.at_ms ? (double)(total->at_ms - oldest.at_ms) / 1000.0 : 1.0;
+    rates->joins = (LONG64)((double)(total->joins - oldest.joins) / seconds + 0.5);
+    rates->leaves = (LONG64)((double)(total->leaves - oldest.leaves) / seconds + 0.5);
+    rates->messages_in = (LONG64)((double)(total->messages_in - oldest.messages_in) / seconds + 0.5);
+    rates->messages_out = (LONG64)((double)(total->messages_out - oldest.messages_out) / seconds + 0.5);
+    rates->bytes_in = (LONG64)((double)(total->bytes_in - oldest.bytes_in) / seconds + 0.5);
+    rates->bytes_out = (LONG64)((double)(total->bytes_out - oldest.bytes_out) / seconds + 0.5);
+    rates->send_calls = (LONG64)((double)(total->send_calls - oldest.send_calls) / seconds + 0.5);
+}
+
+static void read_gauges(MetricsGauges *gauges) {
+    memset(gauges, 0, sizeof(*gauges));
+    if (gauge_callback != NULL) {
+        gauge_callback(gauges);
+    }
+}
+
+/**
+ * Append to a report; the length stays at size once it is full
+ */
+static int report_append(char *buffer, int size, int len, const char *format, ...) {
+    if (len >= size) return size;
+    
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + len, size - len, format, args);
+    va_end(args);
+    
+    if (written < 0 || written >= size - len) return size;
+    return len + written;
+}
+
+/**
+ * Human-readable report, one line per topic. Returns its length, or -1
+ * if it did not fit.
+ */
+int metrics_format_text(char *buffer, int size) {
+    MetricsSample total;
+    MetricsSample rates;
+    MetricsGauges gauges;
+    sum_counters(&total);
+    compute_rates(&total, &rates);
+    read_gauges(&gauges);
+    
+    int len = 0;
+    len = report_append(buffer, size, len, "Uptime %llu s, %d worker(s)\n",
+        (GetTickCount64() - started_ms) / 1000, gauges.workers);
+    len = report_append(buffer, size, len, "Users %lld (v1 %lld, v2 %lld), connections %lld, accepted %lld\n",
+        gauges.users, gauges.users_by_proto[PROTO_TEXT], gauges.users_by_proto[PROTO_BINARY],
+        gauges.connections, total.accepted);
+    len = report_append(buffer, size, len, "Joins %lld (%lld/s), leaves %lld (%lld/s)\n",
+        total.joins, rates.joins, total.leaves, rates.leaves);
+    len = report_append(buffer, size, len, "Messages in %lld (%lld/s), out %lld (%lld/s)\n",
+        total.messages_in, rates.messages_in, total.messages_out, rates.messages_out);
+    len = report_append(buffer, size, len, "Bytes in %lld (%lld/s), out %lld (%lld/s)\n",
+        total.bytes_in, rates.bytes_in, total.bytes_out, rates.bytes_out);
+    len = report_append(buffer, size, len, "Send calls %lld (%lld/s), %.1f frame(s) per call\n",
+        total.send_calls, rates.send_calls,
+        total.send_calls > 0 ? (double)total.messages_out / (double)total.send_calls : 0.0);
+    len = report_append(buffer, size, len, "Outbound queues %lld frame(s); slow consumers: %lld dropped, %lld disconnected\n",
+        total.queued_frames, gauges.slow_dropped_frames, gauges.slow_disconnects);
+    len = report_append(buffer, size, len, "Receive buffers %lld KB in use, %lld KB pooled\n",
+        gauges.recv_buffer_bytes / 1024, gauges.recv_pool_bytes / 1024);
+    len = report_append(buffer, size, len, "Frame pool %lld KB free, %lld frame(s) allocated from the heap\n",
+        gauges.frame_pool_bytes / 1024, gauges.frame_heap_allocations);
+    if (gauges.log_dropped > 0) {
+        len = report_append(buffer, size, len, "Server log records dropped: %lld\n", gauges.log_dropped);
+    }
+    
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        MetricsHistogram h;
+        sum_histogram((MetricHistogram)i, &h);
+        len = report_append(buffer, size, len, "%s us: count %lld, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+            histogram_names[i], h.total,
+            histogram_percentile(&h, 50) / 1000.0, histogram_percentile(&h, 90) / 1000.0,
+            histogram_percentile(&h, 99) / 1000.0, histogram_percentile(&h, 99.9) / 1000.0,
+            h.max / 1000.0);
+    }
+    
+    if (search_enabled()) {
+        SearchStats search;
+        search_get_stats(&search);
+        len = report_append(buffer, size, len, "Search: %lld message(s), %lld term(s), %lld KB\n",
+            search.docs, search.terms, search.bytes / 1024);
+    }
+    
+    return len < size ? len : -1;
+}
+
+static int append_prometheus_value(char *buffer, int size, int len, const char *name, const char *type,
+                                   const char *help, LONG64 value) {
+    len = report_append(buffer, size, len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    return report_append(buffer, size, len, "%s %lld\n", name, value);
+}
+
+/**
+ * Prometheus text exposition format. Returns its length, or -1 if it
+ * did not fit.
+ */
+int metrics_format_prometheus(char *buffer, int size) {
+    MetricsSample total;
+    MetricsGauges gauges;
+    sum_counters(&total);
+    read_gauges(&gauges);
+    
+    int len = 0;
+    len = append_prometheus_value(buffer, size, len, "chat_users", "gauge", "Joined users", gauges.users);
+    len = report_append(buffer, size, len, "# HELP chat_users_by_protocol Joined users per wire format\n"
+                                           "# TYPE chat_users_by_protocol gauge\n");
+    len = report_append(buffer, size, len, "chat_users_by_protocol{protocol=\"v1\"} %lld\n", gauges.users_by_proto[PROTO_TEXT]);
+    len = report_append(buffer, size, len, "chat_users_by_protocol{protocol=\"v2\"} %lld\n", gauges.users_by_proto[PROTO_BINARY]);
+    len = append_prometheus_value(buffer, size, len, "chat_connections", "gauge", "Open connections", gauges.connections);
+    len = append_prometheus_value(buffer, size, len, "chat_connections_accepted_total", "counter", "Connections accepted", total.accepted);
+    len = append_prometheus_value(buffer, size, len, "chat_joins_total", "counter", "Users joined", total.joins);
+    len = append_prometheus_value(buffer, size, len, "chat_leaves_total", "counter", "Users left", total.leaves);
+    len = append_prometheus_value(buffer, size, len, "chat_messages_received_total", "counter", "Frames received from clients", total.messages_in);
+    len = append_prometheus_value(buffer, size, len, "chat_messages_sent_total", "counter", "Frames written to clients", total.messages_out);
+    len = append_prometheus_value(buffer, size, len, "chat_received_bytes_total", "counter", "Bytes received from clients", total.bytes_in);
+    len = append_prometheus_value(buffer, size, len, "chat_sent_bytes_total", "counter", "Bytes written to clients", total.bytes_out);
+    len = append_prometheus_value(buffer, size, len, "chat_send_calls_total", "counter", "WSASend calls writing queued frames", total.send_calls);
+    len = append_prometheus_value(buffer, size, len, "chat_outbound_queue_frames", "gauge", "Frames waiting in outbound queues", total.queued_frames);
+    len = append_prometheus_value(buffer, size, len, "chat_slow_consumer_dropped_frames_total", "counter",
+        "Chat frames discarded for slow consumers", gauges.slow_dropped_frames);
+    len = append_prometheus_value(buffer, size, len, "chat_slow_consumer_disconnects_total", "counter",
+        "Clients disconnected for being too slow", gauges.slow_disconnects);
+    len = append_prometheus_value(buffer, size, len, "chat_log_dropped_records_total", "counter",
+        "Server log records lost to a full ring", gauges.log_dropped);
+    len = append_prometheus_value(buffer, size, len, "chat_recv_buffer_bytes", "gauge",
+        "Receive ring memory held by connections", gauges.recv_buffer_bytes);
+    len = append_prometheus_value(buffer, size, len, "chat_recv_pool_bytes", "gauge",
+        "Free receive blocks kept for reuse", gauges.recv_pool_bytes);
+    len = append_prometheus_value(buffer, size, len, "chat_frame_pool_bytes", "gauge",
+        "Free frames kept for reuse", gauges.frame_pool_bytes);
+    len = append_prometheus_value(buffer, size, len, "chat_frame_heap_allocations_total", "counter",
+        "Frames the pool had to allocate from the heap", gauges.frame_heap_allocations);
+    
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        MetricsHistogram h;
+        sum_histogram((MetricHistogram)i, &h);
+        len = report_append(buffer, size, len, "# HELP chat_%s_seconds %s\n# TYPE chat_%s_seconds histogram\n",
+            histogram_names[i], histogram_help[i], histogram_names[i]);
+        
+        // Prometheus buckets are cumulative; an HDR bucket counts toward
+        // a bound once every value it holds is within the bound
+        LONG64 cumulative = 0;
+        int b = 0;
+        for (size_t k = 0; k < sizeof(prometheus_bounds) / sizeof(prometheus_bounds[0]); k++) {
+            while (b < METRICS_HIST_BUCKETS && bucket_low(b + 1) <= prometheus_bounds[k] + 1) {
+                cumulative += h.counts[b++];
+            }
+            len = report_append(buffer, size, len, "chat_%s_seconds_bucket{le=\"%g\"} %lld\n",
+                histogram_names[i], prometheus_bounds[k] / 1e9, cumulative);
+        }
+        len = report_append(buffer, size, len, "chat_%s_seconds_bucket{le=\"+Inf\"} %lld\n", histogram_names[i], h.total);
+        len = report_append(buffer, size, len, "chat_%s_seconds_sum %.9f\n", histogram_names[i], h.sum / 1e9);
+        len = report_append(buffer, size, len, "chat_%s_seconds_count %lld\n", histogram_names[i], h.total);
+    }
+    
+    if (search_enabled()) {
+        SearchStats search;
+        search_get_stats(&search);
+        len = append_prometheus_value(buffer, size, len, "chat_search_messages", "gauge", "Messages in the search index", search.docs);
+        len = append_prometheus_value(buffer, size, len, "chat_search_terms", "gauge", "Distinct terms in the search index", search.terms);
+        len = append_prometheus_value(buffer, size, len, "chat_search_bytes", "gauge", "Memory held by the search index", search.bytes);
+    }
+    
+    return len < size ? len : -1;
+}
+
+static void send_all(SOCKET socket, const char *data, int len) {
+    while (len > 0) {
+        int sent = send(socket, data, len, 0);
+        if (sent <= 0) return;
+        data += sent;
+        len -= sent;
+    }
+}
+
+/**
+ * Answer one admin request and close the connection. An HTTP GET for
+ * /metrics, or a line "metrics", gets the Prometheus format; anything
+ * else gets the text report.
+ */
+static void serve_admin_request(SOCKET client) {
+    static char report[METRICS_REPORT_SIZE];
+    char request[ADMIN_REQUEST_LEN];
+    DWORD timeout = ADMIN_TIMEOUT_MS;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    
+    int len = recv(client, request, sizeof(request) - 1, 0);
+    if (len < 0) len = 0;
+    request[len] = '\0';
+    
+    int http = strncmp(request, "GET ", 4) == 0;
+    const char *target = http ? request + 4 : request;
+    int prometheus = strncmp(target, http ? "/metrics" : "metrics", http ? 8 : 7) == 0;
+    
+    int report_len = prometheus
+        ? metrics_format_prometheus(report, sizeof(report))
+        : metrics_format_text(report, sizeof(report));
+    if (report_len < 0) report_len = (int)strlen(report);
+    
+    if (http) {
+        char header[256];
+        int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %d\r\nConnection: close\r\n\r\n", report_len);
+        send_all(client, header, header_len);
+    }
+    send_all(client, report, report_len);
+    closesocket(client);
+}
+
+static DWORD WINAPI admin_loop(LPVOID param) {
+    (void)param;
+    
+    while (admin_running) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(admin_socket, &readable);
+        struct timeval timeout = { ADMIN_TIMEOUT_MS / 1000, 0 };
+        if (select(0, &readable, NULL, NULL, &timeout) <= 0) continue;
+        
+        SOCKET client = accept(admin_socket, NULL, NULL);
+        if (client != INVALID_SOCKET) {
+            serve_admin_request(client);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Serve reports on 127.0.0.1:port from a background thread
+ */
+int metrics_start_admin(int port) {
+    admin_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (admin_socket == INVALID_SOCKET) return -1;
+    
+    int opt = 1;
+    setsockopt(admin_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((u_short)port);
+    
+    if (bind(admin_socket, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(admin_socket, 16) == SOCKET_ERROR) {
+        closesocket(admin_socket);
+        admin_socket = INVALID_SOCKET;
+        return -1;
+    }
+    
+    admin_running = 1;
+    admin_thread = CreateThread(NULL, 0, admin_loop, NULL, 0, NULL);
+    if (admin_thread == NULL) {
+        admin_running = 0;
+        closesocket(admin_socket);
+        admin_socket = INVALID_SOCKET;
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop_admin(void) {
+    if (admin_thread == NULL) return;
+    
+    admin_running = 0;
+    WaitForSingleObject(admin_thread, INFINITE);
+    CloseHandle(admin_thread);
+    admin_thread = NULL;
+    closesocket(admin_socket);
+    admin_socket = INVALID_SOCKET;
+}
@@ -0,0 +1,81 @@
+#ifndef CHAT_METRICS_H
+#define CHAT_METRICS_H
+
+#include "chat_protocol.h"
+
+#define METRICS_MAX_SHARDS 64            // One per worker thread
+#define METRICS_CACHE_LINE 64
+#define METRICS_SAMPLES 10               // One-second samples kept for rates
+#define METRICS_REPORT_SIZE 16384        // Largest report, either format
+#define METRICS_HIST_SUB_BITS 5          // 32 buckets per power of two, about 3% error
+#define METRICS_HIST_LINEAR (2 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_BUCKETS (METRICS_HIST_LINEAR + (64 - METRICS_HIST_SUB_BITS - 1) * (1 << METRICS_HIST_SUB_BITS))
+
+#if defined(__GNUC__)
+#define METRICS_ALIGNED __attribute__((aligned(METRICS_CACHE_LINE)))
+#else
+#define METRICS_ALIGNED __declspec(align(METRICS_CACHE_LINE))
+#endif
+
+typedef enum {
+    METRIC_DELIVERY,                     // Frame created until written to a socket
+    METRIC_DISPATCH,                     // Handling one message from a joined client
+    METRIC_LOCK_WAIT,                    // Waiting for client_mutex
+    METRIC_HISTOGRAM_COUNT
+} MetricHistogram;
+
+// Log-linear (HDR-style) histogram of nanosecond values
+typedef struct {
+    LONG64 counts[METRICS_HIST_BUCKETS];
+    LONG64 total;
+    LONG64 sum;
+    LONG64 max;
+} MetricsHistogram;
+
+// Counters of one worker thread. Only that thread writes them, without
+// atomics; readers add up every shard and may see a slightly old value.
+// Shards are cache-line aligned so workers never write the same line.
+typedef struct METRICS_ALIGNED {
+    LONG64 accepted;                     // Connections accepted
+    LONG64 joins;
+    LONG64 leaves;
+    LONG64 messages_in;                  // Frames received from clients
+    LONG64 messages_out;                 // Frames fully written to clients
+    LONG64 bytes_in;
+    LONG64 bytes_out;
+    LONG64 send_calls;                   // WSASend calls writing queued frames
+    LONG64 queued_frames;                // Frames waiting in outbound queues (gauge)
+    MetricsHistogram histograms[METRIC_HISTOGRAM_COUNT];
+} MetricsShard;
+
+// Values owned by the server, read when a report is built
+typedef struct {
+    LONG64 users;                        // Joined users
+    LONG64 users_by_proto[PROTO_COUNT];
+    LONG64 connections;                  // Open connections, joined or not
+    int workers;
+    LONG64 slow_dropped_frames;          // Chat frames discarded for slow consumers
+    LONG64 slow_disconnects;
+    LONG64 log_dropped;                  // Server log records lost to a full ring
+    LONG64 recv_buffer_bytes;            // Receive ring memory held by connections
+    LONG64 recv_pool_bytes;              // Free receive blocks kept for reuse
+    LONG64 frame_pool_bytes;             // Free frames kept for reuse
+    LONG64 frame_heap_allocations;       // Frames the pool had to malloc; flat once it has warmed up
+} MetricsGauges;
+
+typedef void (*MetricsGaugeCallback)(MetricsGauges *gauges);
+
+// Function prototypes
+void metrics_init(MetricsGaugeCallback gauges);
+MetricsShard *metrics_shard(int index);
+void metrics_thread_start(int index);
+MetricsShard *metrics_local(void);
+LONG64 metrics_now(void);
+void metrics_record(MetricsShard *shard, MetricHistogram histogram, LONG64 start, LONG64 end);
+void metrics_tick(void);
+int metrics_format_text(char *buffer, int size);
+int metrics_format_prometheus(char *buffer, int size);
+int metrics_start_admin(int port);
+void metrics_stop_admin(void);
+
+#endif // CHAT_METRICS_H
@@ -39,6 +39,8 @@ int serialize_message(const ChatMessage *msg, char *buffer, size_t buffer_size)
 
 /**
  * Deserialize string to message struct
+ * Fails on a username that does not fit or content shorter than its
+ * declared length.
  */
 int deserialize_message(const char *buffer, ChatMessage *msg) {
     if (buffer == NULL || msg == NULL) {
@@ -69,31 +71,375 @@ int deserialize_message(const char *buffer, ChatMessage *msg) {
     const char *username_end = strchr(p, '|');
     if (username_end == NULL) return -1;
     size_t username_len = username_end - p;
-    if (username_len >= sizeof(msg->username)) username_len = sizeof(msg->username) - 1;
-    strncpy(msg->username, p, username_len);
+    if (username_len >= sizeof(msg->username)) return -1;
+    memcpy(msg->username, p, username_len);
     msg->username[username_len] = '\0';
     p = username_end + 1;
     
     // Parse content length
-    msg->content_length = (int)strtol(p, &endptr, 10);
-    if (*endptr != '|') return -1;
-    if (msg->content_length < 0 || msg->content_length >= MAX_MESSAGE_LEN) return -1;
+    long content_length = strtol(p, &endptr, 10);
+    if (endptr == p || *endptr != '|') return -1;
+    if (content_length < 0 || content_length >= MAX_MESSAGE_LEN) return -1;
+    msg->content_length = (int)content_length;
     p = endptr + 1;
     
-    // Parse content
-    if (msg->content_length > 0) {
-        if ((size_t)msg->content_length >= sizeof(msg->content)) {
-            msg->content_length = sizeof(msg->content) - 1;
-        }
-        memcpy(msg->content, p, msg->content_length);
-        msg->content[msg->content_length] = '\0';
-    } else {
-        msg->content[0] = '\0';
+    // Parse content; the declared length must be present before the terminator
+    if (memchr(p, '\0', msg->content_length) != NULL) return -1;
+    memcpy(msg->content, p, msg->content_length);
+    msg->content[msg->content_length] = '\0';
+    
+    return 0;
+}
+
+/**
+ * Milliseconds since the Unix epoch (UTC)
+ */
+unsigned long long get_epoch_ms(void) {
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    
+    // FILETIME counts 100ns intervals since 1601-01-01
+    unsigned long long ticks = ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (ticks - 116444736000000000ULL) / 10000;
+}
+
+/**
+ * Convert a "YYYY-MM-DD HH:MM:SS" local time string to epoch milliseconds.
+ * Falls back to the current time if the string does not parse.
+ */
+static unsigned long long timestamp_to_ms(const char *timestamp) {
+    struct tm tm_value;
+    memset(&tm_value, 0, sizeof(tm_value));
+    
+    if (sscanf(timestamp, "%d-%d-%d %d:%d:%d",
+               &tm_value.tm_year, &tm_value.tm_mon, &tm_value.tm_mday,
+               &tm_value.tm_hour, &tm_value.tm_min, &tm_value.tm_sec) != 6) {
+        return get_epoch_ms();
+    }
+    tm_value.tm_year -= 1900;
+    tm_value.tm_mon -= 1;
+    tm_value.tm_isdst = -1;
+    
+    time_t seconds = mktime(&tm_value);
+    if (seconds == (time_t)-1) return get_epoch_ms();
+    return (unsigned long long)seconds * 1000;
+}
+
+/**
+ * Format epoch milliseconds as a "YYYY-MM-DD HH:MM:SS" local time string
+ */
+static void format_timestamp_ms(unsigned long long ms, char *buffer, size_t size) {
+    time_t seconds = (time_t)(ms / 1000);
+    struct tm *timeinfo = localtime(&seconds);
+    
+    if (timeinfo == NULL || strftime(buffer, size, "%Y-%m-%d %H:%M:%S", timeinfo) == 0) {
+        buffer[0] = '\0';
+    }
+}
+
+static void put_u16(unsigned char *p, unsigned int value) {
+    p[0] = (unsigned char)(value >> 8);
+    p[1] = (unsigned char)value;
+}
+
+static void put_u32(unsigned char *p, unsigned int value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static unsigned int get_u16(const unsigned char *p) {
+    return ((unsigned int)p[0] << 8) | p[1];
+}
+
+static unsigned int get_u32(const unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+/**
+ * Serialize message struct to a binary v2 frame (no trailing newline)
+ * Returns the frame length, or -1 if it does not fit.
+ */
+int serialize_message_v2(const ChatMessage *msg, char *buffer, size_t buffer_size) {
+    if (msg == NULL || buffer == NULL) {
+        return -1;
+    }
+    
+    size_t username_len = strlen(msg->username);
+    if (username_len >= MAX_USERNAME_LEN) return -1;
+    if (msg->content_length < 0 || msg->content_length >= MAX_MESSAGE_LEN) return -1;
+    
+    size_t total = CHAT_V2_HEADER_LEN + username_len + (size_t)msg->content_length;
+    if (total > buffer_size) return -1;
+    
+    unsigned long long ms = msg->timestamp_ms != 0 ? msg->timestamp_ms : timestamp_to_ms(msg->timestamp);
+    unsigned char *p = (unsigned char *)buffer;
+    p[0] = CHAT_V2_MAGIC;
+    p[1] = (unsigned char)msg->type;
+    p[2] = msg->flags;
+    put_u32(p + 3, msg->seq);
+    put_u32(p + 7, (unsigned int)(ms >> 32));
+    put_u32(p + 11, (unsigned int)ms);
+    p[15] = (unsigned char)username_len;
+    put_u16(p + 16, (unsigned int)msg->content_length);
+    
+    memcpy(buffer + CHAT_V2_HEADER_LEN, msg->username, username_len);
+    memcpy(buffer + CHAT_V2_HEADER_LEN + username_len, msg->content, msg->content_length);
+    
+    return (int)total;
+}
+
+/**
+ * Deserialize one complete binary v2 frame of the given length
+ */
+int deserialize_message_v2(const char *buffer, size_t length, ChatMessage *msg) {
+    if (buffer == NULL || msg == NULL) {
+        return -1;
+    }
+    
+    int total = frame_length(buffer, length);
+    if (total <= 0 || (size_t)total != length || !is_binary_frame(buffer, length)) {
+        return -1;
+    }
+    
+    memset(msg, 0, sizeof(ChatMessage));
+    
+    const unsigned char *p = (const unsigned char *)buffer;
+    unsigned int username_len = p[15];
+    
+    msg->type = (MessageType)p[1];
+    msg->flags = p[2];
+    msg->seq = get_u32(p + 3);
+    msg->timestamp_ms = ((unsigned long long)get_u32(p + 7) << 32) | get_u32(p + 11);
+    format_timestamp_ms(msg->timestamp_ms, msg->timestamp, sizeof(msg->timestamp));
+    
+    memcpy(msg->username, buffer + CHAT_V2_HEADER_LEN, username_len);
+    msg->username[username_len] = '\0';
+    
+    msg->content_length = (int)get_u16(p + 16);
+    memcpy(msg->content, buffer + CHAT_V2_HEADER_LEN + username_len, msg->content_length);
+    msg->content[msg->content_length] = '\0';
+    
+    return 0;
+}
+
+/**
+ * Check whether buffered data starts with a binary v2 frame
+ */
+int is_binary_frame(const char *buffer, size_t length) {
+    return length > 0 && (unsigned char)buffer[0] == CHAT_V2_MAGIC;
+}
+
+/**
+ * Whether a username can be carried in both formats: it must not contain
+ * the v1 field separator or anything that ends or cuts a line
+ */
+int valid_username(const char *username, int length) {
+    for (int i = 0; i < length; i++) {
+        char c = username[i];
+        if (c == '|' || c == '\n' || c == '\r' || c == '\0') return 0;
+    }
+    return 1;
+}
+
+/**
+ * Length of the first frame in a receive buffer, in either format
+ * (for v1 this includes the "\n"). Returns 0 if the frame is not complete
+ * yet and -1 if the header is invalid.
+ */
+int frame_length(const char *buffer, size_t length) {
+    if (length == 0) return 0;
+    
+    if (!is_binary_frame(buffer, length)) {
+        const char *line_end = (const char *)memchr(buffer, '\n', length);
+        return line_end == NULL ? 0 : (int)(line_end - buffer) + 1;
+    }
+    
+    if (length < CHAT_V2_HEADER_LEN) return 0;
+    
+    const unsigned char *p = (const unsigned char *)buffer;
+    unsigned int username_len = p[15];
+    unsigned int content_len = get_u16(p + 16);
+    if (username_len >= MAX_USERNAME_LEN || content_len >= MAX_MESSAGE_LEN) return -1;
+    
+    size_t total = CHAT_V2_HEADER_LEN + username_len + content_len;
+    if (length < total) return 0;
+    
+    // Relayed to v1 clients as is, so it must not forge fields or lines
+    if (!valid_username(buffer + CHAT_V2_HEADER_LEN, (int)username_len)) return -1;
+    return (int)total;
+}
+
+/**
+ * Parse an unsigned decimal field terminated by '|'.
+ * Returns a pointer just past the '|', or NULL.
+ */
+static const char *parse_decimal_field(const char *p, const char *end, int *value) {
+    const char *start = p;
+    int result = 0;
+    
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (p - start >= 9) return NULL;
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    if (p == start || p >= end || *p != '|') return NULL;
+    
+    *value = result;
+    return p + 1;
+}
+
+/**
+ * Locate a text field terminated by '|'.
+ * Returns a pointer just past the '|', or NULL.
+ */
+static const char *parse_text_field(const char *p, const char *end, const char **field, int *field_len) {
+    const char *bar = (const char *)memchr(p, '|', end - p);
+    if (bar == NULL) return NULL;
+    
+    *field = p;
+    *field_len = (int)(bar - p);
+    return bar + 1;
+}
+
+/**
+ * Fill a view from one complete v1 line ("\n" or "\r\n" terminated).
+ * The content must end the line: v1 frames are relayed byte for byte, so
+ * trailing bytes or an oversized timestamp would go to every recipient.
+ */
+static int parse_text_view(const char *buffer, size_t length, ChatMessageView *view) {
+    const char *end = buffer + length;
+    if (end > buffer && end[-1] == '\n') end--;
+    if (end > buffer && end[-1] == '\r') end--;
+    
+    int type;
+    const char *p = parse_decimal_field(buffer, end, &type);
+    if (p == NULL) return -1;
+    view->type = (MessageType)type;
+    
+    p = parse_text_field(p, end, &view->timestamp, &view->timestamp_len);
+    if (p == NULL || view->timestamp_len >= MAX_TIMESTAMP_LEN) return -1;
+    p = parse_text_field(p, end, &view->username, &view->username_len);
+    if (p == NULL || view->username_len >= MAX_USERNAME_LEN) return -1;
+    if (!valid_username(view->username, view->username_len)) return -1;
+    
+    p = parse_decimal_field(p, end, &view->content_length);
+    if (p == NULL || view->content_length >= MAX_MESSAGE_LEN) return -1;
+    if (view->content_length != end - p) return -1;
+    view->content = p;
+    
+    return 0;
+}
+
+/**
+ * Fill a view for one complete frame (length as returned by frame_length).
+ * Nothing is copied; the view points into buffer.
+ */
+int parse_message_view(const char *buffer, size_t length, ChatMessageView *view) {
+    if (buffer == NULL || view == NULL || length == 0) {
+        return -1;
     }
     
+    view->frame = buffer;
+    view->frame_len = (int)length;
+    view->flags = 0;
+    view->seq = 0;
+    view->timestamp_ms = 0;
+    
+    if (!is_binary_frame(buffer, length)) {
+        view->proto = PROTO_TEXT;
+        return parse_text_view(buffer, length, view);
+    }
+    
+    if (frame_length(buffer, length) != (int)length) {
+        return -1;
+    }
+    
+    parse_binary_view(buffer, view);
     return 0;
 }
 
+/**
+ * Fill the view fields of a v2 frame whose length frame_length has
+ * already checked; frame, frame_len and the defaults are left alone
+ */
+void parse_binary_view(const char *buffer, ChatMessageView *view) {
+    const unsigned char *p = (const unsigned char *)buffer;
+    view->proto = PROTO_BINARY;
+    view->type = (MessageType)p[1];
+    view->flags = p[2];
+    view->seq = get_u32(p + 3);
+    view->timestamp_ms = ((unsigned long long)get_u32(p + 7) << 32) | get_u32(p + 11);
+    view->timestamp = NULL;
+    view->timestamp_len = 0;
+    view->username = buffer + CHAT_V2_HEADER_LEN;
+    view->username_len = p[15];
+    view->content = view->username + view->username_len;
+    view->content_length = (int)get_u16(p + 16);
+}
+
+/**
+ * Encode a view as a complete frame in the given format (v1 includes
+ * "\n"). A frame already in that format is forwarded byte for byte,
+ * except that a v2 header takes the view's seq.
+ * Returns the frame length, or -1 if it does not fit.
+ */
+int encode_view_frame(const ChatMessageView *view, ProtocolVersion proto, char *buffer, size_t buffer_size) {
+    if (view == NULL || buffer == NULL) {
+        return -1;
+    }
+    
+    if (view->proto == proto) {
+        if ((size_t)view->frame_len > buffer_size) return -1;
+        memcpy(buffer, view->frame, view->frame_len);
+        if (proto == PROTO_BINARY) {
+            put_u32((unsigned char *)buffer + 3, view->seq);
+        }
+        return view->frame_len;
+    }
+    
+    if (proto == PROTO_BINARY) {
+        // v1 -> v2: the text timestamp becomes epoch milliseconds
+        char timestamp[MAX_TIMESTAMP_LEN];
+        int timestamp_len = view->timestamp_len < (int)sizeof(timestamp) - 1 ? view->timestamp_len : (int)sizeof(timestamp) - 1;
+        memcpy(timestamp, view->timestamp, timestamp_len);
+        timestamp[timestamp_len] = '\0';
+        
+        size_t total = CHAT_V2_HEADER_LEN + view->username_len + view->content_length;
+        if (total > buffer_size) return -1;
+        
+        unsigned long long ms = timestamp_to_ms(timestamp);
+        unsigned char *p = (unsigned char *)buffer;
+        p[0] = CHAT_V2_MAGIC;
+        p[1] = (unsigned char)view->type;
+        p[2] = view->flags;
+        put_u32(p + 3, view->seq);
+        put_u32(p + 7, (unsigned int)(ms >> 32));
+        put_u32(p + 11, (unsigned int)ms);
+        p[15] = (unsigned char)view->username_len;
+        put_u16(p + 16, (unsigned int)view->content_length);
+        memcpy(buffer + CHAT_V2_HEADER_LEN, view->username, view->username_len);
+        memcpy(buffer + CHAT_V2_HEADER_LEN + view->username_len, view->content, view->content_length);
+        return (int)total;
+    }
+    
+    // v2 -> v1: format the header, then copy content without newlines
+    char timestamp[MAX_TIMESTAMP_LEN];
+    format_timestamp_ms(view->timestamp_ms, timestamp, sizeof(timestamp));
+    int header_len = snprintf(buffer, buffer_size, "%d|%s|%.*s|%d|",
+        view->type, timestamp, view->username_len, view->username, view->content_length);
+    if (header_len < 0 || (size_t)header_len + view->content_length + 1 > buffer_size) return -1;
+    
+    char *out = buffer + header_len;
+    for (int i = 0; i < view->content_length; i++) {
+        char c = view->content[i];
+        out[i] = (c == '\n' || c == '\r') ? ' ' : c;
+    }
+    out[view->content_length] = '\n';
+    return header_len + view->content_length + 1;
+}
+
 /**
  * Print formatted message to console
  */
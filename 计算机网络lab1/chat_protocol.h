@@ -5,6 +5,10 @@
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #define _CRT_SECURE_NO_WARNINGS
 
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600   // WSAPoll requires Windows Vista or later
+#endif
+
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <windows.h>
@@ -18,9 +22,27 @@
 #define MAX_BUFFER_SIZE 4096
 #define MAX_USERNAME_LEN 64
 #define MAX_MESSAGE_LEN 2048
-#define MAX_CLIENTS 100
+#define MAX_TIMESTAMP_LEN 32
+#define MAX_CLIENTS 16384
 #define SERVER_PORT 8888
 
+// Binary protocol v2: every frame starts with a fixed 18-byte header
+//   magic(1) type(1) flags(1) seq(4) timestamp_ms(8) username_len(1) content_len(2)
+// followed by the username and content bytes. Integers are big-endian.
+// v1 text frames always start with a digit, so the magic byte tells them apart.
+// seq is the sender's counter on frames from a client; on frames from the
+// server it is the server's relay order, which a reconnecting client
+// presents in MSG_RESUME.
+#define CHAT_V2_MAGIC 0xC2
+#define CHAT_V2_HEADER_LEN 18
+#define CHAT_V2_CAPABILITY "CLIENT/2"   // NICKNAME username that asks for v2
+
+// v2 clients are given a session token at the end of the join ACK,
+// "..., session <token>", and may resume with MSG_RESUME "<token> <last seq>"
+// as the first message of a new connection
+#define CHAT_SESSION_MARKER ", session "
+#define MAX_SESSION_TOKEN_LEN 48
+
 // Message types
 typedef enum {
     MSG_JOIN = 1,      // Client joins the chat room
@@ -30,23 +52,74 @@ typedef enum {
     MSG_ERROR = 5,     // Error message
     MSG_ACK = 6,       // Acknowledgment
     MSG_SYSTEM = 7,    // System message
-    MSG_NICKNAME = 8   // Set nickname (before joining)
+    MSG_NICKNAME = 8,  // Set nickname (before joining)
+    MSG_JOIN_ROOM = 9,     // Join a room, content: room name
+    MSG_LEAVE_ROOM = 10,   // Leave a room, content: room name
+    MSG_ROOM_MESSAGE = 11, // Message to one room, content: "room text"
+    MSG_DIRECT = 12,       // Message to one user, content: "<id|nickname> text"
+    MSG_SEARCH = 13,       // Search request (content: terms) or one search hit
+    MSG_RESUME = 14,       // Resume a dropped session, content: "<token> <last seq>"
+    MSG_STATS = 15,        // Request server statistics, answered with MSG_SYSTEM lines
+    MSG_PING = 16,         // Heartbeat, answered with MSG_PONG (either side may send it)
+    MSG_PONG = 17          // Heartbeat answer
 } MessageType;
 
+// Wire formats; also used as an index into per-version encodings
+typedef enum {
+    PROTO_TEXT = 0,    // v1: TYPE|TIMESTAMP|USERNAME|LEN|CONTENT\n
+    PROTO_BINARY = 1,  // v2: length-prefixed binary frame
+    PROTO_COUNT = 2
+} ProtocolVersion;
+
 // Message structure
 typedef struct {
     MessageType type;
-    char timestamp[32];    // Format: YYYY-MM-DD HH:MM:SS
+    char timestamp[MAX_TIMESTAMP_LEN];    // Format: YYYY-MM-DD HH:MM:SS
     char username[MAX_USERNAME_LEN];
     char content[MAX_MESSAGE_LEN];
     int content_length;    // Actual content length in bytes
+    unsigned char flags;   // v2 only, reserved (zero)
+    unsigned int seq;      // v2 only, sender's sequence number (see above)
+    unsigned long long timestamp_ms;  // Epoch milliseconds; 0 = use timestamp
 } ChatMessage;
 
+// Borrowed view of one received frame. Fields point into the receive
+// buffer and are not NUL-terminated; the view is only valid until that
+// buffer is reused.
+typedef struct {
+    MessageType type;
+    ProtocolVersion proto;           // Format the frame arrived in
+    const char *frame;               // Whole frame, including a v1 "\n"
+    int frame_len;
+    const char *timestamp;           // v1 only
+    int timestamp_len;
+    const char *username;
+    int username_len;
+    const char *content;
+    int content_length;
+    unsigned char flags;             // v2 only
+    unsigned int seq;                // v2: written into re-encoded frames
+    unsigned long long timestamp_ms; // v2 only; v1 is converted on demand
+} ChatMessageView;
+
 // Function prototypes
 void get_timestamp(char *buffer, size_t size);
 int serialize_message(const ChatMessage *msg, char *buffer, size_t buffer_size);
 int deserialize_message(const char *buffer, ChatMessage *msg);
 void print_message(const ChatMessage *msg);
 
+// Protocol v2 and framing helpers shared by client and server
+unsigned long long get_epoch_ms(void);
+int serialize_message_v2(const ChatMessage *msg, char *buffer, size_t buffer_size);
+int deserialize_message_v2(const char *buffer, size_t length, ChatMessage *msg);
+int frame_length(const char *buffer, size_t length);
+int is_binary_frame(const char *buffer, size_t length);
+int valid_username(const char *username, int length);
+
+// Zero-copy parsing of a complete frame and re-encoding for relaying
+int parse_message_view(const char *buffer, size_t length, ChatMessageView *view);
+void parse_binary_view(const char *buffer, ChatMessageView *view);
+int encode_view_frame(const ChatMessageView *view, ProtocolVersion proto, char *buffer, size_t buffer_size);
+
 #endif // CHAT_PROTOCOL_H
 
@@ -0,0 +1,294 @@
+#include "chat_registry.h"
+
+#define REGISTRY_INITIAL_SLOTS 64
+#define INDEX_EMPTY (-1)
+
+// Which key an index is built on
+typedef enum {
+    INDEX_SOCKET = 0,
+    INDEX_ID = 1,
+    INDEX_NAME = 2
+} IndexKind;
+
+static unsigned int hash_int(unsigned long long value) {
+    // Fibonacci hashing spreads sequential IDs and socket handles
+    return (unsigned int)((value * 11400714819323198485ULL) >> 32);
+}
+
+static unsigned int hash_name(const char *name) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int *index_cells(const ClientRegistry *reg, IndexKind kind) {
+    switch (kind) {
+        case INDEX_SOCKET: return reg->by_socket;
+        case INDEX_ID: return reg->by_id;
+        default: return reg->by_name;
+    }
+}
+
+static unsigned int hash_key(IndexKind kind, const void *key) {
+    switch (kind) {
+        case INDEX_SOCKET: return hash_int((unsigned long long)*(const SOCKET *)key);
+        case INDEX_ID: return hash_int((unsigned long long)(unsigned int)*(const int *)key);
+        default: return hash_name((const char *)key);
+    }
+}
+
+static unsigned int hash_slot(const ClientRegistry *reg, IndexKind kind, int slot) {
+    const ClientInfo *client = &reg->slots[slot];
+    switch (kind) {
+        case INDEX_SOCKET: return hash_key(kind, &client->socket);
+        case INDEX_ID: return hash_key(kind, &client->user_id);
+        default: return hash_key(kind, client->username);
+    }
+}
+
+static int slot_matches(const ClientRegistry *reg, IndexKind kind, int slot, const void *key) {
+    const ClientInfo *client = &reg->slots[slot];
+    switch (kind) {
+        case INDEX_SOCKET: return client->socket == *(const SOCKET *)key;
+        case INDEX_ID: return client->user_id == *(const int *)key;
+        default: return strcmp(client->username, (const char *)key) == 0;
+    }
+}
+
+/**
+ * Find the slot holding a key, or -1
+ */
+static int index_lookup(const ClientRegistry *reg, IndexKind kind, const void *key) {
+    const int *cells = index_cells(reg, kind);
+    unsigned int mask = (unsigned int)reg->index_capacity - 1;
+    
+    for (unsigned int i = hash_key(kind, key) & mask; cells[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+        if (slot_matches(reg, kind, cells[i], key)) {
+            return cells[i];
+        }
+    }
+    return -1;
+}
+
+static void index_insert(ClientRegistry *reg, IndexKind kind, int slot) {
+    int *cells = index_cells(reg, kind);
+    unsigned int mask = (unsigned int)reg->index_capacity - 1;
+    
+    unsigned int i = hash_slot(reg, kind, slot) & mask;
+    while (cells[i] != INDEX_EMPTY) {
+        i = (i + 1) & mask;
+    }
+    cells[i] = slot;
+}
+
+/**
+ * Remove a slot from an index with backward-shift deletion, so lookups
+ * never have to skip tombstones
+ */
+static void index_remove(ClientRegistry *reg, IndexKind kind, int slot) {
+    int *cells = index_cells(reg, kind);
+    unsigned int mask = (unsigned int)reg->index_capacity - 1;
+    
+    unsigned int hole = hash_slot(reg, kind, slot) & mask;
+    while (cells[hole] != slot) {
+        if (cells[hole] == INDEX_EMPTY) return;
+        hole = (hole + 1) & mask;
+    }
+    cells[hole] = INDEX_EMPTY;
+    
+    // Pull back later entries of the probe run that can now sit earlier
+    for (unsigned int i = (hole + 1) & mask; cells[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+        unsigned int home = hash_slot(reg, kind, cells[i]) & mask;
+        int stays = (i > hole) ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (!stays) {
+            cells[hole] = cells[i];
+            cells[i] = INDEX_EMPTY;
+            hole = i;
+        }
+    }
+}
+
+/**
+ * Rebuild all three indexes with a new capacity
+ */
+static int index_resize(ClientRegistry *reg, int capacity) {
+    int *by_socket = (int *)malloc(sizeof(int) * capacity);
+    int *by_id = (int *)malloc(sizeof(int) * capacity);
+    int *by_name = (int *)malloc(sizeof(int) * capacity);
+    if (by_socket == NULL || by_id == NULL || by_name == NULL) {
+        free(by_socket);
+        free(by_id);
+        free(by_name);
+        return -1;
+    }
+    
+    // All bytes 0xFF is INDEX_EMPTY (-1)
+    memset(by_socket, 0xFF, sizeof(int) * capacity);
+    memset(by_id, 0xFF, sizeof(int) * capacity);
+    memset(by_name, 0xFF, sizeof(int) * capacity);
+    
+    free(reg->by_socket);
+    free(reg->by_id);
+    free(reg->by_name);
+    reg->by_socket = by_socket;
+    reg->by_id = by_id;
+    reg->by_name = by_name;
+    reg->index_capacity = capacity;
+    
+    for (int slot = 0; slot < reg->slot_count; slot++) {
+        if (reg->slots[slot].active) {
+            index_insert(reg, INDEX_SOCKET, slot);
+            index_insert(reg, INDEX_ID, slot);
+            index_insert(reg, INDEX_NAME, slot);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Take a slot from the free list, or grow the slab.
+ * Returns the slot number, or -1 when full.
+ */
+static int allocate_slot(ClientRegistry *reg) {
+    if (reg->free_head >= 0) {
+        int slot = reg->free_head;
+        reg->free_head = reg->slots[slot].next_free;
+        return slot;
+    }
+    
+    if (reg->slot_count == reg->slot_capacity) {
+        if (reg->slot_capacity >= reg->max_clients) return -1;
+        
+        int capacity = reg->slot_capacity * 2;
+        if (capacity > reg->max_clients) capacity = reg->max_clients;
+        ClientInfo *slots = (ClientInfo *)realloc(reg->slots, sizeof(ClientInfo) * capacity);
+        if (slots == NULL) return -1;
+        reg->slots = slots;
+        reg->slot_capacity = capacity;
+    }
+    
+    return reg->slot_count++;
+}
+
+/**
+ * Initialize an empty registry holding at most max_clients users
+ */
+int registry_init(ClientRegistry *reg, int max_clients) {
+    memset(reg, 0, sizeof(ClientRegistry));
+    reg->max_clients = max_clients;
+    reg->free_head = -1;
+    reg->next_user_id = 1;
+    
+    reg->slot_capacity = max_clients < REGISTRY_INITIAL_SLOTS ? max_clients : REGISTRY_INITIAL_SLOTS;
+    reg->slots = (ClientInfo *)malloc(sizeof(ClientInfo) * reg->slot_capacity);
+    if (reg->slots == NULL) return -1;
+    
+    if (index_resize(reg, REGISTRY_INITIAL_SLOTS * 2) != 0) {
+        registry_destroy(reg);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Free all memory held by a registry
+ */
+void registry_destroy(ClientRegistry *reg) {
+    free(reg->slots);
+    free(reg->by_socket);
+    free(reg->by_id);
+    free(reg->by_name);
+    memset(reg, 0, sizeof(ClientRegistry));
+}
+
+/**
+ * Add a user and assign the next user ID.
+ * Returns 0 on success, -2 if the nickname is taken, -1 if full.
+ * Pointers returned by the lookup functions are invalidated.
+ */
+int registry_add(ClientRegistry *reg, SOCKET socket, const char *username, void *owner, int *assigned_id) {
+    if (index_lookup(reg, INDEX_NAME, username) >= 0) {
+        return -2; // Duplicate username
+    }
+    
+    // Keep the load factor of every index at or below one half
+    if ((reg->active_count + 1) * 2 > reg->index_capacity) {
+        if (index_resize(reg, reg->index_capacity * 2) != 0) return -1;
+    }
+    
+    int slot = allocate_slot(reg);
+    if (slot < 0) return -1;
+    
+    ClientInfo *client = &reg->slots[slot];
+    client->socket = socket;
+    client->user_id = reg->next_user_id++;
+    strncpy(client->username, username, MAX_USERNAME_LEN - 1);
+    client->username[MAX_USERNAME_LEN - 1] = '\0';
+    client->active = 1;
+    client->owner = owner;
+    client->next_free = -1;
+    
+    index_insert(reg, INDEX_SOCKET, slot);
+    index_insert(reg, INDEX_ID, slot);
+    index_insert(reg, INDEX_NAME, slot);
+    reg->active_count++;
+    
+    if (assigned_id != NULL) {
+        *assigned_id = client->user_id;
+    }
+    return 0;
+}
+
+/**
+ * Remove the user on a socket and put its slot on the free list.
+ * Returns 0 if a user was removed, -1 if none was found.
+ */
+int registry_remove(ClientRegistry *reg, SOCKET socket) {
+    int slot = index_lookup(reg, INDEX_SOCKET, &socket);
+    if (slot < 0) return -1;
+    
+    index_remove(reg, INDEX_SOCKET, slot);
+    index_remove(reg, INDEX_ID, slot);
+    index_remove(reg, INDEX_NAME, slot);
+    
+    ClientInfo *client = &reg->slots[slot];
+    client->active = 0;
+    client->owner = NULL;
+    client->next_free = reg->free_head;
+    reg->free_head = slot;
+    reg->active_count--;
+    return 0;
+}
+
+/**
+ * Re-key a user from one socket to another, keeping its slot and ID.
+ * Returns 0 on success, -1 if no user is on old_socket.
+ */
+int registry_move_socket(ClientRegistry *reg, SOCKET old_socket, SOCKET new_socket) {
+    int slot = index_lookup(reg, INDEX_SOCKET, &old_socket);
+    if (slot < 0) return -1;
+    
+    index_remove(reg, INDEX_SOCKET, slot);
+    reg->slots[slot].socket = new_socket;
+    index_insert(reg, INDEX_SOCKET, slot);
+    return 0;
+}
+
+ClientInfo *registry_find_socket(const ClientRegistry *reg, SOCKET socket) {
+    int slot = index_lookup(reg, INDEX_SOCKET, &socket);
+    return slot < 0 ? NULL : &reg->slots[slot];
+}
+
+ClientInfo *registry_find_id(const ClientRegistry *reg, int user_id) {
+    int slot = index_lookup(reg, INDEX_ID, &user_id);
+    return slot < 0 ? NULL : &reg->slots[slot];
+}
+
+ClientInfo *registry_find_name(const ClientRegistry *reg, const char *username) {
+    int slot = index_lookup(reg, INDEX_NAME, username);
+    return slot < 0 ? NULL : &reg->slots[slot];
+}
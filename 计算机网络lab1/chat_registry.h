@@ -0,0 +1,45 @@
+#ifndef CHAT_REGISTRY_H
+#define CHAT_REGISTRY_H
+
+#include "chat_protocol.h"
+
+// Client information structure (one registry slot)
+typedef struct {
+    SOCKET socket;
+    int user_id;                    // User ID assigned by server
+    char username[MAX_USERNAME_LEN]; // Username (nickname)
+    int active;
+    void *owner;                    // Caller's handle for the user (server: its Connection)
+    int next_free;                  // Free-list link while inactive
+} ClientInfo;
+
+// Joined users: a slab of slots reused through a free list, plus
+// open-addressing hash indexes (slot numbers) by socket, user ID and
+// nickname. Not thread-safe; the caller serializes access.
+typedef struct {
+    ClientInfo *slots;
+    int slot_count;                 // Slots handed out so far
+    int slot_capacity;
+    int max_clients;
+    int free_head;                  // First reusable slot, -1 if none
+    int active_count;
+    
+    int *by_socket;
+    int *by_id;
+    int *by_name;
+    int index_capacity;             // Power of two, at least twice active_count
+    
+    int next_user_id;               // Next user ID to assign
+} ClientRegistry;
+
+// Function prototypes
+int registry_init(ClientRegistry *reg, int max_clients);
+void registry_destroy(ClientRegistry *reg);
+int registry_add(ClientRegistry *reg, SOCKET socket, const char *username, void *owner, int *assigned_id);
+int registry_remove(ClientRegistry *reg, SOCKET socket);
+int registry_move_socket(ClientRegistry *reg, SOCKET old_socket, SOCKET new_socket);
+ClientInfo *registry_find_socket(const ClientRegistry *reg, SOCKET socket);
+ClientInfo *registry_find_id(const ClientRegistry *reg, int user_id);
+ClientInfo *registry_find_name(const ClientRegistry *reg, const char *username);
+
+#endif // CHAT_REGISTRY_H
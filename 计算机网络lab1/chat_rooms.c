@@ -0,0 +1,161 @@
+#include "chat_rooms.h"
+
+#define ROOM_BUCKETS 4096               // Directory hash buckets (power of two)
+
+// Room directory: name -> Room, shared by all workers
+static Room *room_buckets[ROOM_BUCKETS];
+static SRWLOCK room_lock;
+static int next_room_id = 1;
+static int room_history_len;
+
+static unsigned int room_hash(const char *name) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash & (ROOM_BUCKETS - 1);
+}
+
+/**
+ * Find a room by name. Called with room_lock held.
+ */
+static Room *find_room(const char *name) {
+    for (Room *room = room_buckets[room_hash(name)]; room != NULL; room = room->next) {
+        if (strcmp(room->name, name) == 0) {
+            return room;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Initialize the room directory; each room keeps its last history_len messages
+ */
+void rooms_init(int history_len) {
+    InitializeSRWLock(&room_lock);
+    room_history_len = history_len;
+    memset(room_buckets, 0, sizeof(room_buckets));
+}
+
+/**
+ * Free every room (at shutdown, when no worker is running)
+ */
+void rooms_destroy(void) {
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        Room *room = room_buckets[i];
+        while (room != NULL) {
+            Room *next = room->next;
+            history_destroy(room->history);
+            free(room->member_ids);
+            free(room);
+            room = next;
+        }
+        room_buckets[i] = NULL;
+    }
+}
+
+/**
+ * Room names are 1-31 printable characters without spaces or '|'
+ */
+int validate_room_name(const char *name) {
+    if (name == NULL) return 0;
+    
+    size_t len = strlen(name);
+    if (len == 0 || len >= MAX_ROOM_NAME_LEN) return 0;
+    
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        if (*p <= ' ' || *p == '|') return 0;
+    }
+    return 1;
+}
+
+/**
+ * Add a user to a room, creating the room on first join.
+ * The caller makes sure the user is not a member yet.
+ * Returns the room, or NULL if out of memory.
+ */
+Room *room_join(const char *name, int user_id, int worker) {
+    AcquireSRWLockExclusive(&room_lock);
+    
+    Room *room = find_room(name);
+    if (room == NULL) {
+        room = (Room *)calloc(1, sizeof(Room));
+        if (room == NULL) {
+            ReleaseSRWLockExclusive(&room_lock);
+            return NULL;
+        }
+        room->id = next_room_id++;
+        strncpy(room->name, name, MAX_ROOM_NAME_LEN - 1);
+        room->history = history_create(room_history_len);  // Room works without one
+        
+        unsigned int bucket = room_hash(room->name);
+        room->next = room_buckets[bucket];
+        room_buckets[bucket] = room;
+    }
+    
+    if (room->member_count == room->member_capacity) {
+        int capacity = room->member_capacity == 0 ? 8 : room->member_capacity * 2;
+        int *ids = (int *)realloc(room->member_ids, sizeof(int) * capacity);
+        if (ids == NULL) {
+            ReleaseSRWLockExclusive(&room_lock);
+            return NULL;  // An empty new room is reused by the next join
+        }
+        room->member_ids = ids;
+        room->member_capacity = capacity;
+    }
+    
+    room->member_ids[room->member_count++] = user_id;
+    InterlockedIncrement(&room->worker_members[worker]);
+    
+    ReleaseSRWLockExclusive(&room_lock);
+    return room;
+}
+
+/**
+ * Remove a user from a room. The last member to leave frees it.
+ */
+void room_leave(Room *room, int user_id, int worker) {
+    AcquireSRWLockExclusive(&room_lock);
+    
+    for (int i = 0; i < room->member_count; i++) {
+        if (room->member_ids[i] == user_id) {
+            room->member_ids[i] = room->member_ids[--room->member_count];
+            InterlockedDecrement(&room->worker_members[worker]);
+            break;
+        }
+    }
+    
+    if (room->member_count == 0) {
+        Room **link = &room_buckets[room_hash(room->name)];
+        while (*link != room) {
+            link = &(*link)->next;
+        }
+        *link = room->next;
+        history_destroy(room->history);
+        free(room->member_ids);
+        free(room);
+    }
+    
+    ReleaseSRWLockExclusive(&room_lock);
+}
+
+/**
+ * Copy up to max_ids member IDs of a room.
+ * Returns the number of members, or -1 if there is no such room.
+ */
+int room_copy_members(const char *name, int *user_ids, int max_ids) {
+    AcquireSRWLockShared(&room_lock);
+    
+    Room *room = find_room(name);
+    int count = -1;
+    if (room != NULL) {
+        count = room->member_count < max_ids ? room->member_count : max_ids;
+        memcpy(user_ids, room->member_ids, sizeof(int) * count);
+        count = room->member_count;
+    }
+    
+    ReleaseSRWLockShared(&room_lock);
+    return count;
+}
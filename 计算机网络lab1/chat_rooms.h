@@ -0,0 +1,31 @@
+#ifndef CHAT_ROOMS_H
+#define CHAT_ROOMS_H
+
+#include "chat_history.h"
+
+#define MAX_ROOM_NAME_LEN 32
+#define MAX_ROOMS_PER_USER 16
+#define MAX_ROOM_WORKERS 64             // Matches the server's MAX_WORKERS
+
+// A named room. It exists while it has members; each member keeps it
+// alive, so a member may hold a Room pointer without the directory lock.
+typedef struct Room {
+    struct Room *next;                  // Directory hash chain
+    int id;                             // Never reused, safe to pass between workers
+    char name[MAX_ROOM_NAME_LEN];
+    int *member_ids;                    // User IDs, guarded by the directory lock
+    int member_count;
+    int member_capacity;
+    volatile LONG worker_members[MAX_ROOM_WORKERS];  // Members owned by each worker
+    MessageHistory *history;            // Recent room messages, NULL if disabled
+} Room;
+
+// Function prototypes
+void rooms_init(int history_len);
+void rooms_destroy(void);
+int validate_room_name(const char *name);
+Room *room_join(const char *name, int user_id, int worker);
+void room_leave(Room *room, int user_id, int worker);
+int room_copy_members(const char *name, int *user_ids, int max_ids);
+
+#endif // CHAT_ROOMS_H
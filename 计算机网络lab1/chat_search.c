@@ -0,0 +1,532 @@
+#include "chat_search.h"
+#include <ctype.h>
+#include <limits.h>
+
+#define SEARCH_BLOCK_SIZE (1024 * 1024)   // Message store allocation unit
+#define MAX_WORD_LEN 32                   // Longer words are cut to this length
+#define MAX_DOC_TERMS (MAX_MESSAGE_LEN * 2)
+#define MAX_QUERY_TERMS 16
+#define SWEEP_STEP 8                      // Dictionary slots checked per added message
+#define MIN_INDEX_CAPACITY 1024
+
+// Messages that contain one term, oldest first. Terms are kept as a
+// 64-bit hash only; a collision merely adds a stray hit.
+typedef struct {
+    unsigned long long term;         // 0 = empty slot
+    int *docs;                       // Ascending message numbers
+    int start;                       // First entry that has not expired
+    int count;
+    int capacity;
+} PostingList;
+
+// Messages are stored once, as their v2 frames, in blocks that are
+// freed in order as the oldest messages expire
+typedef struct SearchBlock {
+    struct SearchBlock *next;
+    int last_doc;                    // Newest message stored in the block
+    int used;
+    char data[SEARCH_BLOCK_SIZE];
+} SearchBlock;
+
+// One character of a CJK run, as bytes of the sender's encoding
+typedef struct {
+    const unsigned char *bytes;
+    int len;
+} CjkChar;
+
+static SRWLOCK search_lock;
+static int search_max_docs = 0;            // 0 = search disabled
+static int first_doc = 0;                  // Oldest searchable message
+static int next_doc = 0;
+static char **doc_frames = NULL;           // Ring indexed by message % search_max_docs
+static SearchBlock *block_head = NULL;
+static SearchBlock *block_tail = NULL;
+static int block_count = 0;
+
+static PostingList *dictionary = NULL;
+static int dictionary_capacity = 0;        // Power of two
+static int term_count = 0;
+static int sweep_cursor = 0;
+static LONG64 live_postings = 0;
+static LONG64 posting_bytes = 0;
+
+static unsigned long long hash_bytes(unsigned long long hash, const unsigned char *bytes, int len) {
+    // FNV-1a, 64 bit
+    for (int i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static unsigned long long term_hash(const unsigned char *a, int a_len, const unsigned char *b, int b_len) {
+    unsigned long long hash = hash_bytes(14695981039346656037ULL, a, a_len);
+    hash = hash_bytes(hash, b, b_len);
+    return hash != 0 ? hash : 1;     // 0 marks an empty slot
+}
+
+// What a character contributes to terms
+typedef enum {
+    CHAR_SEPARATOR = 0,
+    CHAR_LETTER = 1,                 // Part of a word
+    CHAR_CJK = 2                     // Part of a CJK run
+} CharClass;
+
+/**
+ * Classify the character at p and store its length in bytes.
+ * Clients send what their console produces: UTF-8, or GBK on a Chinese
+ * Windows console, so both encodings are recognized.
+ */
+static CharClass classify_char(const unsigned char *p, int remaining, int *len) {
+    *len = 1;
+    if (p[0] < 0x80) {
+        return isalnum(p[0]) ? CHAR_LETTER : CHAR_SEPARATOR;
+    }
+    
+    // UTF-8
+    if (remaining >= 2 && (p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) {
+        *len = 2;
+        return CHAR_LETTER;          // Accented Latin, Cyrillic, Greek, ...
+    }
+    if (remaining >= 3 && (p[0] & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+        unsigned int code = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+        *len = 3;
+        if ((code >= 0x3040 && code <= 0x30FF) ||   // Kana
+            (code >= 0x3400 && code <= 0x4DBF) ||   // CJK extension A
+            (code >= 0x4E00 && code <= 0x9FFF) ||   // CJK unified ideographs
+            (code >= 0xAC00 && code <= 0xD7AF) ||   // Hangul
+            (code >= 0xF900 && code <= 0xFAFF)) {   // CJK compatibility
+            return CHAR_CJK;
+        }
+        // CJK punctuation and full-width forms separate
+        if ((code >= 0x3000 && code <= 0x303F) || (code >= 0xFF00 && code <= 0xFFEF)) {
+            return CHAR_SEPARATOR;
+        }
+        return CHAR_LETTER;
+    }
+    if (remaining >= 4 && (p[0] & 0xF8) == 0xF0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80) {
+        *len = 4;
+        return CHAR_SEPARATOR;       // Emoji and the like
+    }
+    
+    // GBK double byte; rows 0xA1-0xA9 hold punctuation and symbols
+    if (remaining >= 2 && p[0] >= 0x81 && p[0] <= 0xFE && p[1] >= 0x40 && p[1] <= 0xFE && p[1] != 0x7F) {
+        *len = 2;
+        return (p[0] >= 0xA1 && p[0] <= 0xA9) ? CHAR_SEPARATOR : CHAR_CJK;
+    }
+    return CHAR_SEPARATOR;
+}
+
+/**
+ * Terms of a CJK run: for a message every character and every pair of
+ * neighbours; for a query only the pairs (or the single character),
+ * since those already imply the characters
+ */
+static int add_cjk_terms(const CjkChar *run, int run_len, int for_query, unsigned long long *terms, int count, int max_terms) {
+    for (int i = 0; i < run_len && count < max_terms; i++) {
+        if (!for_query || run_len == 1) {
+            terms[count++] = term_hash(run[i].bytes, run[i].len, NULL, 0);
+        }
+        if (i + 1 < run_len && count < max_terms) {
+            terms[count++] = term_hash(run[i].bytes, run[i].len, run[i + 1].bytes, run[i + 1].len);
+        }
+    }
+    return count;
+}
+
+static int compare_terms(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Split text into terms: ASCII words of two or more letters or digits
+ * (case-folded) and CJK characters and bigrams. Returns the number of
+ * distinct terms.
+ */
+static int tokenize(const char *text, int len, int for_query, unsigned long long *terms, int max_terms) {
+    const unsigned char *p = (const unsigned char *)text;
+    unsigned char word[MAX_WORD_LEN];
+    int word_len = 0;
+    int word_chars = 0;
+    CjkChar run[MAX_MESSAGE_LEN / 2];
+    int run_len = 0;
+    int count = 0;
+    
+    int i = 0;
+    while (i <= len && count < max_terms) {
+        int char_len = 0;
+        CharClass kind = i < len ? classify_char(p + i, len - i, &char_len) : CHAR_SEPARATOR;
+        
+        // A word ends at anything that is not a letter, a CJK run likewise
+        if (kind != CHAR_LETTER && word_chars > 0) {
+            if (word_chars >= 2) {
+                terms[count++] = term_hash(word, word_len, NULL, 0);
+            }
+            word_len = 0;
+            word_chars = 0;
+        }
+        if (kind != CHAR_CJK && run_len > 0) {
+            count = add_cjk_terms(run, run_len, for_query, terms, count, max_terms);
+            run_len = 0;
+        }
+        if (i == len) break;
+        
+        if (kind == CHAR_LETTER) {
+            // Words are matched case-insensitively and cut at MAX_WORD_LEN bytes
+            for (int k = 0; k < char_len && word_len < MAX_WORD_LEN; k++) {
+                word[word_len++] = (unsigned char)tolower(p[i + k]);
+            }
+            word_chars++;
+        } else if (kind == CHAR_CJK && run_len < (int)(sizeof(run) / sizeof(run[0]))) {
+            run[run_len].bytes = p + i;
+            run[run_len].len = char_len;
+            run_len++;
+        }
+        i += char_len;
+    }
+    
+    // A term that occurs twice in a message is indexed once
+    qsort(terms, count, sizeof(unsigned long long), compare_terms);
+    int distinct = 0;
+    for (int j = 0; j < count; j++) {
+        if (distinct == 0 || terms[distinct - 1] != terms[j]) {
+            terms[distinct++] = terms[j];
+        }
+    }
+    return distinct;
+}
+
+/**
+ * Dictionary slot of a term, or -1
+ */
+static int dictionary_find(unsigned long long term) {
+    if (dictionary_capacity == 0) return -1;
+    unsigned int mask = (unsigned int)dictionary_capacity - 1;
+    for (unsigned int i = (unsigned int)term & mask; dictionary[i].term != 0; i = (i + 1) & mask) {
+        if (dictionary[i].term == term) return (int)i;
+    }
+    return -1;
+}
+
+static int dictionary_resize(int capacity) {
+    PostingList *table = (PostingList *)calloc(capacity, sizeof(PostingList));
+    if (table == NULL) return -1;
+    
+    unsigned int mask = (unsigned int)capacity - 1;
+    for (int i = 0; i < dictionary_capacity; i++) {
+        if (dictionary[i].term == 0) continue;
+        unsigned int slot = (unsigned int)dictionary[i].term & mask;
+        while (table[slot].term != 0) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = dictionary[i];
+    }
+    
+    free(dictionary);
+    dictionary = table;
+    dictionary_capacity = capacity;
+    sweep_cursor = 0;
+    return 0;
+}
+
+/**
+ * Remove a slot with backward-shift deletion (as in chat_registry.c)
+ */
+static void dictionary_remove(int hole) {
+    unsigned int mask = (unsigned int)dictionary_capacity - 1;
+    dictionary[hole].term = 0;
+    term_count--;
+    
+    for (unsigned int i = ((unsigned int)hole + 1) & mask; dictionary[i].term != 0; i = (i + 1) & mask) {
+        unsigned int home = (unsigned int)dictionary[i].term & mask;
+        unsigned int h = (unsigned int)hole;
+        int stays = (i > h) ? (home > h && home <= i) : (home > h || home <= i);
+        if (!stays) {
+            dictionary[hole] = dictionary[i];
+            dictionary[i].term = 0;
+            hole = (int)i;
+        }
+    }
+}
+
+/**
+ * First entry of a list that has not expired
+ */
+static int live_start(const PostingList *list) {
+    int lo = list->start;
+    int hi = list->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (list->docs[mid] < first_doc) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Drop expired entries from the front of a list.
+ * Returns 0 if nothing is left, in which case the list is freed.
+ */
+static int trim_list(PostingList *list) {
+    int start = live_start(list);
+    live_postings -= start - list->start;
+    list->start = start;
+    
+    if (list->start == list->count) {
+        posting_bytes -= (LONG64)sizeof(int) * list->capacity;
+        free(list->docs);
+        list->docs = NULL;
+        list->start = list->count = list->capacity = 0;
+        return 0;
+    }
+    
+    // Reclaim the dead front once it is most of the list
+    if (list->start >= 16 && list->start * 2 >= list->count) {
+        memmove(list->docs, list->docs + list->start, sizeof(int) * (list->count - list->start));
+        list->count -= list->start;
+        list->start = 0;
+    }
+    return 1;
+}
+
+static int posting_append(unsigned long long term, int doc) {
+    int slot = dictionary_find(term);
+    if (slot < 0) {
+        if ((term_count + 1) * 2 > dictionary_capacity) {
+            int capacity = dictionary_capacity == 0 ? MIN_INDEX_CAPACITY : dictionary_capacity * 2;
+            if (dictionary_resize(capacity) != 0) return -1;
+        }
+        unsigned int mask = (unsigned int)dictionary_capacity - 1;
+        slot = (int)((unsigned int)term & mask);
+        while (dictionary[slot].term != 0) {
+            slot = (slot + 1) & mask;
+        }
+        memset(&dictionary[slot], 0, sizeof(PostingList));
+        dictionary[slot].term = term;
+        term_count++;
+    }
+    
+    PostingList *list = &dictionary[slot];
+    if (list->count == list->capacity) {
+        if (list->start > 0) trim_list(list);
+        if (list->count == list->capacity) {
+            int capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+            int *docs = (int *)realloc(list->docs, sizeof(int) * capacity);
+            if (docs == NULL) return -1;
+            posting_bytes += (LONG64)sizeof(int) * (capacity - list->capacity);
+            list->docs = docs;
+            list->capacity = capacity;
+        }
+    }
+    list->docs[list->count++] = doc;
+    live_postings++;
+    return 0;
+}
+
+/**
+ * Trim a few dictionary slots per added message, so lists of terms that
+ * are no longer used do not keep expired entries forever
+ */
+static void sweep_step(void) {
+    for (int n = 0; n < SWEEP_STEP && dictionary_capacity > 0; n++) {
+        PostingList *list = &dictionary[sweep_cursor];
+        if (list->term != 0 && list->start < list->count && list->docs[list->start] < first_doc && !trim_list(list)) {
+            dictionary_remove(sweep_cursor);
+            continue;                // Another entry may have moved into this slot
+        }
+        sweep_cursor = (sweep_cursor + 1) & (dictionary_capacity - 1);
+    }
+}
+
+static void free_all(void) {
+    for (int i = 0; i < dictionary_capacity; i++) {
+        free(dictionary[i].docs);
+    }
+    free(dictionary);
+    dictionary = NULL;
+    dictionary_capacity = 0;
+    term_count = 0;
+    sweep_cursor = 0;
+    live_postings = 0;
+    posting_bytes = 0;
+    
+    while (block_head != NULL) {
+        SearchBlock *next = block_head->next;
+        free(block_head);
+        block_head = next;
+    }
+    block_tail = NULL;
+    block_count = 0;
+    first_doc = 0;
+    next_doc = 0;
+}
+
+/**
+ * Expire the oldest message, freeing its block once all of it expired
+ */
+static void expire_oldest(void) {
+    first_doc++;
+    while (block_head != NULL && block_head->last_doc < first_doc) {
+        SearchBlock *next = block_head->next;
+        free(block_head);
+        block_head = next;
+        block_count--;
+    }
+    if (block_head == NULL) block_tail = NULL;
+}
+
+/**
+ * Copy a frame into the message store. Returns its address or NULL.
+ */
+static char *store_frame(const char *frame, int frame_len) {
+    if (block_tail == NULL || block_tail->used + frame_len > SEARCH_BLOCK_SIZE) {
+        SearchBlock *block = (SearchBlock *)malloc(sizeof(SearchBlock));
+        if (block == NULL) return NULL;
+        block->next = NULL;
+        block->used = 0;
+        block->last_doc = next_doc;
+        if (block_tail != NULL) block_tail->next = block; else block_head = block;
+        block_tail = block;
+        block_count++;
+    }
+    
+    char *copy = block_tail->data + block_tail->used;
+    memcpy(copy, frame, frame_len);
+    block_tail->used += frame_len;
+    block_tail->last_doc = next_doc;
+    return copy;
+}
+
+/**
+ * Make the last max_docs messages searchable (0 disables search)
+ */
+int search_init(int max_docs) {
+    InitializeSRWLock(&search_lock);
+    if (max_docs <= 0) return 0;
+    
+    doc_frames = (char **)calloc(max_docs, sizeof(char *));
+    if (doc_frames == NULL) return -1;
+    search_max_docs = max_docs;
+    return 0;
+}
+
+void search_destroy(void) {
+    free_all();
+    free(doc_frames);
+    doc_frames = NULL;
+    search_max_docs = 0;
+}
+
+int search_enabled(void) {
+    return search_max_docs > 0;
+}
+
+/**
+ * Index one message given as a v2 frame. Tokenizing happens before the
+ * lock is taken; the oldest message expires once max_docs are indexed.
+ */
+void search_add(const char *frame, int frame_len) {
+    if (search_max_docs == 0) return;
+    
+    ChatMessageView view;
+    if (parse_message_view(frame, frame_len, &view) != 0 || view.proto != PROTO_BINARY) return;
+    
+    unsigned long long terms[MAX_DOC_TERMS];
+    int term_total = tokenize(view.content, view.content_length, 0, terms, MAX_DOC_TERMS);
+    if (term_total == 0) return;
+    
+    AcquireSRWLockExclusive(&search_lock);
+    
+    // Message numbers are ints; start over rather than wrap
+    if (next_doc == INT_MAX) {
+        free_all();
+    }
+    if (next_doc - first_doc == search_max_docs) {
+        expire_oldest();
+    }
+    
+    char *copy = store_frame(frame, frame_len);
+    if (copy != NULL) {
+        int doc = next_doc++;
+        doc_frames[doc % search_max_docs] = copy;
+        for (int i = 0; i < term_total; i++) {
+            posting_append(terms[i], doc);
+        }
+        sweep_step();
+    }
+    
+    ReleaseSRWLockExclusive(&search_lock);
+}
+
+/**
+ * Find the newest messages containing every term. Each hit is passed to
+ * the callback while the index is locked for reading.
+ * Returns the number of hits, or -1 if the query has no usable terms.
+ */
+int search_query(const char *terms, int terms_len, int max_results, SearchResultCallback callback, void *context) {
+    unsigned long long query[MAX_QUERY_TERMS];
+    int query_count = tokenize(terms, terms_len, 1, query, MAX_QUERY_TERMS);
+    if (query_count == 0) return -1;
+    if (search_max_docs == 0) return 0;
+    
+    AcquireSRWLockShared(&search_lock);
+    
+    // Walk the shortest list from its newest entry; look the others up
+    const PostingList *lists[MAX_QUERY_TERMS];
+    int starts[MAX_QUERY_TERMS];
+    int ends[MAX_QUERY_TERMS];          // Search bound, moves down as docs decrease
+    int shortest = 0;
+    int found = 0;
+    int usable = 1;                     // Every term occurs somewhere
+    for (int i = 0; i < query_count && usable; i++) {
+        int slot = dictionary_find(query[i]);
+        if (slot < 0) {
+            usable = 0;
+            break;
+        }
+        lists[i] = &dictionary[slot];
+        starts[i] = live_start(lists[i]);
+        ends[i] = lists[i]->count;
+        usable = starts[i] < ends[i];
+        if (ends[i] - starts[i] < ends[shortest] - starts[shortest]) shortest = i;
+    }
+    
+    for (int k = usable ? ends[shortest] - 1 : -1; usable && k >= starts[shortest] && found < max_results; k--) {
+        int doc = lists[shortest]->docs[k];
+        int match = 1;
+        
+        for (int i = 0; i < query_count && match; i++) {
+            if (i == shortest) continue;
+            
+            // Last entry <= doc within [starts[i], ends[i])
+            int lo = starts[i];
+            int hi = ends[i];
+            while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (lists[i]->docs[mid] <= doc) lo = mid + 1; else hi = mid;
+            }
+            ends[i] = lo;
+            match = lo > starts[i] && lists[i]->docs[lo - 1] == doc;
+        }
+        
+        if (match) {
+            const char *frame = doc_frames[doc % search_max_docs];
+            callback(frame, frame_length(frame, CHAT_V2_HEADER_LEN + MAX_USERNAME_LEN + MAX_MESSAGE_LEN), context);
+            found++;
+        }
+    }
+    
+    ReleaseSRWLockShared(&search_lock);
+    return found;
+}
+
+void search_get_stats(SearchStats *stats) {
+    AcquireSRWLockShared(&search_lock);
+    stats->docs = next_doc - first_doc;
+    stats->terms = term_count;
+    stats->postings = live_postings;
+    stats->bytes = (LONG64)block_count * sizeof(SearchBlock) + posting_bytes +
+        (LONG64)dictionary_capacity * sizeof(PostingList) + (LONG64)search_max_docs * sizeof(char *);
+    ReleaseSRWLockShared(&search_lock);
+}
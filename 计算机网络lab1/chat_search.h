@@ -0,0 +1,31 @@
+#ifndef CHAT_SEARCH_H
+#define CHAT_SEARCH_H
+
+#include "chat_protocol.h"
+
+// Off unless --search-docs is given: every indexed lobby message takes
+// the index's exclusive lock on the relaying worker and allocates for its
+// copy and postings, and a million messages cost about 250 MB
+#define DEFAULT_SEARCH_DOCS 0            // Messages kept searchable, 0 = search off
+#define MAX_SEARCH_DOCS 50000000
+#define MAX_SEARCH_RESULTS 10
+
+// Called for each hit with the message's v2 frame, newest hit first
+typedef void (*SearchResultCallback)(const char *frame, int frame_len, void *context);
+
+typedef struct {
+    LONG64 docs;                     // Messages currently searchable
+    LONG64 terms;                    // Distinct terms in the dictionary
+    LONG64 postings;                 // Live (term, message) pairs
+    LONG64 bytes;                    // Memory held by the index
+} SearchStats;
+
+// Function prototypes
+int search_init(int max_docs);
+void search_destroy(void);
+int search_enabled(void);
+void search_add(const char *frame, int frame_len);
+int search_query(const char *terms, int terms_len, int max_results, SearchResultCallback callback, void *context);
+void search_get_stats(SearchStats *stats);
+
+#endif // CHAT_SEARCH_H
@@ -1,20 +1,255 @@
 #include "chat_protocol.h"
+#include "chat_frame.h"
+#include "chat_framing.h"
+#include "chat_buffer.h"
+#include "chat_registry.h"
+#include "chat_rooms.h"
+#include "chat_history.h"
+#include "chat_log.h"
+#include "chat_search.h"
+#include "chat_trace.h"
+#include "chat_metrics.h"
+#include "chat_logger.h"
+#include "chat_timer.h"
+#include <bcrypt.h>
 
-// Client information structure
+#pragma comment(lib, "bcrypt.lib")
+
+#define HANDSHAKE_TIMEOUT_MS 30000              // Time allowed to send NICKNAME
+#define DEFAULT_HEARTBEAT_MS 30000              // Silence before a joined client is sent MSG_PING
+#define DEFAULT_HEARTBEAT_TIMEOUT_MS 10000      // Time to answer it before the peer counts as gone
+#define DEFAULT_RESUME_GRACE_MS 30000           // Time a dropped v2 session waits for MSG_RESUME
+#define DEFAULT_RESUME_FRAMES 256               // Sent frames kept per session for resuming
+#define SESSION_SECRET_LEN 32                   // Hex digits of the random part of a token
+#define OUTQ_INITIAL_FRAMES 16                  // First allocation of an outbound queue
+#define OUTQ_RING_CLASSES 9                     // Queue ring sizes OUTQ_INITIAL_FRAMES .. OUTQ_MAX_FRAMES
+#define OUTQ_SPARE_BYTES (32 * 1024)            // Drained queue rings of each size kept per worker for reuse
+#define HEAP_COMPACT_BYTES (4 * 1024 * 1024)    // Ring memory freed by a burst before the heap is compacted
+#define CONN_SLAB_OBJECTS 64                    // Connections (and JoinedUsers) per slab
+#define INBOX_SPARE_NODES 4096                  // Free inbox nodes kept for reuse
+#define SENT_INITIAL_FRAMES 16                  // First allocation of a resume ring, grown up to resume_frames
+#define ROOMS_INITIAL 4                         // First allocation of a user's room list
+#define OUTQ_MAX_FRAMES 4096                    // Hard limit on queued frames per connection
+#define FLUSH_BATCH 64                          // Frames gathered into one WSASend
+#define DEFAULT_FLUSH_BYTES (16 * 1024)         // Queued bytes that end a coalescing window early
+#define MAX_WORKERS 64
+#define FIRST_CONN_INDEX 2                      // poll_fds[0] = listener, [1] = wakeup socket
+#define LOCAL_ROOM_BUCKETS 1024                 // Per-worker room index buckets (power of two)
+
+typedef struct Worker Worker;
+
+// What to do with a client whose outbound queue crosses a watermark
+typedef enum {
+    SLOW_DROP_OLDEST = 0,  // Discard the oldest queued chat messages, keep system messages
+    SLOW_COALESCE = 1,     // Replace all queued chat messages with one skip notice
+    SLOW_DISCONNECT = 2    // Send MSG_ERROR and close the connection
+} SlowConsumerPolicy;
+
+// How often each slow-consumer policy fired (updated atomically by workers)
+typedef struct {
+    volatile LONG64 drop_events;
+    volatile LONG64 coalesce_events;
+    volatile LONG64 disconnects;
+    volatile LONG64 dropped_frames;  // Chat frames discarded by drop or coalesce
+} SlowConsumerStats;
+
+// Connection states driven by the event loop
+typedef enum {
+    CONN_HANDSHAKE = 0,    // Connected, waiting for NICKNAME message
+    CONN_ACTIVE = 1,       // Joined, exchanging chat messages
+    CONN_CLOSING = 2       // Closed at the end of the current loop iteration
+} ConnState;
+
+// What a joined user has beyond its connection: read by commands and
+// the resume handshake, never by the fan-out and flush loops
+typedef struct {
+    char username[MAX_USERNAME_LEN];
+    char session_secret[SESSION_SECRET_LEN + 1]; // Random part of the session token, "" if not resumable
+    Room **rooms;                    // Rooms joined (each membership keeps its Room alive)
+    int room_count;
+    int room_capacity;
+} JoinedUser;
+
+// Per-connection state (one per accepted socket, owned by one worker).
+// Only what the event loop touches for every connection lives here; the
+// buffers are leased while data is in flight, so an idle connection holds
+// just this struct and its JoinedUser.
 typedef struct {
     SOCKET socket;
-    int user_id;                    // User ID assigned by server
-    char username[MAX_USERNAME_LEN]; // Username (nickname)
-    int active;
-} ClientInfo;
+    ConnState state;
+    ProtocolVersion proto;           // Wire format, chosen during the handshake
+    Worker *worker;
+    int poll_index;                  // Position in worker->poll_fds / conns
+    int user_id;                     // Valid once state is CONN_ACTIVE
+    JoinedUser *user;                // Allocated when the nickname is accepted
+    Timer timer;                     // Handshake deadline, heartbeat or resume grace (see connection_timer)
+    ULONGLONG last_recv;             // GetTickCount64() when data last arrived
+    ULONGLONG ping_sent_at;          // MSG_PING unanswered since then, 0 if none
+    ULONGLONG detached_until;        // Socket lost: resumable until this tick, 0 while attached
+    LONG64 lobby_seq;                // Newest lobby history frame replayed on join
+    LONG64 joined_at;                // metrics_now() at join; older frames were replayed
+    RingBuffer recv;                 // Bytes not yet handled, only a partial frame between reads
+    struct Frame **out_frames;       // Ring of frames waiting for the socket, NULL while empty
+    int out_head;
+    int out_count;
+    int out_cap;
+    int out_offset;                  // Bytes of the head frame already sent
+    int out_bytes;                   // Total length of queued frames
+    int dirty;                       // Queued on dirty_conns for flushing
+    ULONGLONG flush_due;             // Coalescing window: written once this tick passes
+    int evicting;                    // Too slow: closed after a final flush
+    int skipped;                     // Messages counted by skip_notice
+    struct Frame *skip_notice;       // Queued coalesce notice not yet sent
+    struct Frame **sent_frames;      // Ring of the last frames written, NULL if not resumable
+    int sent_head;
+    int sent_count;
+    int sent_cap;                    // Grows up to resume_frames
+} Connection;
+
+// Node of a worker inbox (intrusive multi-producer single-consumer queue)
+typedef struct InboxNode {
+    struct InboxNode * volatile next;
+    Frame *frame;
+    int room_id;                     // 0 = every joined user
+    int user_id;                     // Direct message recipient, 0 if none
+    SOCKET socket;                   // frame == NULL: new socket resuming user_id's session
+    unsigned int last_seq;           // Last frame that client received
+} InboxNode;
+
+typedef struct {
+    InboxNode * volatile head;       // Producers exchange themselves in here
+    InboxNode *tail;                 // Only touched by the owning worker
+    InboxNode stub;
+} Inbox;
+
+// One online user as seen by readers of a snapshot
+typedef struct {
+    int user_id;
+    char username[MAX_USERNAME_LEN];
+} UserEntry;
+
+// Immutable copy of the registry, sorted by user ID. Readers use it
+// without locks; replaced snapshots are freed once every worker has
+// passed a quiescent point (the top of its event loop).
+typedef struct UserSnapshot {
+    LONG version;                    // membership_version it was built from
+    LONG64 retire_epoch;             // Set when it is replaced
+    struct UserSnapshot *next_retired;
+    int count;
+    UserEntry users[1];
+} UserSnapshot;
+
+// Members of one room that belong to a single worker
+typedef struct LocalRoom {
+    struct LocalRoom *next;
+    int room_id;
+    Connection **members;
+    LONG64 *replayed_seqs;           // Newest history frame replayed to each member
+    int count;
+    int capacity;
+} LocalRoom;
+
+// One event loop thread and the connections it accepted
+struct Worker {
+    int index;
+    HANDLE thread;
+    
+    // poll_fds[i] belongs to conns[i]; the first two slots have no connection
+    WSAPOLLFD *poll_fds;
+    Connection **conns;
+    int poll_count;
+    int poll_capacity;
+    
+    // Connections with pending output, flushed once per loop iteration
+    // or, with a coalescing window, once their window closes
+    Connection **dirty_conns;        // poll_capacity entries
+    int dirty_count;
+    ULONGLONG flush_due;             // Earliest window still open, 0 if none
+    
+    // Broadcasts posted by other workers
+    Inbox inbox;
+    SOCKET wake_socket;              // Loopback UDP socket polled for wakeups
+    struct sockaddr_in wake_addr;
+    volatile LONG wake_pending;
+    volatile LONG active_count;      // Joined users owned by this worker
+    volatile LONG64 quiescent_epoch; // Last reclaim epoch seen holding no snapshot
+    
+    // Room ID -> local members, so room fan-out only touches members
+    LocalRoom *local_rooms[LOCAL_ROOM_BUCKETS];
+    
+    MetricsShard *metrics;           // Counters written only by this worker
+    TimerWheel timers;               // One timer per connection
+    
+    // Drained outbound rings of each size, linked through their first slot
+    struct Frame **spare_rings[OUTQ_RING_CLASSES];
+    int spare_ring_count[OUTQ_RING_CLASSES];
+    LONG64 freed_ring_bytes;         // Grown rings freed since the heap was last compacted
+    
+    // Connection and JoinedUser structs of this worker
+    ObjectPool connection_pool;
+    ObjectPool user_pool;
+};
 
 // Global variables
-static ClientInfo clients[MAX_CLIENTS];
-static int client_count = 0;
-static int next_user_id = 1;         // Next user ID to assign
+static ClientRegistry registry;      // Joined users, guarded by client_mutex
 static HANDLE client_mutex = NULL;
+static volatile LONG membership_version = 0;  // Bumped on every join and leave
+
+// Read side of the registry (see UserSnapshot)
+static UserSnapshot * volatile user_snapshot = NULL;
+static UserSnapshot *retired_snapshots = NULL;  // Guarded by client_mutex
+static volatile LONG64 reclaim_epoch = 0;
 static SOCKET server_socket = INVALID_SOCKET;
-static int server_running = 1;
+static volatile int server_running = 1;
+static volatile LONG proto_users[PROTO_COUNT];  // Joined users per wire format
+static MessageHistory *lobby_history = NULL;    // Recent lobby messages, NULL if disabled
+static int history_len = DEFAULT_HISTORY_LEN;
+
+// Durable message log, off unless a directory is given
+static const char *log_dir = NULL;
+static int log_flush_ms = DEFAULT_LOG_FLUSH_MS;
+static int log_flush_bytes = DEFAULT_LOG_FLUSH_BYTES;
+static int search_docs = DEFAULT_SEARCH_DOCS;  // Lobby messages kept searchable, 0 if search is off
+
+// Session resume; 0 disables it
+static int resume_grace_ms = DEFAULT_RESUME_GRACE_MS;
+static int resume_frames = DEFAULT_RESUME_FRAMES;
+
+// Heartbeat; 0 disables it
+static int heartbeat_ms = DEFAULT_HEARTBEAT_MS;
+static int heartbeat_timeout_ms = DEFAULT_HEARTBEAT_TIMEOUT_MS;
+static int recv_buffer_max = DEFAULT_RECV_BUFFER_MAX;  // Largest receive ring per connection
+static const char *trace_path = NULL;           // Chrome trace written on Ctrl+Break and at exit
+static int admin_port = 0;                      // Local metrics socket, 0 if disabled
+static LoggerConfig logger_options;             // Server log sinks, level and rate limit
+
+// Free inbox nodes; a node is taken by one worker and freed by another
+static SLIST_HEADER spare_inbox_nodes;
+
+// Event loop workers
+static Worker workers[MAX_WORKERS];
+static int worker_count = 1;
+static SOCKET wake_sender = INVALID_SOCKET;
+
+// Slow-consumer watermarks and policy
+static int max_queued_msgs = 1024;
+static int max_queued_bytes = MAX_BUFFER_SIZE * 256;
+static SlowConsumerPolicy slow_policy = SLOW_DROP_OLDEST;
+static SlowConsumerStats slow_stats;
+
+// Write coalescing: output for a connection waits up to flush_window_ms
+// so frames from several loop iterations go out in one WSASend, unless
+// flush_bytes are queued first. 0 writes at the end of every iteration.
+static int flush_window_ms = 0;
+static int flush_bytes = DEFAULT_FLUSH_BYTES;
+
+/**
+ * Put socket into non-blocking mode
+ */
+static int set_nonblocking(SOCKET socket) {
+    u_long mode = 1;
+    return ioctlsocket(socket, FIONBIO, &mode);
+}
 
 /**
  * Initialize server socket
@@ -23,13 +258,13 @@ int init_server() {
     WSADATA wsaData;
     int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (result != 0) {
-        printf("WSAStartup failed: %d\n", result);
+        LOG_ERROR("WSAStartup failed: %d", result);
         return -1;
     }
     
     server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (server_socket == INVALID_SOCKET) {
-        printf("Socket creation failed: %ld\n", WSAGetLastError());
+        LOG_ERROR("Socket creation failed: %d", WSAGetLastError());
         WSACleanup();
         return -1;
     }
@@ -46,7 +281,7 @@ int init_server() {
     server_addr.sin_port = htons(SERVER_PORT);
     
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        printf("Bind failed: %ld\n", WSAGetLastError());
+        LOG_ERROR("Bind failed: %d", WSAGetLastError());
         closesocket(server_socket);
         WSACleanup();
         return -1;
@@ -54,7 +289,24 @@ int init_server() {
     
     // Listen
     if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
-        printf("Listen failed: %ld\n", WSAGetLastError());
+        LOG_ERROR("Listen failed: %d", WSAGetLastError());
+        closesocket(server_socket);
+        WSACleanup();
+        return -1;
+    }
+    
+    // Accept is driven by the event loops
+    if (set_nonblocking(server_socket) == SOCKET_ERROR) {
+        LOG_ERROR("Failed to set non-blocking mode: %d", WSAGetLastError());
+        closesocket(server_socket);
+        WSACleanup();
+        return -1;
+    }
+    
+    // Shared socket used to send wakeup datagrams to workers
+    wake_sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (wake_sender == INVALID_SOCKET) {
+        LOG_ERROR("Wakeup socket creation failed: %d", WSAGetLastError());
         closesocket(server_socket);
         WSACleanup();
         return -1;
@@ -63,438 +315,2565 @@ int init_server() {
     printf("==============================================================\n");
     printf("           NKU Chat Server\n");
     printf("==============================================================\n");
-    printf("Server started on port %d\n", SERVER_PORT);
-    printf("Waiting for clients...\n");
+    LOG_INFO("Server started on port %d with %d worker(s)", SERVER_PORT, worker_count);
+    LOG_INFO("Waiting for clients...");
     
     return 0;
 }
 
 /**
- * Add client to list (thread-safe)
- * Returns user_id on success, negative on error
+ * Acquire client_mutex, tracing the time spent waiting for it
  */
-int add_client(SOCKET socket, const char *username, int *assigned_id) {
+static void lock_clients(void) {
+    TRACE_BEGIN(wait_start);
+    LONG64 start = metrics_now();
     WaitForSingleObject(client_mutex, INFINITE);
-    
-    if (client_count >= MAX_CLIENTS) {
-        ReleaseMutex(client_mutex);
-        return -1;
-    }
-    
-    // Check for duplicate username
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].active && strcmp(clients[i].username, username) == 0) {
-            ReleaseMutex(client_mutex);
-            return -2; // Duplicate username
-        }
-    }
-    
-    // Assign user ID and add new client
-    int user_id = next_user_id++;
-    clients[client_count].socket = socket;
-    clients[client_count].user_id = user_id;
-    strncpy(clients[client_count].username, username, MAX_USERNAME_LEN - 1);
-    clients[client_count].username[MAX_USERNAME_LEN - 1] = '\0';
-    clients[client_count].active = 1;
-    client_count++;
-    
-    if (assigned_id != NULL) {
-        *assigned_id = user_id;
+    metrics_record(metrics_local(), METRIC_LOCK_WAIT, start, metrics_now());
+    TRACE_END(wait_start, TRACE_LOCK_WAIT, 0);
+}
+
+/**
+ * Add client to list (thread-safe)
+ * Returns 0 on success, -2 if the nickname is taken, -1 if full
+ */
+int add_client(SOCKET socket, const char *username, Connection *owner, int *assigned_id) {
+    lock_clients();
+    int result = registry_add(&registry, socket, username, owner, assigned_id);
+    if (result == 0) {
+        InterlockedIncrement(&membership_version);
     }
-    
     ReleaseMutex(client_mutex);
-    return 0;
+    return result;
 }
 
 /**
  * Remove client from list (thread-safe)
+ * The socket itself is closed by the owning event loop.
  */
 void remove_client(SOCKET socket) {
-    WaitForSingleObject(client_mutex, INFINITE);
-    
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].socket == socket && clients[i].active) {
-            clients[i].active = 0;
-            closesocket(clients[i].socket);
-            break;
-        }
+    lock_clients();
+    if (registry_remove(&registry, socket) == 0) {
+        InterlockedIncrement(&membership_version);
     }
-    
     ReleaseMutex(client_mutex);
 }
 
 /**
- * Broadcast message to all active clients except sender
+ * Fill in a message originating from the server
  */
-void broadcast_message(const ChatMessage *msg, SOCKET sender_socket) {
-    char buffer[MAX_BUFFER_SIZE];
-    int len = serialize_message(msg, buffer, sizeof(buffer));
-    if (len < 0) return;
-    
-    WaitForSingleObject(client_mutex, INFINITE);
+static void make_server_message(ChatMessage *msg, MessageType type, const char *content) {
+    msg->type = type;
+    get_timestamp(msg->timestamp, sizeof(msg->timestamp));
+    strncpy(msg->username, "SERVER", MAX_USERNAME_LEN - 1);
+    msg->username[MAX_USERNAME_LEN - 1] = '\0';
+    strncpy(msg->content, content, MAX_MESSAGE_LEN - 1);
+    msg->content[MAX_MESSAGE_LEN - 1] = '\0';
+    msg->content_length = (int)strlen(msg->content);
+    msg->flags = 0;
+    msg->seq = 0;
+    msg->timestamp_ms = get_epoch_ms();
+}
+
+/**
+ * Initialize an empty inbox
+ */
+static void inbox_init(Inbox *inbox) {
+    inbox->stub.next = NULL;
+    inbox->head = &inbox->stub;
+    inbox->tail = &inbox->stub;
+}
+
+/**
+ * Append a node (any thread, lock-free)
+ */
+static void inbox_push(Inbox *inbox, InboxNode *node) {
+    node->next = NULL;
+    InboxNode *prev = (InboxNode *)InterlockedExchangePointer((PVOID volatile *)&inbox->head, node);
+    prev->next = node;
+}
+
+/**
+ * Node for a post to another worker, from the spares when there are any
+ */
+static InboxNode *inbox_node_alloc(void) {
+    InboxNode *node = (InboxNode *)InterlockedPopEntrySList(&spare_inbox_nodes);
+    return node != NULL ? node : (InboxNode *)malloc(sizeof(InboxNode));
+}
+
+static void inbox_node_free(InboxNode *node) {
+    if (QueryDepthSList(&spare_inbox_nodes) < INBOX_SPARE_NODES) {
+        InterlockedPushEntrySList(&spare_inbox_nodes, (PSLIST_ENTRY)node);
+        return;
+    }
+    free(node);
+}
+
+/**
+ * Take the oldest node (owning worker only).
+ * Returns NULL when empty or when a producer is midway through a push.
+ */
+static InboxNode *inbox_pop(Inbox *inbox) {
+    InboxNode *tail = inbox->tail;
+    InboxNode *next = tail->next;
     
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].active && clients[i].socket != sender_socket) {
-            send(clients[i].socket, buffer, len, 0);
-            send(clients[i].socket, "\n", 1, 0); // Add newline for easier parsing
-        }
+    if (tail == &inbox->stub) {
+        if (next == NULL) return NULL;
+        inbox->tail = next;
+        tail = next;
+        next = next->next;
+    }
+    if (next != NULL) {
+        inbox->tail = next;
+        return tail;
     }
+    if (tail != inbox->head) return NULL;
     
-    ReleaseMutex(client_mutex);
+    // Last real node: put the stub back behind it so it can be detached
+    inbox_push(inbox, &inbox->stub);
+    next = tail->next;
+    if (next != NULL) {
+        inbox->tail = next;
+        return tail;
+    }
+    return NULL;
 }
 
 /**
- * Send message to specific client
+ * Wake a worker blocked in WSAPoll; repeated calls collapse into one datagram
  */
-void send_to_client(SOCKET socket, const ChatMessage *msg) {
-    char buffer[MAX_BUFFER_SIZE];
-    int len = serialize_message(msg, buffer, sizeof(buffer));
-    if (len < 0) return;
-    
-    send(socket, buffer, len, 0);
-    send(socket, "\n", 1, 0);
+static void wake_worker(Worker *worker) {
+    if (InterlockedExchange(&worker->wake_pending, 1) == 0) {
+        sendto(wake_sender, "w", 1, 0, (struct sockaddr*)&worker->wake_addr, sizeof(worker->wake_addr));
+    }
 }
 
 /**
- * Get list of online users as string (with ID and nickname)
+ * Schedule a connection for flushing at the end of the loop iteration
  */
-void get_user_list(char *buffer, size_t buffer_size) {
-    WaitForSingleObject(client_mutex, INFINITE);
+static void mark_dirty(Connection *conn) {
+    if (conn->dirty) return;
     
-    buffer[0] = '\0';
-    int first = 1;
-    char temp[128];
-    
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].active) {
-            if (!first) {
-                strncat(buffer, ", ", buffer_size - strlen(buffer) - 1);
-            }
-            snprintf(temp, sizeof(temp), "[ID:%d]%s", clients[i].user_id, clients[i].username);
-            strncat(buffer, temp, buffer_size - strlen(buffer) - 1);
-            first = 0;
-        }
+    // Sized with the poll set in add_poll_slot, so there is always room
+    Worker *worker = conn->worker;
+    worker->dirty_conns[worker->dirty_count++] = conn;
+    conn->dirty = 1;
+    if (flush_window_ms > 0) conn->flush_due = GetTickCount64() + flush_window_ms;
+}
+
+static int ring_class(int capacity) {
+    int index = 0;
+    while ((OUTQ_INITIAL_FRAMES << index) < capacity) index++;
+    return index;
+}
+
+/**
+ * Outbound ring of the given capacity (a power of two), from the
+ * worker's spares when it has one of that size. A queue that grows in
+ * every burst and is dropped when it drains then reuses the same rings.
+ */
+static Frame **take_ring(Worker *worker, int capacity) {
+    int index = ring_class(capacity);
+    Frame **ring = worker->spare_rings[index];
+    if (ring != NULL) {
+        worker->spare_rings[index] = *(Frame ***)ring;
+        worker->spare_ring_count[index]--;
+        return ring;
     }
-    
-    ReleaseMutex(client_mutex);
+    return (Frame **)malloc(capacity * sizeof(Frame *));
+}
+
+static void give_ring(Worker *worker, Frame **ring, int capacity) {
+    if (ring == NULL) return;
+    int index = ring_class(capacity);
+    if ((worker->spare_ring_count[index] + 1) * capacity * (int)sizeof(Frame *) > OUTQ_SPARE_BYTES) {
+        worker->freed_ring_bytes += capacity * sizeof(Frame *);
+        free(ring);
+        return;
+    }
+    *(Frame ***)ring = worker->spare_rings[index];
+    worker->spare_rings[index] = ring;
+    worker->spare_ring_count[index]++;
 }
 
 /**
- * Validate username
+ * Make room for one more frame in the ring, growing it up to OUTQ_MAX_FRAMES
  */
-int validate_username(const char *username) {
-    if (username == NULL) return 0;
-    
-    size_t len = strlen(username);
-    if (len == 0 || len >= MAX_USERNAME_LEN) return 0;
+static int reserve_outbound(Connection *conn) {
+    if (conn->out_count < conn->out_cap) return 1;
     
-    // Check for pipe character (not allowed)
-    if (strchr(username, '|') != NULL) return 0;
+    int new_cap = conn->out_cap ? conn->out_cap * 2 : OUTQ_INITIAL_FRAMES;
+    if (new_cap > OUTQ_MAX_FRAMES) return 0;
+    Frame **new_ring = take_ring(conn->worker, new_cap);
+    if (new_ring == NULL) return 0;
     
+    // Unwrap the old ring into the new one
+    for (int i = 0; i < conn->out_count; i++) {
+        new_ring[i] = conn->out_frames[(conn->out_head + i) % conn->out_cap];
+    }
+    give_ring(conn->worker, conn->out_frames, conn->out_cap);
+    conn->out_frames = new_ring;
+    conn->out_cap = new_cap;
+    conn->out_head = 0;
     return 1;
 }
 
 /**
- * Client handler thread function
+ * Store a frame at the tail of the ring
  */
-DWORD WINAPI client_handler(LPVOID lpParam) {
-    SOCKET client_socket = (SOCKET)(UINT_PTR)lpParam;
-    char buffer[MAX_BUFFER_SIZE];
-    char recv_buffer[MAX_BUFFER_SIZE * 2];
-    int recv_pos = 0;
-    ChatMessage msg;
-    int username_set = 0;
-    char client_username[MAX_USERNAME_LEN];
+static int push_outbound(Connection *conn, Frame *frame) {
+    if (!reserve_outbound(conn)) return 0;
     
-    // Wait for NICKNAME message (with timeout)
-    printf("Waiting for NICKNAME message from client...\n");
-    fd_set readfds;
-    struct timeval timeout;
-    timeout.tv_sec = 30;
-    timeout.tv_usec = 0;
-    
-    FD_ZERO(&readfds);
-    FD_SET(client_socket, &readfds);
+    conn->out_frames[(conn->out_head + conn->out_count) % conn->out_cap] = frame;
+    conn->out_count++;
+    conn->out_bytes += frame->len[conn->proto];
+    conn->worker->metrics->queued_frames++;
+    return 1;
+}
+
+/**
+ * Store a frame at the head of the ring, ahead of everything queued.
+ * Only valid while no frame is partly sent.
+ */
+static int push_outbound_front(Connection *conn, Frame *frame) {
+    if (!reserve_outbound(conn)) return 0;
     
-    int select_result = select(0, &readfds, NULL, NULL, &timeout);
-    if (select_result <= 0 || !FD_ISSET(client_socket, &readfds)) {
-        printf("Client connection timeout (select_result=%d)\n", select_result);
-        closesocket(client_socket);
-        return 1;
-    }
+    conn->out_head = (conn->out_head + conn->out_cap - 1) % conn->out_cap;
+    conn->out_frames[conn->out_head] = frame;
+    conn->out_count++;
+    conn->out_bytes += frame->len[conn->proto];
+    conn->worker->metrics->queued_frames++;
+    return 1;
+}
+
+/**
+ * Discard queued frames, oldest first, until the queue holds at most
+ * keep_msgs frames and keep_bytes bytes. Only MSG_MESSAGE frames are
+ * dropped unless drop_all is set; a partially sent head frame is kept so
+ * the byte stream stays well-formed. Returns the number dropped.
+ */
+static int drop_outbound(Connection *conn, int keep_msgs, int keep_bytes, int drop_all) {
+    int kept = 0;
+    int dropped = 0;
     
-    printf("Data available, receiving NICKNAME message...\n");
-    // Receive initial NICKNAME message
-    int bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received <= 0) {
-        printf("recv failed or connection closed (bytes=%d)\n", bytes_received);
-        closesocket(client_socket);
-        return 1;
+    for (int i = 0; i < conn->out_count; i++) {
+        Frame *frame = conn->out_frames[(conn->out_head + i) % conn->out_cap];
+        int over = (conn->out_count - dropped > keep_msgs) || (conn->out_bytes > keep_bytes);
+        int partial = (i == 0 && conn->out_offset > 0);
+        
+        if (over && !partial && (drop_all || frame->type == MSG_MESSAGE)) {
+            conn->out_bytes -= frame->len[conn->proto];
+            frame_release(frame);
+            dropped++;
+        } else {
+            conn->out_frames[(conn->out_head + kept) % conn->out_cap] = frame;
+            kept++;
+        }
     }
     
-    buffer[bytes_received] = '\0';
-    printf("Received %d bytes: %s\n", bytes_received, buffer);
+    conn->out_count = kept;
+    conn->worker->metrics->queued_frames -= dropped;
+    return dropped;
+}
+
+/**
+ * Queue MSG_ERROR behind whatever is partially sent and mark the
+ * connection for eviction once it has been flushed
+ */
+static void evict_slow_consumer(Connection *conn) {
+    ChatMessage error_msg;
+    make_server_message(&error_msg, MSG_ERROR, "Disconnected: too slow to keep up with the chat room");
     
-    // Remove newline if present
-    char *newline_pos = strchr(buffer, '\n');
-    if (newline_pos != NULL) {
-        *newline_pos = '\0';
+    drop_outbound(conn, 0, 0, 1);
+    conn->skip_notice = NULL;
+    Frame *frame = frame_create(&error_msg);
+    if (frame != NULL && !push_outbound(conn, frame)) {
+        frame_release(frame);
     }
     
-    // Parse NICKNAME message
-    if (deserialize_message(buffer, &msg) == 0 && msg.type == MSG_NICKNAME) {
-        printf("Successfully parsed NICKNAME message, nickname: %s\n", msg.content);
-        if (!validate_username(msg.content)) {
-            // Send error
-            ChatMessage error_msg;
-            error_msg.type = MSG_ERROR;
-            get_timestamp(error_msg.timestamp, sizeof(error_msg.timestamp));
-            strncpy(error_msg.username, "SERVER", MAX_USERNAME_LEN - 1);
-            strncpy(error_msg.content, "Invalid nickname format", MAX_MESSAGE_LEN - 1);
-            error_msg.content_length = strlen(error_msg.content);
-            send_to_client(client_socket, &error_msg);
-            closesocket(client_socket);
-            return 1;
-        }
-        
-        // Try to add client with nickname, get assigned user ID
-        int assigned_id = 0;
-        int result = add_client(client_socket, msg.content, &assigned_id);
-        if (result == -2) {
-            // Duplicate nickname
-            ChatMessage error_msg;
-            error_msg.type = MSG_ERROR;
-            get_timestamp(error_msg.timestamp, sizeof(error_msg.timestamp));
-            strncpy(error_msg.username, "SERVER", MAX_USERNAME_LEN - 1);
-            strncpy(error_msg.content, "Nickname already exists, please choose another one", MAX_MESSAGE_LEN - 1);
-            error_msg.content_length = strlen(error_msg.content);
-            send_to_client(client_socket, &error_msg);
-            closesocket(client_socket);
-            return 1;
-        } else if (result != 0) {
-            // Server full
-            ChatMessage error_msg;
-            error_msg.type = MSG_ERROR;
-            get_timestamp(error_msg.timestamp, sizeof(error_msg.timestamp));
-            strncpy(error_msg.username, "SERVER", MAX_USERNAME_LEN - 1);
-            strncpy(error_msg.content, "Server is full", MAX_MESSAGE_LEN - 1);
-            error_msg.content_length = strlen(error_msg.content);
-            send_to_client(client_socket, &error_msg);
-            closesocket(client_socket);
-            return 1;
+    conn->evicting = 1;
+    InterlockedIncrement64(&slow_stats.disconnects);
+    mark_dirty(conn);
+}
+
+/**
+ * Take the pending coalesce notice out of the queue unless it is already
+ * partly on the wire. Returns 1 if it was removed.
+ */
+static int remove_skip_notice(Connection *conn) {
+    if (conn->skip_notice == NULL) return 0;
+    
+    int kept = 0;
+    int removed = 0;
+    for (int i = 0; i < conn->out_count; i++) {
+        Frame *frame = conn->out_frames[(conn->out_head + i) % conn->out_cap];
+        if (frame == conn->skip_notice && !(i == 0 && conn->out_offset > 0)) {
+            conn->out_bytes -= frame->len[conn->proto];
+            frame_release(frame);
+            removed = 1;
+        } else {
+            conn->out_frames[(conn->out_head + kept) % conn->out_cap] = frame;
+            kept++;
         }
-        
-        username_set = 1;
-        strncpy(client_username, msg.content, MAX_USERNAME_LEN - 1);
-        client_username[MAX_USERNAME_LEN - 1] = '\0';
-        
-        // Send ACK with assigned user ID
-        ChatMessage ack_msg;
-        ack_msg.type = MSG_ACK;
-        get_timestamp(ack_msg.timestamp, sizeof(ack_msg.timestamp));
-        strncpy(ack_msg.username, "SERVER", MAX_USERNAME_LEN - 1);
-        snprintf(ack_msg.content, MAX_MESSAGE_LEN, "Joined successfully! Your user ID is: %d, nickname: %s", assigned_id, msg.content);
-        ack_msg.content_length = strlen(ack_msg.content);
-        send_to_client(client_socket, &ack_msg);
-        
-        // Broadcast system message
-        ChatMessage system_msg;
-        system_msg.type = MSG_SYSTEM;
-        get_timestamp(system_msg.timestamp, sizeof(system_msg.timestamp));
-        strncpy(system_msg.username, "SERVER", MAX_USERNAME_LEN - 1);
-        snprintf(system_msg.content, MAX_MESSAGE_LEN, "User [ID:%d]%s has joined the chat room", assigned_id, msg.content);
-        system_msg.content_length = strlen(system_msg.content);
-        broadcast_message(&system_msg, client_socket);
-        
-        printf("User [ID:%d]%s joined\n", assigned_id, msg.content);
-    } else {
-        printf("Failed to parse NICKNAME message or wrong message type\n");
-        printf("Buffer content: %s\n", buffer);
-        closesocket(client_socket);
-        return 1;
     }
     
-    // Main message loop
-    while (server_running && username_set) {
-        FD_ZERO(&readfds);
-        FD_SET(client_socket, &readfds);
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        if (select(0, &readfds, NULL, NULL, &timeout) > 0 && FD_ISSET(client_socket, &readfds)) {
-            bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-            
-            if (bytes_received <= 0) {
-                // Client disconnected
-                break;
-            }
-            
-            buffer[bytes_received] = '\0';
-            
-            // Append to recv buffer
-            if (recv_pos + bytes_received < sizeof(recv_buffer) - 1) {
-                memcpy(recv_buffer + recv_pos, buffer, bytes_received);
-                recv_pos += bytes_received;
-                recv_buffer[recv_pos] = '\0';
+    conn->out_count = kept;
+    conn->worker->metrics->queued_frames -= removed;
+    conn->skip_notice = NULL;
+    return removed;
+}
+
+/**
+ * Apply the configured policy to a connection whose queue is full.
+ * Returns 1 if there is room for a frame of incoming_len bytes afterwards.
+ */
+static int relieve_backpressure(Connection *conn, int incoming_len) {
+    int dropped;
+    
+    switch (slow_policy) {
+        case SLOW_DROP_OLDEST:
+            // Drop down to half the watermark so this does not run per message
+            dropped = drop_outbound(conn, max_queued_msgs / 2, max_queued_bytes / 2, 0);
+            if (dropped > 0) {
+                InterlockedIncrement64(&slow_stats.drop_events);
+                InterlockedExchangeAdd64(&slow_stats.dropped_frames, dropped);
             }
+            break;
             
-            // Process complete messages (lines)
-            char *line_start = recv_buffer;
-            char *line_end;
-            while ((line_end = strchr(line_start, '\n')) != NULL) {
-                *line_end = '\0';
+        case SLOW_COALESCE:
+            dropped = drop_outbound(conn, 0, 0, 0);
+            if (dropped > 0) {
+                // Fold an unsent notice from an earlier round into the new one
+                conn->skipped = remove_skip_notice(conn) ? conn->skipped + dropped : dropped;
                 
-                if (deserialize_message(line_start, &msg) == 0) {
-                    switch (msg.type) {
-                        case MSG_MESSAGE:
-                            // Broadcast message to all clients
-                            broadcast_message(&msg, client_socket);
-                            break;
-                            
-                        case MSG_LIST:
-                            // Send user list
-                            {
-                                ChatMessage list_msg;
-                                list_msg.type = MSG_MESSAGE;
-                                get_timestamp(list_msg.timestamp, sizeof(list_msg.timestamp));
-                                strncpy(list_msg.username, "SERVER", MAX_USERNAME_LEN - 1);
-                                char user_list[MAX_MESSAGE_LEN];
-                                get_user_list(user_list, sizeof(user_list));
-                                snprintf(list_msg.content, MAX_MESSAGE_LEN, "Online users: %s", user_list);
-                                list_msg.content_length = strlen(list_msg.content);
-                                send_to_client(client_socket, &list_msg);
-                            }
-                            break;
-                            
-                        case MSG_LEAVE:
-                            // Remove client and broadcast
-                            {
-                                // Find user ID before removing
-                                int user_id = 0;
-                                WaitForSingleObject(client_mutex, INFINITE);
-                                for (int i = 0; i < client_count; i++) {
-                                    if (clients[i].socket == client_socket && clients[i].active) {
-                                        user_id = clients[i].user_id;
-                                        break;
-                                    }
-                                }
-                                ReleaseMutex(client_mutex);
-                                
-                                ChatMessage system_msg;
-                                system_msg.type = MSG_SYSTEM;
-                                get_timestamp(system_msg.timestamp, sizeof(system_msg.timestamp));
-                                strncpy(system_msg.username, "SERVER", MAX_USERNAME_LEN - 1);
-                                snprintf(system_msg.content, MAX_MESSAGE_LEN, "User [ID:%d]%s has left the chat room", user_id, client_username);
-                                system_msg.content_length = strlen(system_msg.content);
-                                remove_client(client_socket);
-                                broadcast_message(&system_msg, client_socket);
-                                printf("User [ID:%d]%s left\n", user_id, client_username);
-                                closesocket(client_socket);
-                                return 0;
-                            }
-                            break;
-                            
-                        default:
-                            break;
-                    }
+                ChatMessage notice;
+                char text[MAX_MESSAGE_LEN];
+                snprintf(text, sizeof(text), "%d messages skipped because your connection is too slow", conn->skipped);
+                make_server_message(&notice, MSG_SYSTEM, text);
+                Frame *frame = frame_create(&notice);
+                if (frame != NULL && !push_outbound(conn, frame)) {
+                    frame_release(frame);
+                    frame = NULL;
                 }
-                
-                line_start = line_end + 1;
+                conn->skip_notice = frame;
+                InterlockedIncrement64(&slow_stats.coalesce_events);
+                InterlockedExchangeAdd64(&slow_stats.dropped_frames, dropped);
             }
+            break;
             
-            // Move remaining data to beginning of buffer
-            if (line_start > recv_buffer) {
-                int remaining = recv_pos - (line_start - recv_buffer);
-                memmove(recv_buffer, line_start, remaining);
-                recv_pos = remaining;
-            }
-        }
+        case SLOW_DISCONNECT:
+        default:
+            break;
     }
     
-    // Client disconnected unexpectedly
-    if (username_set) {
-        // Find user ID before removing
-        int user_id = 0;
-        WaitForSingleObject(client_mutex, INFINITE);
-        for (int i = 0; i < client_count; i++) {
-            if (clients[i].socket == client_socket && clients[i].active) {
-                user_id = clients[i].user_id;
-                break;
-            }
-        }
-        ReleaseMutex(client_mutex);
-        
-        ChatMessage system_msg;
-        system_msg.type = MSG_SYSTEM;
-        get_timestamp(system_msg.timestamp, sizeof(system_msg.timestamp));
-        strncpy(system_msg.username, "SERVER", MAX_USERNAME_LEN - 1);
-        snprintf(system_msg.content, MAX_MESSAGE_LEN, "User [ID:%d]%s has disconnected", user_id, client_username);
-        system_msg.content_length = strlen(system_msg.content);
-        remove_client(client_socket);
-        broadcast_message(&system_msg, client_socket);
-        printf("User [ID:%d]%s disconnected\n", user_id, client_username);
-    } else {
-        closesocket(client_socket);
+    // Nothing left to shed (or the policy is to disconnect)
+    if (conn->out_count + 1 > max_queued_msgs || conn->out_bytes + incoming_len > max_queued_bytes) {
+        LOG_WARN("Client [ID:%d]%s is too slow, disconnecting", conn->user_id, conn->user->username);
+        evict_slow_consumer(conn);
+        return 0;
     }
-    
-    return 0;
+    return 1;
 }
 
 /**
- * Main server function
+ * Append a frame to a connection's outbound queue without taking a
+ * reference; the caller accounts for it when this returns 1.
+ * Nothing is sent here; the event loop flushes dirty connections.
  */
-int main() {
-    printf("=== NKU Chat Room Server ===\n");
+static int queue_frame(Connection *conn, Frame *frame) {
+    if (conn->state == CONN_CLOSING || conn->evicting) return 0;
     
-    // Create mutex for thread synchronization
-    client_mutex = CreateMutex(NULL, FALSE, NULL);
-    if (client_mutex == NULL) {
-        printf("Failed to create mutex\n");
-        return 1;
-    }
+    // Built before this user joined, so it was not encoded for them
+    if (frame->len[conn->proto] == 0) return 0;
     
-    // Initialize server
-    if (init_server() != 0) {
-        CloseHandle(client_mutex);
-        return 1;
+    if (conn->out_count + 1 > max_queued_msgs || conn->out_bytes + frame->len[conn->proto] > max_queued_bytes) {
+        if (!relieve_backpressure(conn, frame->len[conn->proto])) return 0;
     }
     
-    // Initialize client list
-    memset(clients, 0, sizeof(clients));
+    if (!push_outbound(conn, frame)) {
+        evict_slow_consumer(conn);
+        return 0;
+    }
+    mark_dirty(conn);
+    return 1;
+}
+
+/**
+ * Release every frame still queued on a connection
+ */
+static void clear_outbound(Connection *conn) {
+    for (int i = 0; i < conn->out_count; i++) {
+        frame_release(conn->out_frames[(conn->out_head + i) % conn->out_cap]);
+    }
+    conn->worker->metrics->queued_frames -= conn->out_count;
+    give_ring(conn->worker, conn->out_frames, conn->out_cap);
+    conn->out_frames = NULL;
+    conn->out_head = 0;
+    conn->out_count = 0;
+    conn->out_cap = 0;
+    conn->out_offset = 0;
+    conn->out_bytes = 0;
+    conn->skip_notice = NULL;
+}
+
+/**
+ * Keep a frame that has been written to the socket, so it can be sent
+ * again if the session is resumed. The ring grows while the session is
+ * busy; once it holds resume_frames the oldest frame is dropped.
+ * Consumes the queue's reference.
+ */
+static void remember_sent(Connection *conn, Frame *frame) {
+    if (conn->sent_frames == NULL) {
+        frame_release(frame);
+        return;
+    }
     
-    // Main accept loop
-    while (server_running) {
-        struct sockaddr_in client_addr;
-        int addr_len = sizeof(client_addr);
-        SOCKET client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &addr_len);
-        
-        if (client_socket == INVALID_SOCKET) {
-            if (server_running) {
-                printf("Accept failed: %ld\n", WSAGetLastError());
+    if (conn->sent_count == conn->sent_cap && conn->sent_cap < resume_frames) {
+        int new_cap = conn->sent_cap * 2 < resume_frames ? conn->sent_cap * 2 : resume_frames;
+        Frame **new_ring = (Frame **)malloc(sizeof(Frame *) * new_cap);
+        if (new_ring != NULL) {
+            for (int i = 0; i < conn->sent_count; i++) {
+                new_ring[i] = conn->sent_frames[(conn->sent_head + i) % conn->sent_cap];
             }
-            continue;
+            free(conn->sent_frames);
+            conn->sent_frames = new_ring;
+            conn->sent_head = 0;
+            conn->sent_cap = new_cap;
         }
+    }
+    if (conn->sent_count == conn->sent_cap) {
+        frame_release(conn->sent_frames[conn->sent_head]);
+        conn->sent_head = (conn->sent_head + 1) % conn->sent_cap;
+        conn->sent_count--;
+    }
+    conn->sent_frames[(conn->sent_head + conn->sent_count) % conn->sent_cap] = frame;
+    conn->sent_count++;
+}
+
+/**
+ * Release every frame kept for resuming
+ */
+static void clear_sent(Connection *conn) {
+    for (int i = 0; i < conn->sent_count; i++) {
+        frame_release(conn->sent_frames[(conn->sent_head + i) % conn->sent_cap]);
+    }
+    free(conn->sent_frames);
+    conn->sent_frames = NULL;
+    conn->sent_head = 0;
+    conn->sent_count = 0;
+    conn->sent_cap = 0;
+}
+
+/**
+ * Queue a frame to every joined connection of one worker except sender
+ */
+static void fan_out_local(Worker *worker, Frame *frame, Connection *sender) {
+    TRACE_BEGIN(fan_out_start);
+    LONG queued = 0;
+    for (int i = FIRST_CONN_INDEX; i < worker->poll_count; i++) {
+        Connection *conn = worker->conns[i];
+        if (conn->state != CONN_ACTIVE || conn == sender) continue;
         
-        printf("New connection from %s:%d\n", 
-            inet_ntoa(client_addr.sin_addr), 
-            ntohs(client_addr.sin_port));
+        // Already replayed from the lobby history when this user joined
+        if (frame->history_seq != 0 && frame->history_seq <= conn->lobby_seq) continue;
         
-        // Create thread for client
-        HANDLE thread = CreateThread(NULL, 0, client_handler, (LPVOID)(UINT_PTR)client_socket, 0, NULL);
-        if (thread == NULL) {
-            printf("Failed to create thread\n");
-            closesocket(client_socket);
-        } else {
-            CloseHandle(thread); // We don't need to wait for the thread
-        }
+        queued += queue_frame(conn, frame);
     }
     
-    // Cleanup
+    // One atomic add covers every queue that now holds the frame
+    if (queued > 0) {
+        InterlockedExchangeAdd(&frame->refcount, queued);
+    }
+    TRACE_END(fan_out_start, TRACE_FAN_OUT, queued);
+}
+
+/**
+ * Broadcast a frame to all active clients except sender, consuming the
+ * caller's reference. The sender's worker delivers directly; other
+ * workers receive the frame through their inbox.
+ */
+static void broadcast_frame(Frame *frame, Connection *sender) {
+    Worker *origin = sender->worker;
+    for (int i = 0; i < worker_count; i++) {
+        Worker *worker = &workers[i];
+        if (worker == origin || worker->active_count == 0) continue;
+        
+        InboxNode *node = inbox_node_alloc();
+        if (node == NULL) continue;
+        InterlockedIncrement(&frame->refcount);
+        node->frame = frame;
+        node->room_id = 0;
+        node->user_id = 0;
+        inbox_push(&worker->inbox, node);
+        wake_worker(worker);
+    }
+    
+    fan_out_local(origin, frame, sender);
+    frame_release(frame);
+}
+
+/**
+ * Broadcast message to all active clients except sender
+ */
+void broadcast_message(const ChatMessage *msg, Connection *sender) {
+    Frame *frame = frame_create(msg);
+    if (frame == NULL) return;
+    broadcast_frame(frame, sender);
+}
+
+/**
+ * Find this worker's members of a room, or NULL
+ */
+static LocalRoom *local_room_find(Worker *worker, int room_id) {
+    LocalRoom *room = worker->local_rooms[room_id & (LOCAL_ROOM_BUCKETS - 1)];
+    while (room != NULL && room->room_id != room_id) {
+        room = room->next;
+    }
+    return room;
+}
+
+/**
+ * Add a connection to this worker's member list of a room.
+ * replayed_seq is the newest room history frame it was sent on joining.
+ */
+static int local_room_add(Worker *worker, int room_id, Connection *conn, LONG64 replayed_seq) {
+    LocalRoom *room = local_room_find(worker, room_id);
+    if (room == NULL) {
+        room = (LocalRoom *)calloc(1, sizeof(LocalRoom));
+        if (room == NULL) return -1;
+        room->room_id = room_id;
+        room->next = worker->local_rooms[room_id & (LOCAL_ROOM_BUCKETS - 1)];
+        worker->local_rooms[room_id & (LOCAL_ROOM_BUCKETS - 1)] = room;
+    }
+    
+    if (room->count == room->capacity) {
+        int capacity = room->capacity == 0 ? 8 : room->capacity * 2;
+        Connection **members = (Connection **)realloc(room->members, sizeof(Connection *) * capacity);
+        if (members == NULL) return -1;
+        room->members = members;
+        LONG64 *seqs = (LONG64 *)realloc(room->replayed_seqs, sizeof(LONG64) * capacity);
+        if (seqs == NULL) return -1;
+        room->replayed_seqs = seqs;
+        room->capacity = capacity;
+    }
+    
+    room->members[room->count] = conn;
+    room->replayed_seqs[room->count] = replayed_seq;
+    room->count++;
+    return 0;
+}
+
+/**
+ * Remove a connection from this worker's member list of a room,
+ * freeing the list when it becomes empty
+ */
+static void local_room_remove(Worker *worker, int room_id, Connection *conn) {
+    LocalRoom **link = &worker->local_rooms[room_id & (LOCAL_ROOM_BUCKETS - 1)];
+    while (*link != NULL && (*link)->room_id != room_id) {
+        link = &(*link)->next;
+    }
+    LocalRoom *room = *link;
+    if (room == NULL) return;
+    
+    for (int i = 0; i < room->count; i++) {
+        if (room->members[i] == conn) {
+            room->count--;
+            room->members[i] = room->members[room->count];
+            room->replayed_seqs[i] = room->replayed_seqs[room->count];
+            break;
+        }
+    }
+    
+    if (room->count == 0) {
+        *link = room->next;
+        free(room->members);
+        free(room->replayed_seqs);
+        free(room);
+    }
+}
+
+/**
+ * Queue a frame for this worker's members of a room except sender
+ */
+static void fan_out_room(Worker *worker, int room_id, Frame *frame, Connection *sender) {
+    LocalRoom *room = local_room_find(worker, room_id);
+    if (room == NULL) return;
+    
+    TRACE_BEGIN(fan_out_start);
+    LONG queued = 0;
+    for (int i = 0; i < room->count; i++) {
+        Connection *conn = room->members[i];
+        if (conn->state != CONN_ACTIVE || conn == sender) continue;
+        if (frame->history_seq != 0 && frame->history_seq <= room->replayed_seqs[i]) continue;
+        
+        queued += queue_frame(conn, frame);
+    }
+    
+    if (queued > 0) {
+        InterlockedExchangeAdd(&frame->refcount, queued);
+    }
+    TRACE_END(fan_out_start, TRACE_FAN_OUT, queued);
+}
+
+/**
+ * Send a frame to the members of a room except sender, consuming the
+ * caller's reference. Only workers that own members are posted to.
+ */
+static void broadcast_room_frame(Room *room, Frame *frame, Connection *sender) {
+    Worker *origin = sender->worker;
+    for (int i = 0; i < worker_count; i++) {
+        Worker *worker = &workers[i];
+        if (worker == origin || room->worker_members[i] == 0) continue;
+        
+        InboxNode *node = inbox_node_alloc();
+        if (node == NULL) continue;
+        InterlockedIncrement(&frame->refcount);
+        node->frame = frame;
+        node->room_id = room->id;
+        node->user_id = 0;
+        inbox_push(&worker->inbox, node);
+        wake_worker(worker);
+    }
+    
+    fan_out_room(origin, room->id, frame, sender);
+    frame_release(frame);
+}
+
+/**
+ * Connection of a joined user owned by this worker, or NULL if the user
+ * has left. Connections are only freed by their own worker, so the result
+ * stays valid for the rest of this loop iteration.
+ */
+static Connection *find_local_user(Worker *worker, int user_id) {
+    lock_clients();
+    ClientInfo *client = registry_find_id(&registry, user_id);
+    Connection *conn = client != NULL ? (Connection *)client->owner : NULL;
+    ReleaseMutex(client_mutex);
+    
+    return (conn != NULL && conn->worker == worker) ? conn : NULL;
+}
+
+/**
+ * Queue a frame for exactly one user, wherever it is connected,
+ * consuming the caller's reference
+ */
+static void send_direct_frame(Connection *target, int target_id, Worker *target_worker, Frame *frame, Worker *origin) {
+    if (target_worker == origin) {
+        if (!queue_frame(target, frame)) {
+            frame_release(frame);
+        }
+        return;
+    }
+    
+    InboxNode *node = inbox_node_alloc();
+    if (node == NULL) {
+        frame_release(frame);
+        return;
+    }
+    node->frame = frame;
+    node->room_id = 0;
+    node->user_id = target_id;
+    inbox_push(&target_worker->inbox, node);
+    wake_worker(target_worker);
+}
+
+static void resume_session(Worker *worker, int user_id, SOCKET socket, unsigned int last_seq);
+
+/**
+ * Deliver broadcasts posted by other workers
+ */
+static void drain_inbox(Worker *worker) {
+    TRACE_BEGIN(inbox_start);
+    int drained = 0;
+    InboxNode *node;
+    while ((node = inbox_pop(&worker->inbox)) != NULL) {
+        drained++;
+        if (node->frame == NULL) {
+            resume_session(worker, node->user_id, node->socket, node->last_seq);
+            inbox_node_free(node);
+            continue;
+        }
+        if (node->user_id != 0) {
+            Connection *target = find_local_user(worker, node->user_id);
+            if (target != NULL && queue_frame(target, node->frame)) {
+                InterlockedIncrement(&node->frame->refcount);
+            }
+        } else if (node->room_id != 0) {
+            fan_out_room(worker, node->room_id, node->frame, NULL);
+        } else {
+            fan_out_local(worker, node->frame, NULL);
+        }
+        frame_release(node->frame);
+        inbox_node_free(node);
+    }
+    if (drained > 0) {
+        TRACE_END(inbox_start, TRACE_INBOX, drained);
+    }
+}
+
+/**
+ * Send message to specific client
+ */
+void send_to_client(Connection *conn, const ChatMessage *msg) {
+    Frame *frame = frame_create(msg);
+    if (frame == NULL) return;
+    
+    // The queue takes over our reference
+    if (!queue_frame(conn, frame)) {
+        frame_release(frame);
+    }
+}
+
+static int compare_user_entries(const void *a, const void *b) {
+    return ((const UserEntry *)a)->user_id - ((const UserEntry *)b)->user_id;
+}
+
+/**
+ * Free retired snapshots that no worker can still be reading.
+ * Called with client_mutex held.
+ */
+static void reclaim_snapshots() {
+    LONG64 safe_epoch = ReadAcquire64(&reclaim_epoch);
+    for (int i = 0; i < worker_count; i++) {
+        LONG64 seen = ReadAcquire64(&workers[i].quiescent_epoch);
+        if (seen < safe_epoch) safe_epoch = seen;
+    }
+    
+    UserSnapshot **link = &retired_snapshots;
+    while (*link != NULL) {
+        UserSnapshot *snapshot = *link;
+        if (snapshot->retire_epoch <= safe_epoch) {
+            *link = snapshot->next_retired;
+            free(snapshot);
+        } else {
+            link = &snapshot->next_retired;
+        }
+    }
+}
+
+/**
+ * Build a snapshot of the registry and publish it. Membership changes
+ * only bump a version; the copy is made when someone next reads it, so
+ * a join storm costs one rebuild rather than one per join.
+ */
+static UserSnapshot *publish_user_snapshot() {
+    lock_clients();
+    
+    // Another reader may have rebuilt it while we waited
+    UserSnapshot *current = user_snapshot;
+    if (current != NULL && current->version == membership_version) {
+        ReleaseMutex(client_mutex);
+        return current;
+    }
+    
+    int count = registry.active_count;
+    UserSnapshot *snapshot = (UserSnapshot *)malloc(sizeof(UserSnapshot) + sizeof(UserEntry) * (count > 0 ? count - 1 : 0));
+    if (snapshot == NULL) {
+        ReleaseMutex(client_mutex);
+        return current;
+    }
+    
+    snapshot->version = membership_version;
+    snapshot->retire_epoch = 0;
+    snapshot->next_retired = NULL;
+    snapshot->count = 0;
+    for (int i = 0; i < registry.slot_count; i++) {
+        const ClientInfo *client = &registry.slots[i];
+        if (client->active) {
+            UserEntry *entry = &snapshot->users[snapshot->count++];
+            entry->user_id = client->user_id;
+            memcpy(entry->username, client->username, MAX_USERNAME_LEN);
+        }
+    }
+    qsort(snapshot->users, snapshot->count, sizeof(UserEntry), compare_user_entries);
+    
+    InterlockedExchangePointer((PVOID volatile *)&user_snapshot, snapshot);
+    if (current != NULL) {
+        current->retire_epoch = InterlockedIncrement64(&reclaim_epoch);
+        current->next_retired = retired_snapshots;
+        retired_snapshots = current;
+    }
+    reclaim_snapshots();
+    
+    ReleaseMutex(client_mutex);
+    return snapshot;
+}
+
+/**
+ * Current snapshot of online users. Valid until the calling worker
+ * returns to the top of its event loop; never NULL after startup.
+ */
+static const UserSnapshot *acquire_user_snapshot() {
+    UserSnapshot *snapshot = (UserSnapshot *)ReadPointerAcquire((PVOID volatile *)&user_snapshot);
+    if (snapshot == NULL || snapshot->version != membership_version) {
+        snapshot = publish_user_snapshot();
+    }
+    return snapshot;
+}
+
+/**
+ * Find a user in a snapshot by ID, or NULL
+ */
+static const UserEntry *snapshot_find_id(const UserSnapshot *snapshot, int user_id) {
+    UserEntry key;
+    key.user_id = user_id;
+    return (const UserEntry *)bsearch(&key, snapshot->users, snapshot->count, sizeof(UserEntry), compare_user_entries);
+}
+
+/**
+ * Free every snapshot at shutdown, after all workers have stopped
+ */
+static void free_user_snapshots() {
+    while (retired_snapshots != NULL) {
+        UserSnapshot *snapshot = retired_snapshots;
+        retired_snapshots = snapshot->next_retired;
+        free(snapshot);
+    }
+    free(user_snapshot);
+    user_snapshot = NULL;
+}
+
+/**
+ * Get list of online users as string (with ID and nickname)
+ */
+void get_user_list(char *buffer, size_t buffer_size) {
+    const UserSnapshot *snapshot = acquire_user_snapshot();
+    
+    buffer[0] = '\0';
+    if (snapshot == NULL) return;
+    
+    size_t used = 0;
+    for (int i = 0; i < snapshot->count && used + 1 < buffer_size; i++) {
+        int written = snprintf(buffer + used, buffer_size - used, "%s[ID:%d]%s",
+            i > 0 ? ", " : "", snapshot->users[i].user_id, snapshot->users[i].username);
+        if (written < 0) break;
+        used += (size_t)written;
+    }
+    if (used >= buffer_size) {
+        buffer[buffer_size - 1] = '\0';
+    }
+}
+
+/**
+ * Validate username
+ */
+int validate_username(const char *username) {
+    if (username == NULL) return 0;
+    
+    size_t len = strlen(username);
+    if (len == 0 || len >= MAX_USERNAME_LEN) return 0;
+    
+    // Check for pipe character (not allowed)
+    if (strchr(username, '|') != NULL) return 0;
+    
+    return 1;
+}
+
+/**
+ * Drop one room membership on the owning worker and in the directory
+ */
+static void leave_room(Connection *conn, int index) {
+    Room *room = conn->user->rooms[index];
+    conn->user->rooms[index] = conn->user->rooms[--conn->user->room_count];
+    local_room_remove(conn->worker, room->id, conn);
+    room_leave(room, conn->user_id, conn->worker->index);
+}
+
+/**
+ * Close a connection. Joined users are removed and the room is notified;
+ * the socket is released by sweep_connections().
+ */
+static void close_connection(Connection *conn, const char *reason) {
+    if (conn->state == CONN_CLOSING) return;
+    
+    if (conn->state == CONN_ACTIVE) {
+        ChatMessage system_msg;
+        char text[MAX_MESSAGE_LEN];
+        snprintf(text, sizeof(text), "User [ID:%d]%s %s", conn->user_id, conn->user->username, reason);
+        make_server_message(&system_msg, MSG_SYSTEM, text);
+        while (conn->user->room_count > 0) {
+            leave_room(conn, conn->user->room_count - 1);
+        }
+        remove_client(conn->socket);
+        conn->worker->metrics->leaves++;
+        InterlockedDecrement(&conn->worker->active_count);
+        InterlockedDecrement(&proto_users[conn->proto]);
+        conn->state = CONN_CLOSING;
+        broadcast_message(&system_msg, conn);
+        LOG_INFO("User [ID:%d]%s %s", conn->user_id, conn->user->username, reason);
+    }
+    
+    conn->state = CONN_CLOSING;
+}
+
+/**
+ * The socket of a connection failed or the peer closed it. A resumable
+ * session is kept for resume_grace_ms, still queueing what it is sent,
+ * so the client can pick it up with MSG_RESUME; anything else is closed.
+ */
+static void connection_lost(Connection *conn) {
+    if (conn->state != CONN_ACTIVE || conn->sent_frames == NULL || conn->evicting) {
+        close_connection(conn, "has disconnected");
+        return;
+    }
+    if (conn->detached_until != 0) return;
+    
+    // The socket stays open until the session ends, so its handle, which
+    // keys the registry, is not reused by another connection meanwhile
+    WSAPOLLFD *pfd = &conn->worker->poll_fds[conn->poll_index];
+    pfd->fd = INVALID_SOCKET;
+    pfd->events = 0;
+    conn->detached_until = GetTickCount64() + resume_grace_ms;
+    timer_schedule(&conn->worker->timers, &conn->timer, conn->detached_until);
+    conn->out_offset = 0;  // The client drops a partly received frame
+    ring_release(&conn->recv);
+    LOG_INFO("User [ID:%d]%s lost connection, session kept for %d ms", conn->user_id, conn->user->username, resume_grace_ms);
+}
+
+/**
+ * Wait for the next heartbeat check of a joined, attached connection
+ */
+static void arm_heartbeat(Connection *conn) {
+    conn->ping_sent_at = 0;
+    if (heartbeat_ms > 0) {
+        timer_schedule(&conn->worker->timers, &conn->timer, conn->last_recv + heartbeat_ms);
+    } else {
+        timer_cancel(&conn->worker->timers, &conn->timer);
+    }
+}
+
+/**
+ * Reject a handshake with an error message and close the connection
+ */
+static void reject_client(Connection *conn, const char *reason) {
+    ChatMessage error_msg;
+    make_server_message(&error_msg, MSG_ERROR, reason);
+    send_to_client(conn, &error_msg);
+    close_connection(conn, NULL);
+}
+
+/**
+ * Wire formats a relayed frame must carry. A frame kept in a history may
+ * be replayed to a user of either format later, so it carries both;
+ * otherwise only the formats someone is connected with are encoded
+ * (plus v2, which the message log and the search index store).
+ */
+static int relay_formats(MessageHistory *history) {
+    if (history != NULL) return ALL_FORMATS;
+    
+    int formats = (log_enabled() || search_enabled()) ? FORMAT_BIT(PROTO_BINARY) : 0;
+    for (int proto = 0; proto < PROTO_COUNT; proto++) {
+        if (proto_users[proto] > 0) formats |= FORMAT_BIT(proto);
+    }
+    return formats;
+}
+
+/**
+ * Queue the recorded frames of a history for one connection, behind
+ * whatever it already has queued, so they go out in the same gathered
+ * send. Returns the history_seq of the newest recorded frame; broadcasts
+ * up to it must not be delivered again.
+ */
+static LONG64 replay_history(Connection *conn, MessageHistory *history) {
+    Frame *frames[MAX_HISTORY_LEN];
+    LONG64 last_seq;
+    
+    // Keep the replay well inside the slow-consumer limits
+    int max_frames = max_queued_msgs / 2 < MAX_HISTORY_LEN ? max_queued_msgs / 2 : MAX_HISTORY_LEN;
+    int count = history_copy(history, frames, max_frames, &last_seq);
+    
+    for (int i = 0; i < count; i++) {
+        if (!queue_frame(conn, frames[i])) {
+            frame_release(frames[i]);
+        }
+    }
+    return last_seq;
+}
+
+/**
+ * Fill in a random session secret of SESSION_SECRET_LEN hex digits
+ */
+static int make_session_secret(char *secret) {
+    unsigned char random[SESSION_SECRET_LEN / 2];
+    if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, random, sizeof(random), BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+        return -1;
+    }
+    for (int i = 0; i < (int)sizeof(random); i++) {
+        snprintf(secret + i * 2, 3, "%02x", random[i]);
+    }
+    return 0;
+}
+
+/**
+ * Compare two secrets in time independent of where they differ
+ */
+static int session_secret_matches(const char *secret, const char *candidate) {
+    unsigned char diff = 0;
+    for (int i = 0; i <= SESSION_SECRET_LEN; i++) {
+        diff |= (unsigned char)(secret[i] ^ candidate[i]);
+    }
+    return diff == 0 && secret[0] != '\0';
+}
+
+/**
+ * Handle the first message of a connection, which must be NICKNAME.
+ * A client that can speak v2 says so in the username field; the reply
+ * and everything after it then use binary frames.
+ */
+static void handle_nickname(Connection *conn, const ChatMessageView *view) {
+    if (view == NULL || view->type != MSG_NICKNAME) {
+        LOG_WARN("Failed to parse NICKNAME message or wrong message type");
+        close_connection(conn, NULL);
+        return;
+    }
+    
+    int capability_len = (int)strlen(CHAT_V2_CAPABILITY);
+    if (view->username_len == capability_len && memcmp(view->username, CHAT_V2_CAPABILITY, capability_len) == 0) {
+        conn->proto = PROTO_BINARY;
+    }
+    
+    // The nickname is the only field the server keeps, so copy just that
+    char nickname[MAX_USERNAME_LEN];
+    if (view->content_length >= MAX_USERNAME_LEN || memchr(view->content, '\0', view->content_length) != NULL) {
+        reject_client(conn, "Invalid nickname format");
+        return;
+    }
+    memcpy(nickname, view->content, view->content_length);
+    nickname[view->content_length] = '\0';
+    
+    if (!validate_username(nickname)) {
+        reject_client(conn, "Invalid nickname format");
+        return;
+    }
+    
+    conn->user = (JoinedUser *)object_pool_alloc(&conn->worker->user_pool);
+    if (conn->user == NULL) {
+        reject_client(conn, "Server is out of memory");
+        return;
+    }
+    
+    // Only v2 frames carry the sequence numbers a resume starts from.
+    // The secret is set before the registry makes this connection visible.
+    if (conn->proto == PROTO_BINARY && resume_grace_ms > 0) {
+        conn->sent_frames = (Frame **)malloc(sizeof(Frame *) * SENT_INITIAL_FRAMES);
+        conn->sent_cap = resume_frames < SENT_INITIAL_FRAMES ? resume_frames : SENT_INITIAL_FRAMES;
+        if (conn->sent_frames == NULL || make_session_secret(conn->user->session_secret) != 0) {
+            clear_sent(conn);
+            conn->user->session_secret[0] = '\0';
+        }
+    }
+    
+    // Try to add client with nickname, get assigned user ID
+    int assigned_id = 0;
+    int result = add_client(conn->socket, nickname, conn, &assigned_id);
+    if (result == -2) {
+        reject_client(conn, "Nickname already exists, please choose another one");
+        return;
+    } else if (result != 0) {
+        reject_client(conn, "Server is full");
+        return;
+    }
+    
+    conn->state = CONN_ACTIVE;
+    conn->user_id = assigned_id;
+    strncpy(conn->user->username, nickname, MAX_USERNAME_LEN - 1);
+    conn->user->username[MAX_USERNAME_LEN - 1] = '\0';
+    conn->joined_at = metrics_now();
+    arm_heartbeat(conn);
+    conn->worker->metrics->joins++;
+    InterlockedIncrement(&conn->worker->active_count);
+    InterlockedIncrement(&proto_users[conn->proto]);
+    
+    // Send ACK with assigned user ID
+    ChatMessage reply;
+    char text[MAX_MESSAGE_LEN];
+    int used = snprintf(text, sizeof(text), "Joined successfully! Your user ID is: %d, nickname: %s", assigned_id, conn->user->username);
+    if (conn->user->session_secret[0] != '\0') {
+        snprintf(text + used, sizeof(text) - used, CHAT_SESSION_MARKER "%d.%s", assigned_id, conn->user->session_secret);
+    }
+    make_server_message(&reply, MSG_ACK, text);
+    send_to_client(conn, &reply);
+    
+    // Catch up on recent messages; queued right behind the ACK
+    conn->lobby_seq = replay_history(conn, lobby_history);
+    
+    // Broadcast system message
+    snprintf(text, sizeof(text), "User [ID:%d]%s has joined the chat room", assigned_id, conn->user->username);
+    make_server_message(&reply, MSG_SYSTEM, text);
+    broadcast_message(&reply, conn);
+    
+    LOG_INFO("User [ID:%d]%s joined (protocol v%d)", assigned_id, conn->user->username, conn->proto + 1);
+}
+
+/**
+ * Handle MSG_RESUME "<user ID>.<secret> <last seq>" as the first message of
+ * a connection. The socket is handed to the worker that owns the session;
+ * this connection is dropped without closing it.
+ */
+static void handle_resume(Connection *conn, const ChatMessageView *view) {
+    char request[MAX_SESSION_TOKEN_LEN + 16];
+    char secret[SESSION_SECRET_LEN + 1];
+    int user_id = 0;
+    unsigned int last_seq = 0;
+    char extra;
+    
+    // Only v2 sessions can be resumed, so the reply is a v2 frame too
+    conn->proto = PROTO_BINARY;
+    memset(secret, 0, sizeof(secret));
+    if (view->content_length >= (int)sizeof(request)) {
+        reject_client(conn, "Invalid session token");
+        return;
+    }
+    memcpy(request, view->content, view->content_length);
+    request[view->content_length] = '\0';
+    if (sscanf(request, "%d.%32[0-9a-f] %u %c", &user_id, secret, &last_seq, &extra) != 3) {
+        reject_client(conn, "Invalid session token");
+        return;
+    }
+    
+    lock_clients();
+    ClientInfo *client = registry_find_id(&registry, user_id);
+    Connection *session = client != NULL ? (Connection *)client->owner : NULL;
+    Worker *owner = (session != NULL && session_secret_matches(session->user->session_secret, secret)) ? session->worker : NULL;
+    ReleaseMutex(client_mutex);
+    
+    if (owner == NULL) {
+        reject_client(conn, "Session expired, please join again");
+        return;
+    }
+    
+    InboxNode *node = inbox_node_alloc();
+    if (node == NULL) {
+        reject_client(conn, "Server is out of memory");
+        return;
+    }
+    node->frame = NULL;
+    node->room_id = 0;
+    node->user_id = user_id;
+    node->socket = conn->socket;
+    node->last_seq = last_seq;
+    
+    conn->socket = INVALID_SOCKET;
+    close_connection(conn, NULL);
+    inbox_push(&owner->inbox, node);
+    wake_worker(owner);
+}
+
+/**
+ * Attach a resuming client's socket to its session on this worker. The
+ * client gets an ACK, the frames written after the last one it received
+ * (all kept frames if that one is gone), then what was queued meanwhile.
+ */
+static void resume_session(Worker *worker, int user_id, SOCKET socket, unsigned int last_seq) {
+    Connection *session = find_local_user(worker, user_id);
+    if (session == NULL || session->evicting) {
+        // Expired after the token was checked; the client's next attempt
+        // is rejected with an error
+        closesocket(socket);
+        return;
+    }
+    
+    // Also taken over while attached: the old socket may be half-open
+    lock_clients();
+    registry_move_socket(&registry, session->socket, socket);
+    ReleaseMutex(client_mutex);
+    closesocket(session->socket);
+    session->socket = socket;
+    session->detached_until = 0;
+    session->last_recv = GetTickCount64();
+    arm_heartbeat(session);
+    session->out_offset = 0;
+    ring_release(&session->recv);
+    WSAPOLLFD *pfd = &worker->poll_fds[session->poll_index];
+    pfd->fd = socket;
+    pfd->events = POLLRDNORM;
+    pfd->revents = 0;
+    
+    int first = -1;
+    for (int i = session->sent_count - 1; i >= 0; i--) {
+        if (session->sent_frames[(session->sent_head + i) % session->sent_cap]->seq == last_seq) {
+            first = i + 1;
+            break;
+        }
+    }
+    int missed = first < 0 && session->sent_count > 0;
+    if (first < 0) first = 0;
+    
+    // Pushed to the front newest first, so they end up in order; the
+    // frames move from the sent ring back to the queue
+    int replayed = 0;
+    while (session->sent_count > first) {
+        session->sent_count--;
+        Frame *frame = session->sent_frames[(session->sent_head + session->sent_count) % session->sent_cap];
+        if (push_outbound_front(session, frame)) {
+            replayed++;
+        } else {
+            frame_release(frame);
+        }
+    }
+    // Whatever else is queued arrived while the session was detached
+    int queued = session->out_count - replayed;
+    
+    ChatMessage reply;
+    char text[MAX_MESSAGE_LEN];
+    if (missed) {
+        make_server_message(&reply, MSG_SYSTEM, "Some messages were lost while you were disconnected");
+        Frame *frame = frame_create(&reply);
+        if (frame != NULL && !push_outbound_front(session, frame)) {
+            frame_release(frame);
+        }
+    }
+    snprintf(text, sizeof(text), "Session resumed! Your user ID is: %d, nickname: %s, %d message(s) resent, %d new",
+        session->user_id, session->user->username, replayed, queued);
+    make_server_message(&reply, MSG_ACK, text);
+    Frame *frame = frame_create(&reply);
+    if (frame != NULL && !push_outbound_front(session, frame)) {
+        frame_release(frame);
+    }
+    mark_dirty(session);
+    
+    LOG_INFO("User [ID:%d]%s resumed after seq %u (%d frame(s) resent, %d queued while detached)",
+        session->user_id, session->user->username, last_seq, replayed, queued);
+}
+
+/**
+ * Send a MSG_ERROR reply to one client
+ */
+static void send_error(Connection *conn, const char *text) {
+    ChatMessage error_msg;
+    make_server_message(&error_msg, MSG_ERROR, text);
+    send_to_client(conn, &error_msg);
+}
+
+/**
+ * Tell the other members of a room about a change
+ */
+static void notify_room(Room *room, Connection *conn, const char *text) {
+    ChatMessage notice;
+    make_server_message(&notice, MSG_SYSTEM, text);
+    Frame *frame = frame_create(&notice);
+    if (frame != NULL) {
+        broadcast_room_frame(room, frame, conn);
+    }
+}
+
+/**
+ * Copy a room name out of a message field.
+ * Returns 1 if it is a valid room name.
+ */
+static int copy_room_name(const char *field, int field_len, char *name) {
+    if (field_len <= 0 || field_len >= MAX_ROOM_NAME_LEN) return 0;
+    memcpy(name, field, field_len);
+    name[field_len] = '\0';
+    return (int)strlen(name) == field_len && validate_room_name(name);
+}
+
+/**
+ * Index of a joined room in conn->user->rooms, or -1
+ */
+static int find_joined_room(const Connection *conn, const char *name) {
+    for (int i = 0; i < conn->user->room_count; i++) {
+        if (strcmp(conn->user->rooms[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void handle_join_room(Connection *conn, const ChatMessageView *view) {
+    char name[MAX_ROOM_NAME_LEN];
+    char text[MAX_MESSAGE_LEN];
+    
+    if (!copy_room_name(view->content, view->content_length, name)) {
+        send_error(conn, "Invalid room name");
+        return;
+    }
+    if (find_joined_room(conn, name) >= 0) {
+        snprintf(text, sizeof(text), "You are already in room %s", name);
+        send_error(conn, text);
+        return;
+    }
+    if (conn->user->room_count == MAX_ROOMS_PER_USER) {
+        snprintf(text, sizeof(text), "You cannot join more than %d rooms", MAX_ROOMS_PER_USER);
+        send_error(conn, text);
+        return;
+    }
+    if (conn->user->room_count == conn->user->room_capacity) {
+        int capacity = conn->user->room_capacity ? conn->user->room_capacity * 2 : ROOMS_INITIAL;
+        if (capacity > MAX_ROOMS_PER_USER) capacity = MAX_ROOMS_PER_USER;
+        Room **rooms = (Room **)realloc(conn->user->rooms, sizeof(Room *) * capacity);
+        if (rooms == NULL) {
+            send_error(conn, "Server is out of memory");
+            return;
+        }
+        conn->user->rooms = rooms;
+        conn->user->room_capacity = capacity;
+    }
+    
+    Room *room = room_join(name, conn->user_id, conn->worker->index);
+    if (room == NULL) {
+        send_error(conn, "Server is out of memory");
+        return;
+    }
+    
+    ChatMessage reply;
+    snprintf(text, sizeof(text), "You joined room %s", name);
+    make_server_message(&reply, MSG_SYSTEM, text);
+    send_to_client(conn, &reply);
+    
+    // Joined in the directory first, so anything recorded after the
+    // copy is also fanned out to this worker
+    LONG64 replayed_seq = replay_history(conn, room->history);
+    if (local_room_add(conn->worker, room->id, conn, replayed_seq) != 0) {
+        room_leave(room, conn->user_id, conn->worker->index);
+        send_error(conn, "Server is out of memory");
+        return;
+    }
+    conn->user->rooms[conn->user->room_count++] = room;
+    
+    snprintf(text, sizeof(text), "User [ID:%d]%s has joined room %s", conn->user_id, conn->user->username, name);
+    notify_room(room, conn, text);
+}
+
+static void handle_leave_room(Connection *conn, const ChatMessageView *view) {
+    char name[MAX_ROOM_NAME_LEN];
+    char text[MAX_MESSAGE_LEN];
+    
+    int index = copy_room_name(view->content, view->content_length, name) ? find_joined_room(conn, name) : -1;
+    if (index < 0) {
+        send_error(conn, "You are not in that room");
+        return;
+    }
+    
+    // Notify before leaving: the last member's leave frees the room
+    snprintf(text, sizeof(text), "User [ID:%d]%s has left room %s", conn->user_id, conn->user->username, name);
+    notify_room(conn->user->rooms[index], conn, text);
+    leave_room(conn, index);
+    
+    ChatMessage reply;
+    snprintf(text, sizeof(text), "You left room %s", name);
+    make_server_message(&reply, MSG_SYSTEM, text);
+    send_to_client(conn, &reply);
+}
+
+/**
+ * Relay "room text" to the other members of a room the sender is in
+ */
+static void handle_room_message(Connection *conn, ChatMessageView *view) {
+    char name[MAX_ROOM_NAME_LEN];
+    
+    const char *space = (const char *)memchr(view->content, ' ', view->content_length);
+    int name_len = space != NULL ? (int)(space - view->content) : view->content_length;
+    int index = copy_room_name(view->content, name_len, name) ? find_joined_room(conn, name) : -1;
+    if (index < 0) {
+        send_error(conn, "You are not in that room");
+        return;
+    }
+    
+    Room *room = conn->user->rooms[index];
+    Frame *frame = frame_create_relay(view, relay_formats(room->history));
+    if (frame != NULL) {
+        history_append(room->history, frame);
+        log_append(frame);
+        broadcast_room_frame(room, frame, conn);
+    }
+}
+
+/**
+ * Relay "<id|nickname> text" to exactly one user. The recipient is
+ * resolved through the registry's ID or nickname index.
+ */
+static void handle_direct_message(Connection *conn, ChatMessageView *view) {
+    char target_name[MAX_USERNAME_LEN];
+    char text[MAX_MESSAGE_LEN];
+    
+    const char *space = (const char *)memchr(view->content, ' ', view->content_length);
+    int name_len = space != NULL ? (int)(space - view->content) : 0;
+    if (name_len <= 0 || name_len >= MAX_USERNAME_LEN) {
+        send_error(conn, "Usage: /msg <id|nickname> text");
+        return;
+    }
+    memcpy(target_name, view->content, name_len);
+    target_name[name_len] = '\0';
+    
+    // A number is tried as a user ID first, then as a nickname
+    char *end;
+    long target_id = strtol(target_name, &end, 10);
+    
+    lock_clients();
+    ClientInfo *client = (*end == '\0' && target_id > 0) ? registry_find_id(&registry, (int)target_id) : NULL;
+    if (client == NULL) {
+        client = registry_find_name(&registry, target_name);
+    }
+    Connection *target = client != NULL ? (Connection *)client->owner : NULL;
+    
+    // Registered connections are not freed while client_mutex is held
+    int recipient_id = target != NULL ? target->user_id : 0;
+    Worker *target_worker = target != NULL ? target->worker : NULL;
+    int recipient_formats = target != NULL ? FORMAT_BIT(target->proto) : 0;
+    ReleaseMutex(client_mutex);
+    
+    if (target == NULL) {
+        snprintf(text, sizeof(text), "User %s is not online", target_name);
+        send_error(conn, text);
+        return;
+    }
+    if (target == conn) {
+        send_error(conn, "You cannot send a direct message to yourself");
+        return;
+    }
+    
+    Frame *frame = frame_create_relay(view, recipient_formats);
+    if (frame != NULL) {
+        send_direct_frame(target, recipient_id, target_worker, frame, conn->worker);
+    }
+}
+
+/**
+ * Reply to /list for one room
+ */
+static void send_room_list(Connection *conn, const ChatMessageView *view) {
+    char name[MAX_ROOM_NAME_LEN];
+    char text[MAX_MESSAGE_LEN];
+    int member_ids[MAX_MESSAGE_LEN / 8];  // More than fit in one reply
+    
+    int count = copy_room_name(view->content, view->content_length, name) ?
+        room_copy_members(name, member_ids, (int)(sizeof(member_ids) / sizeof(member_ids[0]))) : -1;
+    if (count < 0) {
+        send_error(conn, "No such room");
+        return;
+    }
+    if (count > (int)(sizeof(member_ids) / sizeof(member_ids[0]))) {
+        count = (int)(sizeof(member_ids) / sizeof(member_ids[0]));
+    }
+    
+    const UserSnapshot *snapshot = acquire_user_snapshot();
+    int used = snprintf(text, sizeof(text), "Users in room %s: ", name);
+    for (int i = 0; i < count && used < (int)sizeof(text); i++) {
+        const UserEntry *user = snapshot != NULL ? snapshot_find_id(snapshot, member_ids[i]) : NULL;
+        used += snprintf(text + used, sizeof(text) - used, "%s[ID:%d]%s",
+            i > 0 ? ", " : "", member_ids[i], user != NULL ? user->username : "?");
+    }
+    
+    ChatMessage list_msg;
+    make_server_message(&list_msg, MSG_MESSAGE, text);
+    send_to_client(conn, &list_msg);
+}
+
+static void send_search_hit(const char *frame, int frame_len, void *context) {
+    ChatMessage hit;
+    if (deserialize_message_v2(frame, frame_len, &hit) != 0) return;
+    hit.type = MSG_SEARCH;  // Keeps the original timestamp and username
+    send_to_client((Connection *)context, &hit);
+}
+
+/**
+ * Reply to /search with the newest lobby messages containing every term
+ */
+static void handle_search(Connection *conn, const ChatMessageView *view) {
+    char text[MAX_MESSAGE_LEN];
+    
+    if (!search_enabled()) {
+        send_error(conn, "Search is disabled on this server");
+        return;
+    }
+    
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    int found = search_query(view->content, view->content_length, MAX_SEARCH_RESULTS, send_search_hit, conn);
+    QueryPerformanceCounter(&end);
+    
+    if (found < 0) {
+        send_error(conn, "Usage: /search <words>");
+        return;
+    }
+    
+    ChatMessage reply;
+    snprintf(text, sizeof(text), "Search \"%.*s\": %d result(s), newest first (%.2f ms)",
+        view->content_length < 200 ? view->content_length : 200, view->content, found,
+        (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart);
+    make_server_message(&reply, MSG_SYSTEM, text);
+    send_to_client(conn, &reply);
+}
+
+/**
+ * Reply to /stats with the metrics report, one MSG_SYSTEM per line
+ */
+static void handle_stats(Connection *conn) {
+    char report[METRICS_REPORT_SIZE];
+    if (metrics_format_text(report, sizeof(report)) < 0) {
+        send_error(conn, "Statistics are unavailable");
+        return;
+    }
+    
+    char *line = report;
+    char *end;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        ChatMessage reply;
+        make_server_message(&reply, MSG_SYSTEM, line);
+        send_to_client(conn, &reply);
+        line = end + 1;
+    }
+}
+
+/**
+ * Dispatch one chat message from a joined client
+ */
+static void handle_message(Connection *conn, ChatMessageView *view) {
+    switch (view->type) {
+        case MSG_MESSAGE:
+            // Broadcast message to all clients, relaying the received bytes
+            {
+                Frame *frame = frame_create_relay(view, relay_formats(lobby_history));
+                if (frame != NULL) {
+                    history_append(lobby_history, frame);
+                    log_append(frame);
+                    search_add(frame->data[PROTO_BINARY], frame->len[PROTO_BINARY]);
+                    broadcast_frame(frame, conn);
+                }
+            }
+            break;
+            
+        case MSG_ROOM_MESSAGE:
+            handle_room_message(conn, view);
+            break;
+            
+        case MSG_DIRECT:
+            handle_direct_message(conn, view);
+            break;
+            
+        case MSG_JOIN_ROOM:
+            handle_join_room(conn, view);
+            break;
+            
+        case MSG_LEAVE_ROOM:
+            handle_leave_room(conn, view);
+            break;
+            
+        case MSG_LIST:
+            // Send user list, or the members of a room if one is named
+            if (view->content_length > 0) {
+                send_room_list(conn, view);
+                break;
+            }
+            {
+                ChatMessage list_msg;
+                char user_list[MAX_MESSAGE_LEN];
+                char text[MAX_MESSAGE_LEN];
+                get_user_list(user_list, sizeof(user_list));
+                snprintf(text, sizeof(text), "Online users: %s", user_list);
+                make_server_message(&list_msg, MSG_MESSAGE, text);
+                send_to_client(conn, &list_msg);
+            }
+            break;
+            
+        case MSG_SEARCH:
+            handle_search(conn, view);
+            break;
+            
+        case MSG_STATS:
+            handle_stats(conn);
+            break;
+            
+        case MSG_PING:
+            {
+                ChatMessage pong;
+                make_server_message(&pong, MSG_PONG, "");
+                send_to_client(conn, &pong);
+            }
+            break;
+            
+        case MSG_PONG:
+            // Answer to our MSG_PING; receiving it already counted as activity
+            break;
+            
+        case MSG_LEAVE:
+            close_connection(conn, "has left the chat room");
+            break;
+            
+        default:
+            break;
+    }
+}
+
+/**
+ * Handle the complete frames at the start of data, in order.
+ * Returns the bytes they took, or -1 if the connection was closed for a
+ * malformed frame.
+ */
+static int handle_frames(Connection *conn, const char *data, int length) {
+    int done = 0;
+    FrameBatch batch;
+    while (conn->state != CONN_CLOSING) {
+        TRACE_BEGIN(parse_start);
+        framing_split(data + done, length - done, &batch);
+        TRACE_END(parse_start, TRACE_PARSE, batch.consumed);
+        
+        const char *base = data + done;
+        for (int i = 0; i < batch.count && conn->state != CONN_CLOSING; i++) {
+            ChatMessageView view;
+            int ok = framing_view(base, &batch.spans[i], &view) == 0;
+            conn->worker->metrics->messages_in++;
+            
+            TRACE_BEGIN(handle_start);
+            if (conn->state == CONN_HANDSHAKE && ok && view.type == MSG_RESUME) {
+                handle_resume(conn, &view);
+                TRACE_END(handle_start, TRACE_HANDSHAKE, (int)conn->socket);
+            } else if (conn->state == CONN_HANDSHAKE) {
+                handle_nickname(conn, ok ? &view : NULL);
+                TRACE_END(handle_start, TRACE_HANDSHAKE, (int)conn->socket);
+            } else if (ok) {
+                LONG64 dispatch_start = metrics_now();
+                handle_message(conn, &view);
+                metrics_record(conn->worker->metrics, METRIC_DISPATCH, dispatch_start, metrics_now());
+                TRACE_END(handle_start, TRACE_DISPATCH, view.type);
+            }
+        }
+        done += batch.consumed;
+        
+        if (batch.malformed && conn->state != CONN_CLOSING) {
+            LOG_WARN("Malformed frame from socket %d, closing", (int)conn->socket);
+            close_connection(conn, "has disconnected");
+            return -1;
+        }
+        if (batch.count < FRAMING_MAX_SPANS) break;
+    }
+    return done;
+}
+
+/**
+ * Read available data from a connection and process complete frames
+ */
+static void handle_readable(Connection *conn) {
+    TRACE_BEGIN(recv_start);
+    int bytes_received = ring_recv(&conn->recv, conn->socket, recv_buffer_max);
+    TRACE_END(recv_start, TRACE_RECV, bytes_received);
+    if (bytes_received == RING_FULL) {
+        // A full buffer without a complete frame cannot be a valid message
+        LOG_WARN("Line too long from socket %d, closing", (int)conn->socket);
+        close_connection(conn, "has disconnected");
+        return;
+    }
+    if (bytes_received == RING_NO_MEMORY) {
+        LOG_ERROR("No memory for the receive buffer of socket %d, closing", (int)conn->socket);
+        close_connection(conn, "has disconnected");
+        return;
+    }
+    if (bytes_received > 0) {
+        conn->worker->metrics->bytes_in += bytes_received;
+        conn->last_recv = GetTickCount64();
+    }
+    if (bytes_received == 0) {
+        connection_lost(conn);
+        return;
+    }
+    if (bytes_received == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK) {
+            connection_lost(conn);
+        }
+        return;
+    }
+    
+    // Handle frames in place; a frame that wraps around the end of the
+    // ring is made contiguous before it is split
+    for (;;) {
+        int length;
+        const char *data = ring_peek(&conn->recv, &length);
+        int used = handle_frames(conn, data, length);
+        if (used < 0 || conn->state == CONN_CLOSING) return;
+        int more = ring_advance(&conn->recv, used, length);
+        if (more == RING_NO_MEMORY) {
+            LOG_ERROR("No memory for the receive buffer of socket %d, closing", (int)conn->socket);
+            close_connection(conn, "has disconnected");
+            return;
+        }
+        if (!more) break;
+    }
+}
+
+/**
+ * Write queued frames with gathered WSASend calls until the queue is
+ * empty or the socket would block.
+ * Returns 0 on success (including would-block), SOCKET_ERROR on failure.
+ */
+static int send_queued(Connection *conn) {
+    MetricsShard *metrics = conn->worker->metrics;
+    WSABUF bufs[FLUSH_BATCH];
+    
+    while (conn->out_count > 0) {
+        int count = conn->out_count < FLUSH_BATCH ? conn->out_count : FLUSH_BATCH;
+        for (int i = 0; i < count; i++) {
+            Frame *frame = conn->out_frames[(conn->out_head + i) % conn->out_cap];
+            int skip = (i == 0) ? conn->out_offset : 0;
+            bufs[i].buf = frame->data[conn->proto] + skip;
+            bufs[i].len = (ULONG)(frame->len[conn->proto] - skip);
+        }
+        
+        DWORD sent = 0;
+        metrics->send_calls++;
+        if (WSASend(conn->socket, bufs, (DWORD)count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : SOCKET_ERROR;
+        }
+        metrics->bytes_out += sent;
+        LONG64 now = metrics_now();
+        
+        // Release fully written frames and remember the partial one
+        DWORD remaining = sent;
+        while (conn->out_count > 0) {
+            Frame *frame = conn->out_frames[conn->out_head];
+            DWORD left = (DWORD)(frame->len[conn->proto] - conn->out_offset);
+            if (remaining < left) {
+                conn->out_offset += (int)remaining;
+                return 0; // Socket buffer is full
+            }
+            remaining -= left;
+            conn->out_offset = 0;
+            conn->out_head = (conn->out_head + 1) % conn->out_cap;
+            conn->out_count--;
+            conn->out_bytes -= frame->len[conn->proto];
+            metrics->queued_frames--;
+            metrics->messages_out++;
+            if (frame->created >= conn->joined_at) {
+                metrics_record(metrics, METRIC_DELIVERY, frame->created, now);
+            }
+            if (frame == conn->skip_notice) conn->skip_notice = NULL;
+            remember_sent(conn, frame);
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Send as much pending output as the socket accepts
+ */
+static void flush_connection(Connection *conn) {
+    if (conn->detached_until != 0) return;  // Kept queued for a resume
+    
+    TRACE_BEGIN(flush_start);
+    int result = send_queued(conn);
+    TRACE_END(flush_start, TRACE_FLUSH, (int)conn->socket);
+    if (result == SOCKET_ERROR) {
+        connection_lost(conn);
+        return;
+    }
+    
+    WSAPOLLFD *pfd = &conn->worker->poll_fds[conn->poll_index];
+    if (conn->out_count == 0) {
+        // An idle connection holds no ring; it goes back to the
+        // worker's spares
+        clear_outbound(conn);
+        pfd->events = POLLRDNORM;
+    } else {
+        // Wait for the socket to become writable again
+        pfd->events = POLLRDNORM | POLLWRNORM;
+    }
+}
+
+/**
+ * Whether a dirty connection's output should wait for more frames: its
+ * window is still open, it has less than flush_bytes queued, and it is
+ * not already waiting for the socket (then it is written when writable)
+ */
+static int keep_coalescing(Connection *conn, ULONGLONG now) {
+    if (flush_window_ms == 0 || now >= conn->flush_due || conn->detached_until != 0) return 0;
+    if (conn->out_bytes >= flush_bytes || conn->evicting) return 0;
+    return (conn->worker->poll_fds[conn->poll_index].events & POLLWRNORM) == 0;
+}
+
+/**
+ * Flush every connection that received output during this iteration,
+ * except those still inside their coalescing window, which stay on the
+ * list for a later iteration
+ */
+static void flush_dirty_connections(Worker *worker) {
+    ULONGLONG now = GetTickCount64();
+    int kept = 0;
+    worker->flush_due = 0;
+    
+    // Closing a connection may broadcast and grow the list while iterating
+    for (int i = 0; i < worker->dirty_count; i++) {
+        Connection *conn = worker->dirty_conns[i];
+        if (conn->state != CONN_CLOSING && keep_coalescing(conn, now)) {
+            worker->dirty_conns[kept++] = conn;
+            if (worker->flush_due == 0 || conn->flush_due < worker->flush_due) {
+                worker->flush_due = conn->flush_due;
+            }
+            continue;
+        }
+        conn->dirty = 0;
+        if (conn->state == CONN_CLOSING) continue;
+        
+        if (conn->evicting) {
+            // The MSG_ERROR is sent best-effort by sweep_connections()
+            close_connection(conn, "was disconnected for being too slow");
+        } else {
+            flush_connection(conn);
+        }
+    }
+    worker->dirty_count = kept;
+}
+
+/**
+ * Append a socket to a worker's poll set
+ */
+static int add_poll_slot(Worker *worker, SOCKET socket, Connection *conn) {
+    if (worker->poll_count == worker->poll_capacity) {
+        int new_cap = worker->poll_capacity ? worker->poll_capacity * 2 : 256;
+        WSAPOLLFD *new_fds = (WSAPOLLFD *)realloc(worker->poll_fds, new_cap * sizeof(WSAPOLLFD));
+        if (new_fds == NULL) return -1;
+        worker->poll_fds = new_fds;
+        Connection **new_conns = (Connection **)realloc(worker->conns, new_cap * sizeof(Connection *));
+        if (new_conns == NULL) return -1;
+        worker->conns = new_conns;
+        // Every connection is on the dirty list at most once
+        Connection **new_dirty = (Connection **)realloc(worker->dirty_conns, new_cap * sizeof(Connection *));
+        if (new_dirty == NULL) return -1;
+        worker->dirty_conns = new_dirty;
+        worker->poll_capacity = new_cap;
+    }
+    
+    worker->poll_fds[worker->poll_count].fd = socket;
+    worker->poll_fds[worker->poll_count].events = POLLRDNORM;
+    worker->poll_fds[worker->poll_count].revents = 0;
+    worker->conns[worker->poll_count] = conn;
+    return worker->poll_count++;
+}
+
+/**
+ * Register a newly accepted socket with a worker
+ */
+static Connection *add_connection(Worker *worker, SOCKET socket) {
+    Connection *conn = (Connection *)object_pool_alloc(&worker->connection_pool);
+    if (conn == NULL) return NULL;
+    
+    conn->socket = socket;
+    conn->state = CONN_HANDSHAKE;
+    conn->worker = worker;
+    conn->last_recv = GetTickCount64();
+    ring_init(&conn->recv);
+    conn->poll_index = add_poll_slot(worker, socket, conn);
+    if (conn->poll_index < 0) {
+        object_pool_free(&worker->connection_pool, conn);
+        return NULL;
+    }
+    timer_init(&conn->timer, conn);
+    timer_schedule(&worker->timers, &conn->timer, conn->last_recv + HANDSHAKE_TIMEOUT_MS);
+    
+    return conn;
+}
+
+/**
+ * Accept pending connections on the shared listening socket.
+ * Workers race for each connection; losers see WSAEWOULDBLOCK.
+ */
+static void accept_connections(Worker *worker) {
+    while (server_running) {
+        TRACE_BEGIN(accept_start);
+        struct sockaddr_in client_addr;
+        int addr_len = sizeof(client_addr);
+        SOCKET client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &addr_len);
+        
+        if (client_socket == INVALID_SOCKET) {
+            int error = WSAGetLastError();
+            if (error != WSAEWOULDBLOCK && server_running) {
+                LOG_ERROR("Accept failed: %d", error);
+            }
+            return;
+        }
+        
+        if (set_nonblocking(client_socket) == SOCKET_ERROR || add_connection(worker, client_socket) == NULL) {
+            LOG_ERROR("Failed to register connection");
+            closesocket(client_socket);
+            continue;
+        }
+        TRACE_END(accept_start, TRACE_ACCEPT, (int)client_socket);
+        worker->metrics->accepted++;
+        
+        LOG_DEBUG("New connection from %s:%d (worker %d)",
+            inet_ntoa(client_addr.sin_addr),
+            ntohs(client_addr.sin_port),
+            worker->index);
+    }
+}
+
+/**
+ * A connection's timer expired. Depending on its state that is the end
+ * of the handshake period, of a detached session's grace period, or a
+ * heartbeat check: activity since the last check only moves the timer,
+ * silence gets a MSG_PING, and a ping left unanswered means the peer is
+ * gone even if the socket never reported an error.
+ */
+static void connection_timer(Timer *timer, void *context) {
+    Connection *conn = (Connection *)timer->owner;
+    ULONGLONG now = *(const ULONGLONG *)context;
+    if (conn->state == CONN_CLOSING) return;
+    
+    if (conn->state == CONN_HANDSHAKE) {
+        LOG_INFO("Client connection timeout (socket %d)", (int)conn->socket);
+        close_connection(conn, NULL);
+        return;
+    }
+    if (conn->detached_until != 0) {
+        close_connection(conn, "has disconnected");
+        return;
+    }
+    if (heartbeat_ms == 0 || conn->evicting) return;
+    
+    if (conn->ping_sent_at != 0 && conn->last_recv < conn->ping_sent_at) {
+        if (now < conn->ping_sent_at + heartbeat_timeout_ms) {
+            timer_schedule(&conn->worker->timers, timer, conn->ping_sent_at + heartbeat_timeout_ms);
+            return;
+        }
+        LOG_INFO("User [ID:%d]%s did not answer a heartbeat within %d ms", conn->user_id, conn->user->username, heartbeat_timeout_ms);
+        connection_lost(conn);
+        return;
+    }
+    
+    if (now < conn->last_recv + heartbeat_ms) {
+        arm_heartbeat(conn);
+        return;
+    }
+    ChatMessage ping;
+    make_server_message(&ping, MSG_PING, "");
+    send_to_client(conn, &ping);
+    conn->ping_sent_at = now;
+    timer_schedule(&conn->worker->timers, timer, now + heartbeat_timeout_ms);
+}
+
+/**
+ * Release a connection's buffers and state; its socket is already closed
+ */
+static void free_connection(Connection *conn) {
+    Worker *worker = conn->worker;
+    clear_outbound(conn);
+    clear_sent(conn);
+    ring_release(&conn->recv);
+    if (conn->user != NULL) {
+        free(conn->user->rooms);
+        object_pool_free(&worker->user_pool, conn->user);
+    }
+    object_pool_free(&worker->connection_pool, conn);
+}
+
+/**
+ * Release connections marked CONN_CLOSING
+ */
+static void sweep_connections(Worker *worker) {
+    for (int i = worker->poll_count - 1; i >= FIRST_CONN_INDEX; i--) {
+        Connection *conn = worker->conns[i];
+        if (conn->state != CONN_CLOSING) continue;
+        
+        // Best effort delivery of a final error message. A connection
+        // whose socket was handed to another worker has none.
+        if (conn->socket != INVALID_SOCKET) {
+            if (conn->detached_until == 0) send_queued(conn);
+            closesocket(conn->socket);
+        }
+        timer_cancel(&worker->timers, &conn->timer);
+        free_connection(conn);
+        
+        // Move the last entry into the freed slot
+        worker->poll_count--;
+        if (i != worker->poll_count) {
+            worker->poll_fds[i] = worker->poll_fds[worker->poll_count];
+            worker->conns[i] = worker->conns[worker->poll_count];
+            worker->conns[i]->poll_index = i;
+        }
+    }
+}
+
+/**
+ * Create a worker's inbox and loopback wakeup socket
+ */
+static int init_worker(Worker *worker, int index) {
+    memset(worker, 0, sizeof(Worker));
+    worker->index = index;
+    worker->metrics = metrics_shard(index);
+    timer_wheel_init(&worker->timers, GetTickCount64());
+    object_pool_init(&worker->connection_pool, sizeof(Connection), CONN_SLAB_OBJECTS);
+    object_pool_init(&worker->user_pool, sizeof(JoinedUser), CONN_SLAB_OBJECTS);
+    inbox_init(&worker->inbox);
+    
+    worker->wake_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (worker->wake_socket == INVALID_SOCKET) return -1;
+    
+    struct sockaddr_in addr;
+    int addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(worker->wake_socket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        getsockname(worker->wake_socket, (struct sockaddr*)&worker->wake_addr, &addr_len) == SOCKET_ERROR ||
+        set_nonblocking(worker->wake_socket) == SOCKET_ERROR) {
+        closesocket(worker->wake_socket);
+        return -1;
+    }
+    
+    if (add_poll_slot(worker, server_socket, NULL) < 0 ||
+        add_poll_slot(worker, worker->wake_socket, NULL) < 0) {
+        closesocket(worker->wake_socket);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/**
+ * Release everything a worker still owns after its loop has exited
+ */
+static void cleanup_worker(Worker *worker) {
+    for (int i = FIRST_CONN_INDEX; i < worker->poll_count; i++) {
+        if (worker->conns[i]->socket != INVALID_SOCKET) {
+            closesocket(worker->conns[i]->socket);
+        }
+        free_connection(worker->conns[i]);
+    }
+    for (int i = 0; i < OUTQ_RING_CLASSES; i++) {
+        while (worker->spare_rings[i] != NULL) {
+            Frame **ring = worker->spare_rings[i];
+            worker->spare_rings[i] = *(Frame ***)ring;
+            free(ring);
+        }
+    }
+    object_pool_destroy(&worker->user_pool);
+    object_pool_destroy(&worker->connection_pool);
+    
+    InboxNode *node;
+    while ((node = inbox_pop(&worker->inbox)) != NULL) {
+        if (node->frame != NULL) {
+            frame_release(node->frame);
+        } else {
+            closesocket(node->socket);
+        }
+        free(node);
+    }
+    
+    for (int i = 0; i < LOCAL_ROOM_BUCKETS; i++) {
+        while (worker->local_rooms[i] != NULL) {
+            LocalRoom *room = worker->local_rooms[i];
+            worker->local_rooms[i] = room->next;
+            free(room->members);
+            free(room->replayed_seqs);
+            free(room);
+        }
+    }
+    
+    closesocket(worker->wake_socket);
+    free(worker->poll_fds);
+    free(worker->conns);
+    free(worker->dirty_conns);
+}
+
+/**
+ * Event loop of one worker: accepts connections and drives every
+ * connection's state machine from readiness notifications
+ */
+static void run_event_loop(Worker *worker) {
+    ULONGLONG last_metrics_tick = GetTickCount64();
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "worker %d", worker->index);
+    trace_thread_start(thread_name);
+    metrics_thread_start(worker->index);
+    
+    while (server_running) {
+        // Nothing from the previous iteration is held across the poll
+        worker->quiescent_epoch = ReadAcquire64(&reclaim_epoch);
+        
+        // Sleep until the next due timer; never longer than a second so
+        // the worker keeps passing quiescent points and sees shutdown
+        ULONGLONG poll_at = GetTickCount64();
+        int timeout = timer_wheel_timeout(&worker->timers, poll_at, 1000);
+        if (worker->flush_due != 0) {
+            int window = worker->flush_due > poll_at ? (int)(worker->flush_due - poll_at) : 0;
+            if (window < timeout) timeout = window;
+        }
+        TRACE_BEGIN(poll_start);
+        int ready = WSAPoll(worker->poll_fds, (ULONG)worker->poll_count, timeout);
+        TRACE_END(poll_start, TRACE_POLL, ready);
+        if (ready == SOCKET_ERROR) {
+            LOG_ERROR("WSAPoll failed: %d", WSAGetLastError());
+            break;
+        }
+        
+        if (ready > 0) {
+            // Connections accepted below are appended and polled next iteration
+            int count = worker->poll_count;
+            for (int i = FIRST_CONN_INDEX; i < count; i++) {
+                short revents = worker->poll_fds[i].revents;
+                Connection *conn = worker->conns[i];
+                if (revents == 0 || conn->state == CONN_CLOSING) continue;
+                
+                if (revents & (POLLERR | POLLNVAL)) {
+                    connection_lost(conn);
+                    continue;
+                }
+                if (revents & (POLLRDNORM | POLLHUP)) {
+                    handle_readable(conn);
+                }
+                if ((revents & POLLWRNORM) && conn->state != CONN_CLOSING && !conn->dirty) {
+                    flush_connection(conn);
+                }
+            }
+            
+            if (worker->poll_fds[1].revents & POLLRDNORM) {
+                char drain[64];
+                while (recv(worker->wake_socket, drain, sizeof(drain), 0) > 0) {
+                }
+            }
+            
+            if (worker->poll_fds[0].revents & POLLRDNORM) {
+                accept_connections(worker);
+            }
+        }
+        
+        // Clear the flag before draining so later posts wake us again
+        InterlockedExchange(&worker->wake_pending, 0);
+        drain_inbox(worker);
+        
+        ULONGLONG now = GetTickCount64();
+        timer_wheel_advance(&worker->timers, now, connection_timer, &now);
+        if (worker->index == 0 && now - last_metrics_tick >= 1000) {
+            metrics_tick();
+            last_metrics_tick = now;
+        }
+        
+        flush_dirty_connections(worker);
+        sweep_connections(worker);
+        
+        // Queues that grew during a burst (a join storm, a slow reader)
+        // are freed as they drain, but the heap keeps the pages; give
+        // them back once this worker has nothing queued
+        if (worker->freed_ring_bytes >= HEAP_COMPACT_BYTES && worker->metrics->queued_frames == 0) {
+            worker->freed_ring_bytes = 0;
+            HeapCompact(GetProcessHeap(), 0);
+        }
+    }
+}
+
+/**
+ * Print how often each slow-consumer policy fired
+ */
+static void print_slow_consumer_stats() {
+    LOG_INFO("Slow consumers: drop=%lld coalesce=%lld disconnect=%lld (chat frames discarded: %lld)",
+        (long long)slow_stats.drop_events,
+        (long long)slow_stats.coalesce_events,
+        (long long)slow_stats.disconnects,
+        (long long)slow_stats.dropped_frames);
+}
+
+/**
+ * Server-wide values for metrics reports; called from any thread
+ */
+static void read_server_gauges(MetricsGauges *gauges) {
+    for (int proto = 0; proto < PROTO_COUNT; proto++) {
+        gauges->users_by_proto[proto] = proto_users[proto];
+        gauges->users += proto_users[proto];
+    }
+    for (int i = 0; i < worker_count; i++) {
+        int slots = workers[i].poll_count;
+        if (slots > FIRST_CONN_INDEX) gauges->connections += slots - FIRST_CONN_INDEX;
+    }
+    gauges->workers = worker_count;
+    gauges->slow_dropped_frames = slow_stats.dropped_frames;
+    gauges->slow_disconnects = slow_stats.disconnects;
+    gauges->log_dropped = logger_dropped();
+    
+    BufferPoolStats buffers;
+    buffer_pool_get_stats(&buffers);
+    gauges->recv_buffer_bytes = buffers.in_use;
+    gauges->recv_pool_bytes = buffers.idle;
+    
+    FramePoolStats frames;
+    frame_pool_get_stats(&frames);
+    gauges->frame_pool_bytes = frames.idle_bytes;
+    gauges->frame_heap_allocations = frames.heap_allocations;
+}
+
+/**
+ * Worker thread entry point
+ */
+static DWORD WINAPI worker_thread(LPVOID lpParam) {
+    run_event_loop((Worker *)lpParam);
+    return 0;
+}
+
+/**
+ * Write the trace rings collected so far
+ */
+static void write_trace(void) {
+    int spans = trace_dump(trace_path);
+    if (spans < 0) {
+        LOG_ERROR("Failed to write trace to %s", trace_path);
+    } else {
+        LOG_INFO("Trace: %d spans written to %s", spans, trace_path);
+    }
+}
+
+/**
+ * Console control handler: Ctrl+C for orderly shutdown, Ctrl+Break for
+ * a trace snapshot when tracing
+ */
+static BOOL WINAPI console_handler(DWORD ctrl_type) {
+    if (ctrl_type == CTRL_C_EVENT || ctrl_type == CTRL_CLOSE_EVENT) {
+        server_running = 0;
+        return TRUE;
+    }
+    if (ctrl_type == CTRL_BREAK_EVENT && trace_path != NULL) {
+        write_trace();
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static int replay_log_record(LONG64 record, ChatMessageView *view, void *context) {
+    LONG64 history_first = *(const LONG64 *)context;
+    if (view->type != MSG_MESSAGE) return 0;
+    
+    search_add(view->frame, view->frame_len);
+    if (record >= history_first && lobby_history != NULL) {
+        Frame *frame = frame_create_relay(view, ALL_FORMATS);
+        if (frame != NULL) {
+            history_append(lobby_history, frame);
+            frame_release(frame);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Refill the lobby history and the search index from the end of the
+ * message log, so a restart does not lose recent messages. Room messages
+ * are skipped: rooms do not outlive the server.
+ */
+static void load_message_log(void) {
+    if (log_next_record() == 1) return;  // Nothing logged yet
+    
+    LONG64 history_first = log_next_record() - history_len;
+    LONG64 first = log_next_record() - search_docs;
+    if (history_first < first) first = history_first;
+    log_read_records(log_dir, first < 1 ? 1 : first, replay_log_record, &history_first);
+}
+
+/**
+ * Parse command line options
+ */
+static int parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+            if (worker_count < 1 || worker_count > MAX_WORKERS) {
+                printf("Worker count must be between 1 and %d\n", MAX_WORKERS);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--slow-policy") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "drop") == 0) {
+                slow_policy = SLOW_DROP_OLDEST;
+            } else if (strcmp(policy, "coalesce") == 0) {
+                slow_policy = SLOW_COALESCE;
+            } else if (strcmp(policy, "disconnect") == 0) {
+                slow_policy = SLOW_DISCONNECT;
+            } else {
+                printf("Unknown slow consumer policy: %s\n", policy);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--max-queued-msgs") == 0 && i + 1 < argc) {
+            max_queued_msgs = atoi(argv[++i]);
+            if (max_queued_msgs < 2 || max_queued_msgs > OUTQ_MAX_FRAMES) {
+                printf("Queued message limit must be between 2 and %d\n", OUTQ_MAX_FRAMES);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--max-queued-bytes") == 0 && i + 1 < argc) {
+            max_queued_bytes = atoi(argv[++i]);
+            if (max_queued_bytes < MAX_BUFFER_SIZE * 2) {
+                printf("Queued byte limit must be at least %d\n", MAX_BUFFER_SIZE * 2);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            history_len = atoi(argv[++i]);
+            if (history_len < 0 || history_len > MAX_HISTORY_LEN) {
+                printf("History length must be between 0 and %d\n", MAX_HISTORY_LEN);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--log-dir") == 0 && i + 1 < argc) {
+            log_dir = argv[++i];
+        } else if (strcmp(argv[i], "--log-flush-ms") == 0 && i + 1 < argc) {
+            log_flush_ms = atoi(argv[++i]);
+            if (log_flush_ms < 1 || log_flush_ms > 10000) {
+                printf("Log flush interval must be between 1 and 10000 ms\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--log-flush-bytes") == 0 && i + 1 < argc) {
+            log_flush_bytes = atoi(argv[++i]);
+            if (log_flush_bytes < 1 || log_flush_bytes > LOG_BUFFER_SIZE) {
+                printf("Log flush size must be between 1 and %d bytes\n", LOG_BUFFER_SIZE);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--search-docs") == 0 && i + 1 < argc) {
+            search_docs = atoi(argv[++i]);
+            if (search_docs < 0 || search_docs > MAX_SEARCH_DOCS) {
+                printf("Searchable message count must be between 0 and %d\n", MAX_SEARCH_DOCS);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--resume-grace") == 0 && i + 1 < argc) {
+            resume_grace_ms = atoi(argv[++i]);
+            if (resume_grace_ms < 0 || resume_grace_ms > 3600000) {
+                printf("Resume grace period must be between 0 and 3600000 ms\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--resume-frames") == 0 && i + 1 < argc) {
+            resume_frames = atoi(argv[++i]);
+            if (resume_frames < 1 || resume_frames > OUTQ_MAX_FRAMES) {
+                printf("Resume frame count must be between 1 and %d\n", OUTQ_MAX_FRAMES);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--heartbeat") == 0 && i + 1 < argc) {
+            heartbeat_ms = atoi(argv[++i]);
+            if (heartbeat_ms != 0 && (heartbeat_ms < 1000 || heartbeat_ms > 3600000)) {
+                printf("Heartbeat interval must be 0 (off) or between 1000 and 3600000 ms\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--heartbeat-timeout") == 0 && i + 1 < argc) {
+            heartbeat_timeout_ms = atoi(argv[++i]);
+            if (heartbeat_timeout_ms < 100 || heartbeat_timeout_ms > 600000) {
+                printf("Heartbeat timeout must be between 100 and 600000 ms\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--recv-buffer-max") == 0 && i + 1 < argc) {
+            recv_buffer_max = atoi(argv[++i]);
+            if (recv_buffer_max < BUFFER_MIN_SIZE || recv_buffer_max > BUFFER_MAX_SIZE
+                || (recv_buffer_max & (recv_buffer_max - 1)) != 0) {
+                printf("Receive buffer limit must be a power of two between %d and %d bytes\n",
+                       BUFFER_MIN_SIZE, BUFFER_MAX_SIZE);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--flush-window") == 0 && i + 1 < argc) {
+            flush_window_ms = atoi(argv[++i]);
+            if (flush_window_ms < 0 || flush_window_ms > 1000) {
+                printf("Flush window must be between 0 and 1000 ms\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--flush-bytes") == 0 && i + 1 < argc) {
+            flush_bytes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--admin-port") == 0 && i + 1 < argc) {
+            admin_port = atoi(argv[++i]);
+            if (admin_port < 1 || admin_port > 65535 || admin_port == SERVER_PORT) {
+                printf("Admin port must be between 1 and 65535 and differ from %d\n", SERVER_PORT);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            if (logger_parse_level(argv[++i], &logger_options.level) != 0) {
+                printf("Unknown log level: %s (debug, info, warn or error)\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--log-rate") == 0 && i + 1 < argc) {
+            logger_options.rate = atoi(argv[++i]);
+            if (logger_options.rate < 0) {
+                printf("Log rate must be 0 (no limit) or more records per second\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--server-log") == 0 && i + 1 < argc) {
+            logger_options.file_path = argv[++i];
+        } else if (strcmp(argv[i], "--server-log-size") == 0 && i + 1 < argc) {
+            logger_options.file_size = strtoll(argv[++i], NULL, 10);
+            if (logger_options.file_size < LOGGER_BATCH_SIZE) {
+                printf("Server log size must be at least %d bytes\n", LOGGER_BATCH_SIZE);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--server-log-files") == 0 && i + 1 < argc) {
+            logger_options.file_count = atoi(argv[++i]);
+            if (logger_options.file_count < 1 || logger_options.file_count > 99) {
+                printf("Rotated server log count must be between 1 and 99\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            logger_options.console = 0;
+        } else {
+            printf("Usage: %s [--workers N] [--slow-policy drop|coalesce|disconnect]\n"
+                   "          [--max-queued-msgs N] [--max-queued-bytes N] [--history N]\n"
+                   "          [--log-dir DIR] [--log-flush-ms N] [--log-flush-bytes N]\n"
+                   "          [--search-docs N] [--resume-grace MS] [--resume-frames N]\n"
+                   "          [--heartbeat MS] [--heartbeat-timeout MS] [--recv-buffer-max BYTES]\n"
+                   "          [--flush-window MS] [--flush-bytes BYTES]\n"
+                   "          [--trace FILE] [--admin-port PORT]\n"
+                   "          [--log-level debug|info|warn|error] [--log-rate N] [--quiet]\n"
+                   "          [--server-log FILE] [--server-log-size BYTES] [--server-log-files N]\n", argv[0]);
+            return -1;
+        }
+    }
+    
+    // Checked once every option is in, whichever order they came in
+    if (flush_bytes < 1 || flush_bytes > max_queued_bytes) {
+        printf("Flush threshold must be between 1 and %d bytes (--max-queued-bytes)\n", max_queued_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Main server function
+ */
+int main(int argc, char *argv[]) {
+    printf("=== NKU Chat Room Server ===\n");
+    
+    logger_default_config(&logger_options);
+    if (parse_args(argc, argv) != 0) {
+        return 1;
+    }
+    if (logger_start(&logger_options) != 0) {
+        printf("Failed to start the server log\n");
+        return 1;
+    }
+    buffer_pool_init();
+    frame_pool_init();
+    InitializeSListHead(&spare_inbox_nodes);
+    metrics_init(read_server_gauges);
+    if (trace_path != NULL) {
+        if (trace_start() != 0) {
+            LOG_ERROR("Tracing is not available; build with -DCHAT_TRACE");
+            logger_stop();
+            return 1;
+        }
+        LOG_INFO("Tracing to %s (Ctrl+Break writes a snapshot)", trace_path);
+    }
+    
+    // Create mutex protecting the client list
+    client_mutex = CreateMutex(NULL, FALSE, NULL);
+    if (client_mutex == NULL) {
+        LOG_ERROR("Failed to create mutex");
+        logger_stop();
+        return 1;
+    }
+    
+    // Initialize client list
+    if (registry_init(&registry, MAX_CLIENTS) != 0) {
+        LOG_ERROR("Failed to allocate client registry");
+        CloseHandle(client_mutex);
+        logger_stop();
+        return 1;
+    }
+    rooms_init(history_len);
+    lobby_history = history_create(history_len);  // NULL when disabled
+    if (search_init(search_docs) != 0) {
+        LOG_ERROR("Failed to allocate search index");
+        registry_destroy(&registry);
+        CloseHandle(client_mutex);
+        logger_stop();
+        return 1;
+    }
+    if (search_enabled()) {
+        LOG_INFO("Search index: up to %d lobby messages", search_docs);
+    }
+    
+    if (log_dir != NULL) {
+        if (log_open(log_dir, log_flush_ms, log_flush_bytes) != 0) {
+            LOG_ERROR("Failed to open message log in %s", log_dir);
+            registry_destroy(&registry);
+            CloseHandle(client_mutex);
+            logger_stop();
+            return 1;
+        }
+        load_message_log();
+        LOG_INFO("Message log: %s, next record %lld", log_dir, log_next_record());
+    }
+    
+    if (publish_user_snapshot() == NULL) {
+        LOG_ERROR("Failed to allocate user snapshot");
+        log_close();
+        registry_destroy(&registry);
+        CloseHandle(client_mutex);
+        logger_stop();
+        return 1;
+    }
+    
+    // Initialize server
+    if (init_server() != 0) {
+        log_close();
+        free_user_snapshots();
+        registry_destroy(&registry);
+        CloseHandle(client_mutex);
+        logger_stop();
+        return 1;
+    }
+    
+    if (admin_port != 0) {
+        if (metrics_start_admin(admin_port) != 0) {
+            LOG_ERROR("Failed to open admin socket on 127.0.0.1:%d", admin_port);
+            closesocket(wake_sender);
+            closesocket(server_socket);
+            WSACleanup();
+            log_close();
+            free_user_snapshots();
+            registry_destroy(&registry);
+            CloseHandle(client_mutex);
+            logger_stop();
+            return 1;
+        }
+        LOG_INFO("Metrics on 127.0.0.1:%d (GET /metrics for Prometheus)", admin_port);
+    }
+    
+    if (flush_window_ms > 0) {
+        LOG_INFO("Write coalescing: %d ms window, %d byte threshold", flush_window_ms, flush_bytes);
+    }
+    
+    SetConsoleCtrlHandler(console_handler, TRUE);
+    
+    for (int i = 0; i < worker_count; i++) {
+        if (init_worker(&workers[i], i) != 0) {
+            LOG_ERROR("Failed to initialize worker %d: %d", i, WSAGetLastError());
+            server_running = 0;
+            worker_count = i;
+            break;
+        }
+    }
+    
+    // Worker 0 runs on the main thread
+    for (int i = 1; i < worker_count; i++) {
+        workers[i].thread = CreateThread(NULL, 0, worker_thread, &workers[i], 0, NULL);
+        if (workers[i].thread == NULL) {
+            LOG_ERROR("Failed to create worker thread %d", i);
+            server_running = 0;
+            break;
+        }
+    }
+    if (server_running) {
+        run_event_loop(&workers[0]);
+    }
+    
+    // Cleanup
+    for (int i = 1; i < worker_count; i++) {
+        if (workers[i].thread != NULL) {
+            WaitForSingleObject(workers[i].thread, INFINITE);
+            CloseHandle(workers[i].thread);
+        }
+    }
+    metrics_stop_admin();
+    if (trace_path != NULL) {
+        write_trace();
+        trace_stop();
+    }
+    for (int i = 0; i < worker_count; i++) {
+        cleanup_worker(&workers[i]);
+    }
+    closesocket(wake_sender);
     closesocket(server_socket);
     WSACleanup();
+    log_close();
+    search_destroy();
+    free_user_snapshots();
+    rooms_destroy();
+    history_destroy(lobby_history);
+    registry_destroy(&registry);
     CloseHandle(client_mutex);
     
-    printf("Server shutdown\n");
+    print_slow_consumer_stats();
+    LOG_INFO("Server shutdown");
+    logger_stop();
     return 0;
 }
 
@@ -0,0 +1,144 @@
+#include "chat_timer.h"
+
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_TICKS (((ULONGLONG)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+static void link_timer(Timer **head, Timer *timer) {
+    timer->next = *head;
+    if (*head != NULL) (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void unlink_timer(Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * File a timer in the lowest level whose turn covers its deadline.
+ * A deadline that is already due goes to the current level-0 slot.
+ */
+static void file_timer(TimerWheel *wheel, Timer *timer) {
+    if (timer->expires < wheel->current) timer->expires = wheel->current;
+    
+    ULONGLONG delta = timer->expires - wheel->current;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= ((ULONGLONG)1 << (TIMER_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    int index = (int)((timer->expires >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK);
+    link_timer(&wheel->slots[level][index], timer);
+}
+
+/**
+ * Refile the timers of a higher-level slot whose turn has come; they
+ * all expire within the turn of the level below
+ */
+static void cascade(TimerWheel *wheel, int level, int index) {
+    Timer *list = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (list != NULL) {
+        Timer *timer = list;
+        list = timer->next;
+        file_timer(wheel, timer);
+    }
+}
+
+void timer_wheel_init(TimerWheel *wheel, ULONGLONG now_ms) {
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->current = now_ms / TIMER_TICK_MS;
+}
+
+void timer_init(Timer *timer, void *owner) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->owner = owner;
+}
+
+/**
+ * (Re)schedule a timer to fire at the first tick at or after when_ms
+ * (GetTickCount64() time), but never in the tick already processed
+ */
+void timer_schedule(TimerWheel *wheel, Timer *timer, ULONGLONG when_ms) {
+    if (timer->pprev != NULL) {
+        unlink_timer(timer);
+    } else {
+        wheel->count++;
+    }
+    
+    ULONGLONG expires = (when_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (expires <= wheel->current) expires = wheel->current + 1;
+    if (expires - wheel->current > TIMER_MAX_TICKS) expires = wheel->current + TIMER_MAX_TICKS;
+    timer->expires = expires;
+    file_timer(wheel, timer);
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (timer->pprev == NULL) return;
+    unlink_timer(timer);
+    wheel->count--;
+}
+
+int timer_pending(const Timer *timer) {
+    return timer->pprev != NULL;
+}
+
+/**
+ * Process every tick up to now_ms, calling back for each timer that
+ * expires. Returns the number of timers that fired.
+ */
+int timer_wheel_advance(TimerWheel *wheel, ULONGLONG now_ms, TimerCallback callback, void *context) {
+    ULONGLONG target = now_ms / TIMER_TICK_MS;
+    int fired = 0;
+    
+    while (wheel->current < target) {
+        if (wheel->count == 0) {
+            wheel->current = target;
+            break;
+        }
+        ULONGLONG tick = ++wheel->current;
+        
+        // A new turn of level L - 1 starts: bring down the due slot of level L
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if ((tick & (((ULONGLONG)1 << (TIMER_SLOT_BITS * level)) - 1)) != 0) break;
+            cascade(wheel, level, (int)((tick >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK));
+        }
+        
+        // Detach the due slot first, so callbacks can reschedule or
+        // cancel any timer while it is walked
+        Timer *due = wheel->slots[0][tick & TIMER_SLOT_MASK];
+        if (due == NULL) continue;
+        wheel->slots[0][tick & TIMER_SLOT_MASK] = NULL;
+        due->pprev = &due;
+        while (due != NULL) {
+            Timer *timer = due;
+            unlink_timer(timer);
+            wheel->count--;
+            fired++;
+            callback(timer, context);
+        }
+    }
+    return fired;
+}
+
+/**
+ * Milliseconds a poll may wait before the wheel has work: the next
+ * level-0 slot with timers, or the end of the level-0 turn when the
+ * levels above cascade, whichever comes first; at most max_ms.
+ */
+int timer_wheel_timeout(const TimerWheel *wheel, ULONGLONG now_ms, int max_ms) {
+    if (wheel->count == 0) return max_ms;
+    
+    ULONGLONG tick = wheel->current + 1;
+    while (wheel->slots[0][tick & TIMER_SLOT_MASK] == NULL && (tick & TIMER_SLOT_MASK) != 0) {
+        tick++;
+    }
+    
+    LONG64 wait = (LONG64)(tick * TIMER_TICK_MS) - (LONG64)now_ms;
+    if (wait < 0) return 0;
+    return wait < max_ms ? (int)wait : max_ms;
+}
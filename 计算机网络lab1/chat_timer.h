@@ -0,0 +1,42 @@
+#ifndef CHAT_TIMER_H
+#define CHAT_TIMER_H
+
+#include "chat_protocol.h"
+
+// Hierarchical timer wheel, owned by one thread (no locking). Level 0
+// has TIMER_SLOTS slots of one tick; a slot of each higher level spans a
+// whole turn of the level below. A timer is filed in the lowest level
+// its deadline fits in and moves down when that level's slot comes up,
+// so scheduling and cancelling are O(1) and a tick only visits the
+// slots that are due.
+#define TIMER_TICK_MS 100
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4                   // Deadlines up to 64^4 ticks (19 days) ahead
+
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer **pprev;                // Link pointing at this timer, NULL if not scheduled
+    ULONGLONG expires;                   // Tick it fires at
+    void *owner;
+} Timer;
+
+typedef struct {
+    Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    ULONGLONG current;                   // Last tick processed
+    int count;                           // Scheduled timers
+} TimerWheel;
+
+// Called for each expired timer; it may schedule that timer again
+typedef void (*TimerCallback)(Timer *timer, void *context);
+
+// Function prototypes
+void timer_wheel_init(TimerWheel *wheel, ULONGLONG now_ms);
+void timer_init(Timer *timer, void *owner);
+void timer_schedule(TimerWheel *wheel, Timer *timer, ULONGLONG when_ms);
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+int timer_pending(const Timer *timer);
+int timer_wheel_advance(TimerWheel *wheel, ULONGLONG now_ms, TimerCallback callback, void *context);
+int timer_wheel_timeout(const TimerWheel *wheel, ULONGLONG now_ms, int max_ms);
+
+#endif // CHAT_TIMER_H
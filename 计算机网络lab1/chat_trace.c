@@ -0,0 +1,204 @@
+#include "chat_trace.h"
+
+#ifdef CHAT_TRACE
+
+// One recorded span
+typedef struct {
+    LONG64 start;                    // QueryPerformanceCounter ticks
+    unsigned int duration;           // Ticks
+    int stage;
+    int arg;
+} TraceEvent;
+
+// Spans of one thread. Only the owner writes; head is published after
+// each event so a dump can tell which slots were overwritten meanwhile.
+typedef struct {
+    char name[32];
+    DWORD thread_id;
+    volatile LONG64 head;            // Spans recorded; the next goes to head % TRACE_RING_EVENTS
+    TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+volatile int trace_active = 0;
+static DWORD trace_slot = TLS_OUT_OF_INDEXES;   // TLS index holding the thread's ring
+static TraceRing * volatile trace_rings[TRACE_MAX_THREADS];
+static volatile LONG trace_ring_count = 0;
+static LARGE_INTEGER trace_frequency;
+static LONG64 trace_epoch;                      // Time zero of the dump
+static volatile LONG trace_dumping = 0;
+
+static const char *stage_names[TRACE_STAGE_COUNT] = {
+    "poll", "accept", "recv", "parse", "handshake",
+    "dispatch", "fan_out", "inbox", "flush", "lock_wait"
+};
+static const char *arg_names[TRACE_STAGE_COUNT] = {
+    "ready", "socket", "bytes", "bytes", "socket",
+    "type", "queues", "frames", "socket", NULL
+};
+
+/**
+ * Turn recording on. Threads must call trace_thread_start() to record.
+ */
+int trace_start(void) {
+    trace_slot = TlsAlloc();
+    if (trace_slot == TLS_OUT_OF_INDEXES) return -1;
+    
+    QueryPerformanceFrequency(&trace_frequency);
+    trace_epoch = trace_now();
+    trace_active = 1;
+    return 0;
+}
+
+/**
+ * Turn recording off and free the rings once no thread records any more.
+ * A dump running on another thread (Ctrl+Break) is waited for first.
+ */
+void trace_stop(void) {
+    if (trace_slot == TLS_OUT_OF_INDEXES) return;
+    
+    trace_active = 0;
+    while (InterlockedCompareExchange(&trace_dumping, 1, 0) != 0) {
+        Sleep(1);
+    }
+    int count = trace_ring_count < TRACE_MAX_THREADS ? trace_ring_count : TRACE_MAX_THREADS;
+    for (int i = 0; i < count; i++) {
+        free(trace_rings[i]);
+        trace_rings[i] = NULL;
+    }
+    trace_ring_count = 0;
+    TlsFree(trace_slot);
+    trace_slot = TLS_OUT_OF_INDEXES;
+    InterlockedExchange(&trace_dumping, 0);
+}
+
+/**
+ * Give the calling thread a ring. Does nothing while tracing is off.
+ */
+int trace_thread_start(const char *name) {
+    if (!trace_active) return 0;
+    
+    TraceRing *ring = (TraceRing *)malloc(sizeof(TraceRing));
+    if (ring == NULL) return -1;
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    ring->thread_id = GetCurrentThreadId();
+    ring->head = 0;
+    
+    LONG index = InterlockedIncrement(&trace_ring_count) - 1;
+    if (index >= TRACE_MAX_THREADS) {
+        free(ring);
+        return -1;
+    }
+    InterlockedExchangePointer((PVOID volatile *)&trace_rings[index], ring);
+    TlsSetValue(trace_slot, ring);
+    return 0;
+}
+
+LONG64 trace_now(void) {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+/**
+ * Record a span from start until now on the calling thread's ring
+ */
+void trace_record(TraceStage stage, LONG64 start, int arg) {
+    TraceRing *ring = (TraceRing *)TlsGetValue(trace_slot);
+    if (ring == NULL) return;  // Thread never called trace_thread_start()
+    
+    LONG64 head = ring->head;
+    TraceEvent *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    event->start = start;
+    event->duration = (unsigned int)(trace_now() - start);
+    event->stage = stage;
+    event->arg = arg;
+    WriteRelease64(&ring->head, head + 1);
+}
+
+static double ticks_to_us(LONG64 ticks) {
+    return (double)ticks * 1e6 / (double)trace_frequency.QuadPart;
+}
+
+/**
+ * Copy the spans still in a ring. Slots the owner may have overwritten
+ * while copying are dropped. Returns the number of spans in out.
+ */
+static int snapshot_ring(TraceRing *ring, TraceEvent *out) {
+    LONG64 head = ReadAcquire64(&ring->head);
+    LONG64 first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+    for (LONG64 i = first; i < head; i++) {
+        out[i - first] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+    }
+    MemoryBarrier();
+    
+    // The owner may be writing slot of span `now`, which held now - N
+    LONG64 now = ReadAcquire64(&ring->head);
+    LONG64 valid = now >= TRACE_RING_EVENTS ? now - TRACE_RING_EVENTS + 1 : 0;
+    if (valid <= first) return (int)(head - first);
+    if (valid >= head) return 0;
+    
+    memmove(out, out + (valid - first), (size_t)(head - valid) * sizeof(TraceEvent));
+    return (int)(head - valid);
+}
+
+/**
+ * Write every thread's ring as Chrome trace JSON. Safe to call while
+ * other threads record. Returns the number of spans written, or -1.
+ */
+int trace_dump(const char *path) {
+    if (!trace_active) return -1;
+    if (InterlockedCompareExchange(&trace_dumping, 1, 0) != 0) return -1;
+    
+    TraceEvent *events = (TraceEvent *)malloc(sizeof(TraceEvent) * TRACE_RING_EVENTS);
+    FILE *file = events != NULL ? fopen(path, "w") : NULL;
+    if (file == NULL) {
+        free(events);
+        InterlockedExchange(&trace_dumping, 0);
+        return -1;
+    }
+    
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"chat_server\"}}");
+    
+    int total = 0;
+    int count = trace_ring_count < TRACE_MAX_THREADS ? trace_ring_count : TRACE_MAX_THREADS;
+    for (int r = 0; r < count; r++) {
+        TraceRing *ring = trace_rings[r];
+        if (ring == NULL) continue;  // Still being registered
+        
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+            (unsigned long)ring->thread_id, ring->name);
+        
+        int spans = snapshot_ring(ring, events);
+        for (int i = 0; i < spans; i++) {
+            const TraceEvent *event = &events[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f",
+                stage_names[event->stage], (unsigned long)ring->thread_id,
+                ticks_to_us(event->start - trace_epoch), ticks_to_us(event->duration));
+            if (arg_names[event->stage] != NULL) {
+                fprintf(file, ",\"args\":{\"%s\":%d}", arg_names[event->stage], event->arg);
+            }
+            fputc('}', file);
+        }
+        total += spans;
+    }
+    
+    fprintf(file, "\n]}\n");
+    int failed = ferror(file);
+    fclose(file);
+    free(events);
+    InterlockedExchange(&trace_dumping, 0);
+    return failed ? -1 : total;
+}
+
+#else
+
+// Built without CHAT_TRACE: nothing is recorded
+int trace_start(void) { return -1; }
+void trace_stop(void) {}
+int trace_thread_start(const char *name) { (void)name; return 0; }
+LONG64 trace_now(void) { return 0; }
+void trace_record(TraceStage stage, LONG64 start, int arg) { (void)stage; (void)start; (void)arg; }
+int trace_dump(const char *path) { (void)path; return -1; }
+
+#endif // CHAT_TRACE
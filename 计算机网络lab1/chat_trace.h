@@ -0,0 +1,45 @@
+#ifndef CHAT_TRACE_H
+#define CHAT_TRACE_H
+
+#include "chat_protocol.h"
+
+// Hot-path tracing, compiled in with -DCHAT_TRACE. Each thread records
+// spans into its own ring, overwriting the oldest; trace_dump() copies the
+// rings out without stopping the writers and saves them as Chrome trace
+// JSON (chrome://tracing or ui.perfetto.dev). Without CHAT_TRACE the
+// TRACE_ macros expand to nothing.
+#define TRACE_RING_EVENTS 65536          // Spans kept per thread (power of two)
+#define TRACE_MAX_THREADS 128
+
+typedef enum {
+    TRACE_POLL,                          // WSAPoll wait, arg = ready sockets
+    TRACE_ACCEPT,                        // accept and register, arg = socket
+    TRACE_RECV,                          // recv call, arg = bytes
+    TRACE_PARSE,                         // framing_split of received bytes, arg = bytes split
+    TRACE_HANDSHAKE,                     // NICKNAME or RESUME handling, arg = socket
+    TRACE_DISPATCH,                      // handle_message, arg = message type
+    TRACE_FAN_OUT,                       // Queueing a frame on local connections, arg = queues
+    TRACE_INBOX,                         // Draining frames posted by other workers, arg = frames
+    TRACE_FLUSH,                         // WSASend of queued frames, arg = socket
+    TRACE_LOCK_WAIT,                     // Waiting for client_mutex
+    TRACE_STAGE_COUNT
+} TraceStage;
+
+#ifdef CHAT_TRACE
+extern volatile int trace_active;
+#define TRACE_BEGIN(start) LONG64 start = trace_active ? trace_now() : 0
+#define TRACE_END(start, stage, arg) do { if (start != 0) trace_record(stage, start, arg); } while (0)
+#else
+#define TRACE_BEGIN(start)
+#define TRACE_END(start, stage, arg) do { } while (0)
+#endif
+
+// Function prototypes
+int trace_start(void);
+void trace_stop(void);
+int trace_thread_start(const char *name);
+LONG64 trace_now(void);
+void trace_record(TraceStage stage, LONG64 start, int arg);
+int trace_dump(const char *path);
+
+#endif // CHAT_TRACE_H